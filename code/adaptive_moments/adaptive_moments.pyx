@@ -1,11 +1,14 @@
 from __future__ import print_function, division
-from math import atan2, cos, sin
+import os
 import numpy as np
 # "cimport" is used to import special compile-time information
 # about the numpy module (this is stored in a file numpy.pxd which is
 # currently part of the Cython distribution).
 cimport numpy as np
-from libc.math cimport sqrt, ceil, floor, exp
+from libc.math cimport sqrt, ceil, floor, fabs, atan2, cos, sin, NAN
+from libc.string cimport memset
+cimport cython
+from cython.parallel cimport prange
 
 
 pixel_to_arcsecond = 0.27
@@ -43,42 +46,76 @@ ctypedef np.float64_t DTYPE_t
 "large value to completely disable this optimization.\n"
 cdef double MAX_MOMENT_NSIG2 = 25.
 
-# cpdef NOT cdef !!
-cpdef np.ndarray[DTYPE_t, ndim=1] find_ellipmom_1(
-        np.ndarray[DTYPE_t, ndim=2] data,
-        double Mx, double My,
-        double Mxx, double Mxy, double Myy):
-    """C routine to obtain estimates of corrections to Mxx etc. Taken from
-    galsim."""
-
-
-    cdef DTYPE_t A = 0
-    cdef DTYPE_t Bx = 0
-    cdef DTYPE_t By = 0
-    cdef DTYPE_t Cxx = 0
-    cdef DTYPE_t Cxy = 0
-    cdef DTYPE_t Cyy = 0
-    cdef DTYPE_t Cxxx = 0
-    cdef DTYPE_t Cxxy = 0
-    cdef DTYPE_t Cxyy = 0
-    cdef DTYPE_t Cyyy = 0
-    cdef DTYPE_t rho4w = 0
-
-    cdef np.ndarray[DTYPE_t, ndim=1] return_array
-
-    cdef int xmin = 0
+cdef extern from "ellipmom.h" nogil:
+    enum:
+        ELLIPMOM_LANES
+        ELLIPMOM_NSUMS
+    void ellipmom_span_weights(int ix1, int ix2, double Mx, double Minv_xx,
+                               double TwoMinv_xy__y_My,
+                               double Minv_yy__y_My__y_My, double* wts)
+    void ellipmom_row_1(const double* row, const double* wts,
+                        int ix1, int ix2, int xread, double y_My,
+                        double Mx, double Minv_xx, double TwoMinv_xy__y_My,
+                        double Minv_yy__y_My__y_My, double* sums)
+    void ellipmom_row_orders(const double* row, const double* wts,
+                             int ix1, int ix2, int xread,
+                             int norders, const int* p, const double* y_My_q,
+                             int pmax, double Mx, double Minv_xx,
+                             double TwoMinv_xy__y_My,
+                             double Minv_yy__y_My__y_My,
+                             double* xpow, double* A, double* mu)
+    void ellipmom_sum_lanes(const double* sums, int nsums, double* out)
+
+# Flags set by the native routines when something went wrong with a stamp
+cdef enum:
+    NOT_POSDEF = 1  # moment matrix not positive definite
+    EMPTY = 2  # weight ellipse missed the image rows
+    NEG_WEIGHT = 4  # non positive-definite weight during iteration
+    MAX_ITER = 8  # stopped at num_iter_max without converging
+    ZERO_FLUX = 16  # no weighted flux (not positive, when iterating)
+ELLIPMOM_NOT_POSDEF = NOT_POSDEF
+ELLIPMOM_EMPTY = EMPTY
+ELLIPMOM_NEG_WEIGHT = NEG_WEIGHT
+ELLIPMOM_MAX_ITER = MAX_ITER
+ELLIPMOM_ZERO_FLUX = ZERO_FLUX
+
+# The elliptical Gaussian weight of a moment matrix, cut off at
+# MAX_MOMENT_NSIG2, and the image rows iy1 <= y < iy2 that it covers
+cdef struct weight_ellipse:
+    double Mx, My
+    double Minv_xx, TwoMinv_xy, Minv_yy, Inv2Minv_xx
+    int iy1, iy2
+
+# The pixels ix1 <= x < ix2 of one row inside the weight ellipse
+cdef struct weight_row:
+    double y_My, TwoMinv_xy__y_My, Minv_yy__y_My__y_My
+    int ix1, ix2
+
+# The weights of a weight_ellipse, kept by WeightStencil. Those of row y
+# start at wts[start[y - iy1]]
+cdef struct weight_stencil:
+    const double* wts
+    const Py_ssize_t* start
+
+@cython.cdivision(True)
+cdef int _weight_ellipse(double Mx, double My,
+                         double Mxx, double Mxy, double Myy,
+                         int ymax, weight_ellipse* e) noexcept nogil:
+    """Fills e for an image with ymax rows. Returns ELLIPMOM flags."""
+
+    cdef int flags = 0
     cdef int ymin = 0
-    cdef int ymax = data.shape[0]
-    cdef int xmax = data.shape[1]
 
     cdef double detM = Mxx * Myy - Mxy * Mxy
-    if (detM <= 0) + (Mxx <= 0) + (Myy <= 0):
-        print("Error: non positive definite adaptive moments!\n")
+    if (detM <= 0) or (Mxx <= 0) or (Myy <= 0):
+        flags |= NOT_POSDEF
 
-    cdef double Minv_xx = Myy / detM
-    cdef double TwoMinv_xy = -Mxy / detM * 2.0
-    cdef double Minv_yy = Mxx / detM
-    cdef double Inv2Minv_xx = 0.5 / Minv_xx  # Will be useful later...
+    e.Mx = Mx
+    e.My = My
+    e.Minv_xx = Myy / detM
+    e.TwoMinv_xy = -Mxy / detM * 2.0
+    e.Minv_yy = Mxx / detM
+    e.Inv2Minv_xx = 0.5 / e.Minv_xx  # Will be useful later...
 
     # rho2 = Minv_xx(x-Mx)^2 + 2Minv_xy(x-Mx)(y-My) + Minv_yy(y-My)^2
     # The minimum/maximum y that have a solution rho2 = max_moment_nsig2 is at:
@@ -93,142 +130,302 @@ cpdef np.ndarray[DTYPE_t, ndim=1] find_ellipmom_1(
     #
     # we are finding the limits for the iy values and then the ix values.
     cdef double y_My = sqrt(MAX_MOMENT_NSIG2 * Myy)
-    # nan check!
-    if y_My != y_My:
-        return_array = \
-            np.array([A, Bx, By, Cxx, Cxy, Cyy, rho4w,
-                      Cxxx, Cxxy, Cxyy, Cyyy
-                      ], dtype=DTYPE)
-        return return_array
+    e.iy1 = 0
+    e.iy2 = 0
+    # nan check! leaves all the moments at zero
+    if y_My == y_My:
+        # stay within image bounds
+        e.iy1 = max(<int>(ceil(-y_My + My)), ymin)
+        e.iy2 = min(<int>(floor(y_My + My)), ymax)
+        if e.iy1 > e.iy2:
+            flags |= EMPTY
+    return flags
 
-    cdef double y1 = -y_My + My
-    cdef double y2 = y_My + My
+cdef bint _weight_row(const weight_ellipse* e, int y, int xmax,
+                      weight_row* r) noexcept nogil:
+    """Fills r for row y of an image with xmax columns. Returns False if
+    none of its pixels are inside the ellipse."""
 
-    # stay within image bounds
-    cdef int iy1 = max(<int>(ceil(y1)), ymin)
-    cdef int iy2 = min(<int>(floor(y2)), ymax)
-    cdef int y
+    cdef int xmin = 0
+    cdef double a, b, c, d, sqrtd, x1, x2
 
-    if iy1 > iy2:
-        print('iy1 > iy2', y1, ymin, y2, ymax, iy1, iy2)
+    r.y_My = <double>y - e.My
+    r.TwoMinv_xy__y_My = e.TwoMinv_xy * r.y_My
+    r.Minv_yy__y_My__y_My = e.Minv_yy * r.y_My * r.y_My
 
-    cdef double a, b, c, d, sqrtd, inv2a, x1, x2, x_Mx, \
-        Minv_xx__x_Mx__x_Mx, rho2, intensity, TwoMinv_xy__y_My, Minv_yy__y_My__y_My
-    cdef int ix1, ix2, x
+    # Now for a particular value of y, we want to find the min/max x that satisfy
+    # rho2 < max_moment_nsig2.
+    #
+    # 0 = Minv_xx(x-Mx)^2 + 2Minv_xy(x-Mx)(y-My) + Minv_yy(y-My)^2 - max_moment_nsig2
+    # Simple quadratic formula:
+
+    a = e.Minv_xx
+    b = r.TwoMinv_xy__y_My
+    c = r.Minv_yy__y_My__y_My - MAX_MOMENT_NSIG2
+    d = b * b - 4 * a * c
+    sqrtd = sqrt(d)
+    x1 = e.Inv2Minv_xx * (-b - sqrtd) + e.Mx
+    x2 = e.Inv2Minv_xx * (-b + sqrtd) + e.Mx
+
+    # stay within image bounds
+    r.ix1 = max(<int>(ceil(x1)), xmin)
+    r.ix2 = min(<int>(floor(x2)), xmax)
+    # in the following two cases, ask if we somehow wanted to find
+    # pixels outside the image
+    if (r.ix1 > xmax) and (r.ix2 == xmax):
+        return False
+    elif (r.ix1 == xmin) and (r.ix2 < xmin):
+        return False
+    elif r.ix1 > r.ix2:
+        # usually what happens is you want to take only one pixel and you
+        # end up due to the ceil and floor funcs with e.g. 15, 14 instead
+        # of 14, 15
+        return False
+    return True
+
+cdef inline const double* _stencil_row(const weight_stencil* s,
+                                       const weight_ellipse* e,
+                                       int y) noexcept nogil:
+    """The stored weights of row y, or NULL to compute them."""
+    if s == NULL:
+        return NULL
+    return s.wts + s.start[y - e.iy1]
+
+cdef int _ellipmom_1(const double* data, int ymax, int xmax,
+                     double Mx, double My,
+                     double Mxx, double Mxy, double Myy,
+                     const weight_stencil* s,
+                     double* moments) noexcept nogil:
+    """find_ellipmom_1 on a C-ordered ymax x xmax image, without the GIL.
+
+    Fills moments with A, Bx, By, Cxx, Cxy, Cyy, rho4w, Cxxx, Cxxy, Cxyy,
+    Cyyy and returns the ELLIPMOM flags instead of printing. The pixels of
+    each row are weighted and summed in vector lanes by ellipmom_row_1,
+    with the weights from s if it is not NULL.
+    """
 
-    for y in xrange(iy1, iy2):
+    cdef weight_ellipse e
+    cdef weight_row r
+    cdef double sums[ELLIPMOM_NSUMS * ELLIPMOM_LANES]
+    cdef int y
+    cdef int flags = _weight_ellipse(Mx, My, Mxx, Mxy, Myy, ymax, &e)
+
+    memset(sums, 0, sizeof(sums))
+    for y in range(e.iy1, e.iy2):
+        if _weight_row(&e, y, xmax, &r):
+            # y,x order!
+            ellipmom_row_1(data + <Py_ssize_t>y * xmax, _stencil_row(s, &e, y),
+                           r.ix1, r.ix2, (ymax - y) * xmax, r.y_My,
+                           Mx, e.Minv_xx, r.TwoMinv_xy__y_My,
+                           r.Minv_yy__y_My__y_My, sums)
+    ellipmom_sum_lanes(sums, ELLIPMOM_NSUMS, moments)
+    return flags
 
-        y_My = float(y) - My
-        TwoMinv_xy__y_My = TwoMinv_xy * y_My
-        Minv_yy__y_My__y_My = Minv_yy * y_My ** 2
+# cpdef NOT cdef !!
+cpdef np.ndarray[DTYPE_t, ndim=1] find_ellipmom_1(
+        np.ndarray[DTYPE_t, ndim=2] data,
+        double Mx, double My,
+        double Mxx, double Mxy, double Myy):
+    """C routine to obtain estimates of corrections to Mxx etc. Taken from
+    galsim.
 
-        # Now for a particular value of y, we want to find the min/max x that satisfy
-        # rho2 < max_moment_nsig2.
-        #
-        # 0 = Minv_xx(x-Mx)^2 + 2Minv_xy(x-Mx)(y-My) + Minv_yy(y-My)^2 - max_moment_nsig2
-        # Simple quadratic formula:
+    Returns A, Bx, By, Cxx, Cxy, Cyy, rho4w, Cxxx, Cxxy, Cxyy, Cyyy."""
 
-        a = Minv_xx
-        b = TwoMinv_xy__y_My
-        c = Minv_yy__y_My__y_My - MAX_MOMENT_NSIG2
-        d = b * b - 4 * a * c
-        sqrtd = sqrt(d)
-        inv2a = Inv2Minv_xx
-        x1 = inv2a * (-b - sqrtd) + Mx
-        x2 = inv2a * (-b + sqrtd) + Mx
+    cdef np.ndarray[DTYPE_t, ndim=2, mode='c'] cdata = np.ascontiguousarray(data)
+    cdef np.ndarray[DTYPE_t, ndim=1] return_array = np.zeros(11, dtype=DTYPE)
+    cdef int flags = _ellipmom_1(&cdata[0, 0], cdata.shape[0], cdata.shape[1],
+                                 Mx, My, Mxx, Mxy, Myy, NULL,
+                                 &return_array[0])
 
-        # stay within image bounds
-        ix1 = max(<int>(ceil(x1)), xmin)
-        ix2 = min(<int>(floor(x2)), xmax)
-        # in the following two cases, ask if we somehow wanted to find
-        # pixels outside the image
-        if (ix1 > xmax) * (ix2 == xmax):
-            continue
-        elif (ix1 == xmin) * (ix2 < xmin):
-            continue
-        elif ix1 > ix2:
-            # print('ix1 > ix2', y, x1, xmin, x2, xmax, ix1, ix2)
-            # usually what happens is you want to take only one pixel and you
-            # end up due to the ceil and floor funcs with e.g. 15, 14 instead
-            # of 14, 15
-            # ix1, ix2 = ix2, ix1
-            # ix1 = max(ix1, xmin)
-            # ix2 = min(ix2, xmax)
-            continue
-
-        for x in xrange(ix1, ix2):
-
-            x_Mx = float(x) - Mx
-
-            # Compute displacement from weight centroid, then get elliptical
-            # radius and weight.
-            Minv_xx__x_Mx__x_Mx = Minv_xx * x_Mx ** 2
-            rho2 = Minv_yy__y_My__y_My + \
-                TwoMinv_xy__y_My * x_Mx + \
-                Minv_xx__x_Mx__x_Mx
-
-            # this shouldn't happen by construction
-            if (rho2 > MAX_MOMENT_NSIG2 + 1e8):
-                print('rho2 > max_moment_nsig2 !')
-                continue
-
-            intensity = exp(-0.5 * rho2) * data[y, x]  # y,x order!
-
-            A += intensity
-            Bx += intensity * x_Mx
-            By += intensity * y_My
-            Cxx += intensity * x_Mx ** 2
-            Cxy += intensity * x_Mx * y_My
-            Cyy += intensity * y_My ** 2
-            Cxxx += intensity * x_Mx ** 3
-            Cxxy += intensity * x_Mx ** 2 * y_My
-            Cxyy += intensity * x_Mx * y_My ** 2
-            Cyyy += intensity * y_My ** 3
-            rho4w += intensity * rho2 * rho2
-
-    return_array = \
-        np.array([A, Bx, By, Cxx, Cxy, Cyy, rho4w,
-                  Cxxx, Cxxy, Cxyy, Cyyy
-                  ], dtype=DTYPE)
+    _print_flags(flags, data.shape[0], My, Myy)
     return return_array
 
-def adaptive_moments(data,
-    epsilon = 1e-6,
-    convergence_factor = 1.0,
-    guess_sig = 3.0,
-    bound_correct_wt = 0.25,  # Maximum shift in centroids and sigma between
-                             # iterations for adaptive moments.
-    guess_centroid = None,
-    num_iter = 0,
-    num_iter_max = 100,
-    **kwargs
-    ):
+def _print_flags(flags, ymax, My, Myy):
+    # the warnings of the python versions of find_ellipmom_1 and
+    # centered_moment
+    if flags & NOT_POSDEF:
+        print("Error: non positive definite adaptive moments!\n")
+    if flags & EMPTY:
+        y_My = sqrt(MAX_MOMENT_NSIG2 * Myy)
+        print('iy1 > iy2', My - y_My, 0, My + y_My, ymax,
+              max(<int>(ceil(My - y_My)), 0),
+              min(<int>(floor(My + y_My)), ymax))
+    if flags & ZERO_FLUX:
+        print("Error: zero weighted flux, the moments are nan.\n")
+
+cdef inline double _bound(double d, double bound_correct_wt) noexcept nogil:
+    if d > bound_correct_wt:
+        return bound_correct_wt
+    if d < -bound_correct_wt:
+        return -bound_correct_wt
+    return d
+
+@cython.cdivision(True)
+cdef bint _newton_step(const double* m, double Mxx, double Mxy, double Myy,
+                       double* step) noexcept nogil:
+    """Newton step in (Mx, My, Mxx, Mxy, Myy) towards B = 0 and C/A = M/2.
+
+    m is the output of find_ellipmom_1 at the current weight. The Jacobian
+    takes the derivatives of A, B, C with respect to the weight from the
+    third moments, and the fourth moments from the Gaussian (Isserlis)
+    estimate scaled to match rho4. For a Gaussian it reduces to the usual
+    step. Returns False, leaving step alone, if the system is singular.
+    """
 
-    # Set Amp = -1000 as initial value just in case the while() block below is
-    # never triggered; in this case we have at least *something* defined to
-    # divide by, and for which the output will fairly clearly be junk.
-    Amp = -1000.
-    if type(guess_centroid) == type(None):
-        Mx = data.shape[1] / 2.
-        My = data.shape[0] / 2.
-    else:
-        Mx = guess_centroid[0]
-        My = guess_centroid[1]
-    Mxx = guess_sig ** 2
-    Mxy = 0
-    Myy = guess_sig ** 2
+    cdef double A = m[0]
+    cdef double det = Mxx * Myy - Mxy * Mxy
+    cdef double N[2][2]
+    cdef double b[2]
+    cdef double c[2][2]
+    cdef double t[4]  # xxx, xxy, xyy, yyy by the number of y's
+    cdef double cN[2][2]
+    cdef double NcN[2][2]
+    cdef double M[3]
+    cdef double dA[5]
+    cdef double J[5][6]
+    cdef double lam, trNc, trNcNc, q, s, piv
+    cdef int pair[5][2]
+    cdef int r, p, i, j, k, l, n, ia, ib, best
+
+    if not (A > 0 and det > 0):
+        return False
+
+    M[0] = Mxx
+    M[1] = Mxy
+    M[2] = Myy
+    N[0][0] = Myy / det
+    N[0][1] = N[1][0] = -Mxy / det
+    N[1][1] = Mxx / det
+    b[0] = m[1] / A
+    b[1] = m[2] / A
+    c[0][0] = m[3] / A
+    c[0][1] = c[1][0] = m[4] / A
+    c[1][1] = m[5] / A
+    for i in range(4):
+        t[i] = m[7 + i] / A
+    for i in range(2):
+        for j in range(2):
+            cN[i][j] = c[i][0] * N[0][j] + c[i][1] * N[1][j]
+    for i in range(2):
+        for j in range(2):
+            NcN[i][j] = N[i][0] * cN[0][j] + N[i][1] * cN[1][j]
+    trNc = cN[0][0] + cN[1][1]
+    trNcNc = cN[0][0] * cN[0][0] + 2 * cN[0][1] * cN[1][0] + cN[1][1] * cN[1][1]
+    lam = (m[6] / A) / (trNc * trNc + 2 * trNcNc)
+
+    # parameters 2, 3, 4 and residuals 2, 3, 4 are the xx, xy, yy entries
+    pair[2][0] = 0; pair[2][1] = 0
+    pair[3][0] = 0; pair[3][1] = 1
+    pair[4][0] = 1; pair[4][1] = 1
+
+    # derivatives of log A
+    for p in range(2):
+        dA[p] = N[p][0] * b[0] + N[p][1] * b[1]
+    for p in range(2, 5):
+        ia = pair[p][0]
+        ib = pair[p][1]
+        dA[p] = (1 + (ia != ib)) * 0.5 * NcN[ia][ib]
+
+    for r in range(5):
+        for p in range(5):
+            if p < 2:
+                if r < 2:
+                    # dB_r / dMp
+                    s = cN[r][p] - (r == p)
+                else:
+                    # dC_ij / dMp
+                    i = pair[r][0]
+                    j = pair[r][1]
+                    s = -(i == p) * b[j] - (j == p) * b[i]
+                    for l in range(2):
+                        s += t[i + j + l] * N[l][p]
+            else:
+                ia = pair[p][0]
+                ib = pair[p][1]
+                s = 0
+                for l in range(2):
+                    for n in range(2):
+                        if r < 2:
+                            q = t[r + l + n]
+                        else:
+                            i = pair[r][0]
+                            j = pair[r][1]
+                            q = lam * (c[i][j] * c[l][n] + c[i][l] * c[j][n] +
+                                       c[i][n] * c[j][l])
+                        s += q * N[l][ia] * N[n][ib]
+                s *= (1 + (ia != ib)) * 0.5
+            if r < 2:
+                J[r][p] = s - b[r] * dA[p]
+            else:
+                J[r][p] = s - c[pair[r][0]][pair[r][1]] * dA[p] - 0.5 * (r == p)
+        # right hand side, minus the residual
+        if r < 2:
+            J[r][5] = -b[r]
+        else:
+            J[r][5] = 0.5 * M[r - 2] - c[pair[r][0]][pair[r][1]]
+
+    # Gaussian elimination with partial pivoting
+    for k in range(5):
+        best = k
+        for r in range(k + 1, 5):
+            if fabs(J[r][k]) > fabs(J[best][k]):
+                best = r
+        if not (fabs(J[best][k]) > 1e-300):
+            return False
+        if best != k:
+            for p in range(k, 6):
+                J[k][p], J[best][p] = J[best][p], J[k][p]
+        for r in range(k + 1, 5):
+            piv = J[r][k] / J[k][k]
+            for p in range(k, 6):
+                J[r][p] -= piv * J[k][p]
+    for k in range(4, -1, -1):
+        s = J[k][5]
+        for p in range(k + 1, 5):
+            s -= J[k][p] * step[p]
+        step[k] = s / J[k][k]
+        if not (fabs(step[k]) < 1e300):
+            return False
+    return True
+
+@cython.cdivision(True)
+cdef int _adaptive_moments_1(const double* data, int ymax, int xmax,
+                             double epsilon, double convergence_factor,
+                             double bound_correct_wt,
+                             int num_iter, int num_iter_max, bint newton,
+                             double* result, int* iterations) noexcept nogil:
+    """The adaptive_moments iteration on one C-ordered image, without the GIL.
+
+    result holds the starting Mx, My, Mxx, Mxy, Myy on input and the 14
+    values returned by adaptive_moments on output. Returns ELLIPMOM flags.
+    If the weighted flux A is not positive, that has ZERO_FLUX and the
+    result is nan but for A.
+    """
+
+    cdef double Mx = result[0]
+    cdef double My = result[1]
+    cdef double Mxx = result[2]
+    cdef double Mxy = result[3]
+    cdef double Myy = result[4]
+    cdef double m[11]
+    cdef double step[5]
+    cdef double Amp, two_psi, semi_a2, semi_b2, shiftscale, shiftscale0 = 0
+    cdef double dx, dy, dxx, dxy, dyy
+    cdef int first = 1
+    cdef int flags = 0
+    cdef int k
 
     # Iterate until we converge
-    while (convergence_factor > epsilon) * (num_iter < num_iter_max):
-        # print(Mx, My, Mxx, Mxy, Myy, num_iter)
+    while (convergence_factor > epsilon) and (num_iter < num_iter_max):
 
         # Get moments
-        Amp, Bx, By, Cxx, Cxy, Cyy, rho4, \
-            Cxxx, Cxxy, Cxyy, Cyyy \
-            = find_ellipmom_1(data, Mx, My, Mxx, Mxy, Myy)
-        # print(num_iter)
-        # print(Amp, Bx / Amp, By / Amp, Cxx / Amp, Cxy / Amp, Cyy / Amp, rho4 / Amp)
-        # print(Mx, My, Mxx, Mxy, Myy)
+        flags |= _ellipmom_1(data, ymax, xmax, Mx, My, Mxx, Mxy, Myy, NULL, m)
+        Amp = m[0]
+        if not (Amp > 0):
+            # e.g. a blank stamp, or the weight has left the image
+            flags |= ZERO_FLUX
+            break
+
         # Compute configuration of the weight function
         two_psi = atan2(2 * Mxy, Mxx - Myy)
         semi_a2 = 0.5 * ((Mxx + Myy) + (Mxx - Myy) * cos(two_psi)) + \
@@ -236,41 +433,38 @@ def adaptive_moments(data,
         semi_b2 = Mxx + Myy - semi_a2
 
         if semi_b2 <= 0:
-            print("Error: non positive-definite weight in find_ellipmom_2.\n")
+            flags |= NEG_WEIGHT
 
         shiftscale = sqrt(semi_b2)
-        if num_iter == 0:
+        if first:
             shiftscale0 = shiftscale
+            first = 0
 
         # Now compute changes to Mx, etc
-        dx = 2. * Bx / (Amp * shiftscale)
-        dy = 2. * By / (Amp * shiftscale)
-        dxx = 4. * (Cxx / Amp - 0.5 * Mxx) / semi_b2
-        dxy = 4. * (Cxy / Amp - 0.5 * Mxy) / semi_b2
-        dyy = 4. * (Cyy / Amp - 0.5 * Myy) / semi_b2
-
-        if (dx     >  bound_correct_wt): dx     =  bound_correct_wt
-        if (dx     < -bound_correct_wt): dx     = -bound_correct_wt
-        if (dy     >  bound_correct_wt): dy     =  bound_correct_wt
-        if (dy     < -bound_correct_wt): dy     = -bound_correct_wt
-        if (dxx    >  bound_correct_wt): dxx    =  bound_correct_wt
-        if (dxx    < -bound_correct_wt): dxx    = -bound_correct_wt
-        if (dxy    >  bound_correct_wt): dxy    =  bound_correct_wt
-        if (dxy    < -bound_correct_wt): dxy    = -bound_correct_wt
-        if (dyy    >  bound_correct_wt): dyy    =  bound_correct_wt
-        if (dyy    < -bound_correct_wt): dyy    = -bound_correct_wt
+        if newton and _newton_step(m, Mxx, Mxy, Myy, step):
+            dx = _bound(step[0] / shiftscale, bound_correct_wt)
+            dy = _bound(step[1] / shiftscale, bound_correct_wt)
+            dxx = _bound(step[2] / semi_b2, bound_correct_wt)
+            dxy = _bound(step[3] / semi_b2, bound_correct_wt)
+            dyy = _bound(step[4] / semi_b2, bound_correct_wt)
+        else:
+            dx = _bound(2. * m[1] / (Amp * shiftscale), bound_correct_wt)
+            dy = _bound(2. * m[2] / (Amp * shiftscale), bound_correct_wt)
+            dxx = _bound(4. * (m[3] / Amp - 0.5 * Mxx) / semi_b2, bound_correct_wt)
+            dxy = _bound(4. * (m[4] / Amp - 0.5 * Mxy) / semi_b2, bound_correct_wt)
+            dyy = _bound(4. * (m[5] / Amp - 0.5 * Myy) / semi_b2, bound_correct_wt)
 
         # Convergence tests
-        convergence_factor = abs(dx) ** 2
-        if (abs(dy) > convergence_factor):
-            convergence_factor = abs(dy) ** 2
-        if (abs(dxx) > convergence_factor):
-            convergence_factor = abs(dxx)
-        if (abs(dxy) > convergence_factor):
-            convergence_factor = abs(dxy)
-        if (abs(dyy) > convergence_factor):
-            convergence_factor = abs(dyy)
-        convergence_factor = np.sqrt(convergence_factor)
+        convergence_factor = dx * dx
+        if (fabs(dy) > convergence_factor):
+            convergence_factor = dy * dy
+        if (fabs(dxx) > convergence_factor):
+            convergence_factor = fabs(dxx)
+        if (fabs(dxy) > convergence_factor):
+            convergence_factor = fabs(dxy)
+        if (fabs(dyy) > convergence_factor):
+            convergence_factor = fabs(dyy)
+        convergence_factor = sqrt(convergence_factor)
         if (shiftscale < shiftscale0):
             convergence_factor *= shiftscale0 / shiftscale
 
@@ -283,23 +477,294 @@ def adaptive_moments(data,
 
         num_iter += 1
 
+    if convergence_factor > epsilon and not (flags & ZERO_FLUX):
+        flags |= MAX_ITER
+
     # we made it! do a final calculation
-    Amp, Bx, By, Cxx, Cxy, Cyy, rho4, \
-        Cxxx, Cxxy, Cxyy, Cyyy \
-        = find_ellipmom_1(data, Mx, My, Mxx, Mxy, Myy)
+    flags |= _ellipmom_1(data, ymax, xmax, Mx, My, Mxx, Mxy, Myy, NULL, m)
+    Amp = m[0]
+    iterations[0] = num_iter
+    if not (Amp > 0):
+        flags |= ZERO_FLUX
+    if flags & ZERO_FLUX:
+        for k in range(14):
+            result[k] = NAN
+        result[5] = Amp
+        return flags
+
+    result[0] = Mx
+    result[1] = My
+    result[2] = Mxx
+    result[3] = Mxy
+    result[4] = Myy
+    result[5] = Amp
+    result[6] = m[6] / Amp
+    result[7] = m[3] / Amp
+    result[8] = m[4] / Amp
+    result[9] = m[5] / Amp
+    result[10] = m[7] / Amp
+    result[11] = m[8] / Amp
+    result[12] = m[9] / Amp
+    result[13] = m[10] / Amp
+    return flags
 
-    A = Amp
-    rho4 /= Amp
-    x2 = Cxx / Amp
-    xy = Cxy / Amp
-    y2 = Cyy / Amp
-    x3 = Cxxx / Amp
-    x2y = Cxxy / Amp
-    xy2 = Cxyy / Amp
-    y3 = Cyyy / Amp
+def adaptive_moments(data,
+    epsilon = 1e-6,
+    convergence_factor = 1.0,
+    guess_sig = 3.0,
+    bound_correct_wt = 0.25,  # Maximum shift in centroids and sigma between
+                             # iterations for adaptive moments.
+    guess_centroid = None,
+    num_iter = 0,
+    num_iter_max = 100,
+    newton = False,  # Newton steps, using the third and fourth moments
+    **kwargs
+    ):
 
-    return Mx, My, Mxx, Mxy, Myy, A, rho4, x2, xy, y2, x3, x2y, xy2, y3
+    cdef np.ndarray[DTYPE_t, ndim=2, mode='c'] cdata = \
+        np.ascontiguousarray(data, dtype=DTYPE)
+    cdef np.ndarray[DTYPE_t, ndim=1] result = \
+        np.zeros(len(moment_names), dtype=DTYPE)
+    cdef int iterations = 0
+    cdef int flags
 
+    if type(guess_centroid) == type(None):
+        result[0] = cdata.shape[1] / 2.
+        result[1] = cdata.shape[0] / 2.
+    else:
+        result[0] = guess_centroid[0]
+        result[1] = guess_centroid[1]
+    result[2] = guess_sig ** 2
+    result[4] = guess_sig ** 2
+
+    # the iteration itself runs in _adaptive_moments_1, which raises the
+    # warnings as flags; they are printed once here
+    flags = _adaptive_moments_1(&cdata[0, 0], cdata.shape[0], cdata.shape[1],
+                                epsilon, convergence_factor, bound_correct_wt,
+                                num_iter, num_iter_max, newton,
+                                &result[0], &iterations)
+    _print_flags(flags, cdata.shape[0], result[1], result[4])
+    if flags & NEG_WEIGHT:
+        print("Error: non positive-definite weight in find_ellipmom_2.\n")
+
+    return tuple(result)
+
+
+# names of the values returned by adaptive_moments, in order
+moment_names = ('Mx', 'My', 'Mxx', 'Mxy', 'Myy', 'A', 'rho4',
+                'x2', 'xy', 'y2', 'x3', 'x2y', 'xy2', 'y3')
+moments_dtype = np.dtype([(name, DTYPE) for name in moment_names] +
+                         [('num_iter', np.int32), ('flags', np.int32)])
+
+# with warm_start, adaptive_moments_batch chains the stamps in runs of this
+# many, so that the result does not depend on the number of threads
+WARM_START_RUN = 64
+
+def starting_moments(moments):
+    """(Mx, My, Mxx, Mxy, Myy) of earlier results, as a (k, 5) array
+
+    moments can be anything indexed by those names: the output of
+    adaptive_moments_batch, a dict, or a DataFrame from Moment_Evaluator.
+    """
+    return np.stack([np.asarray(moments[name], dtype=DTYPE).reshape(-1)
+                     for name in moment_names[:5]], axis=-1)
+
+@cython.boundscheck(False)
+@cython.wraparound(False)
+def adaptive_moments_batch(stamps,
+    epsilon = 1e-6,
+    convergence_factor = 1.0,
+    guess_sig = 3.0,
+    bound_correct_wt = 0.25,
+    guess_centroid = None,
+    num_iter = 0,
+    num_iter_max = 100,
+    nthreads = 0,
+    guess_moments = None,
+    warm_start = False,
+    newton = False,
+    **kwargs
+    ):
+    """Run adaptive_moments on every stamp of a stack, in parallel
+
+    Parameters
+    ----------
+    stamps : array
+        (N, H, W) stack of postage stamps, in y,x order like adaptive_moments.
+
+    guess_centroid : array, optional
+        Starting (Mx, My), either one pair for all stamps or an (N, 2) array.
+        Defaults to the centre of the stamps.
+
+    guess_moments : array, optional
+        Starting (Mx, My, Mxx, Mxy, Myy) in place of guess_centroid and
+        guess_sig, either one set for all stamps or an (N, 5) array, or an
+        earlier result (see starting_moments). Stamps that differ little from
+        the one it came from then converge in an iteration or two.
+
+    warm_start : bool
+        Start each stamp from the solution of the one before it, which is
+        good for a series of similar stamps. The first stamp of each run of
+        WARM_START_RUN, so that the runs can go in parallel, and those after a
+        stamp with flags set, start from the guess.
+
+    nthreads : int
+        Number of OpenMP threads, all cores if <= 0. Only used when the module
+        was compiled with OpenMP.
+
+    newton : bool
+        Update the weight by Newton steps, which take the third moments of the
+        stamp into account as well as the second, rather than the fixed-point
+        update for a Gaussian. This needs fewer iterations when the profile is
+        not Gaussian, and falls back to the usual step when the Newton system
+        is singular.
+
+    The other parameters are those of adaptive_moments.
+
+    Returns
+    -------
+    moments : structured array
+        N records with the fields of moment_names, the number of iterations
+        taken (num_iter), and any ELLIPMOM flags raised along the way (flags)
+        in place of the warnings adaptive_moments prints. A stamp with
+        ELLIPMOM_ZERO_FLUX, such as a blank one, has nan moments.
+
+    """
+    stamps = np.ascontiguousarray(stamps, dtype=DTYPE)
+    if stamps.ndim != 3 or stamps.shape[1] == 0 or stamps.shape[2] == 0:
+        raise ValueError('stamps must be a non-empty (N, H, W) array')
+    cdef Py_ssize_t nstamps = stamps.shape[0]
+    cdef int ymax = stamps.shape[1]
+    cdef int xmax = stamps.shape[2]
+    if nthreads <= 0:
+        nthreads = os.cpu_count() or 1
+    cdef int num_threads = max(1, min(nthreads, nstamps))
+
+    results = np.zeros((nstamps, len(moment_names)), dtype=DTYPE)
+    if guess_centroid is None:
+        results[:, 0] = xmax / 2.
+        results[:, 1] = ymax / 2.
+    else:
+        results[:, :2] = guess_centroid
+    results[:, 2] = guess_sig ** 2
+    results[:, 4] = guess_sig ** 2
+    if guess_moments is not None:
+        if not isinstance(guess_moments, np.ndarray) or guess_moments.dtype.names:
+            guess_moments = starting_moments(guess_moments)
+        results[:, :5] = guess_moments
+    iterations = np.zeros(nstamps, dtype=np.int32)
+    flags = np.zeros(nstamps, dtype=np.int32)
+
+    cdef double[:, :, ::1] data = stamps
+    cdef double[:, ::1] result = results
+    cdef int[::1] iters = iterations
+    cdef int[::1] flag = flags
+    cdef double eps = epsilon
+    cdef double conv = convergence_factor
+    cdef double bound = bound_correct_wt
+    cdef int n_iter = num_iter
+    cdef int n_iter_max = num_iter_max
+    cdef bint use_newton = newton
+    cdef Py_ssize_t run = WARM_START_RUN if warm_start else 1
+    cdef Py_ssize_t nruns = (nstamps + run - 1) // run
+    cdef Py_ssize_t i, k, m
+
+    for k in prange(nruns, nogil=True, schedule='dynamic',
+                    num_threads=num_threads):
+        for i in range(k * run, min(nstamps, (k + 1) * run)):
+            # a stamp that had trouble does not pass on its solution
+            if i > k * run and flag[i - 1] == 0:
+                for m in range(5):
+                    result[i, m] = result[i - 1, m]
+            flag[i] = _adaptive_moments_1(&data[i, 0, 0], ymax, xmax,
+                                          eps, conv, bound, n_iter, n_iter_max,
+                                          use_newton, &result[i, 0], &iters[i])
+
+    moments = np.empty(nstamps, dtype=moments_dtype)
+    for j, name in enumerate(moment_names):
+        moments[name] = results[:, j]
+    moments['num_iter'] = iterations
+    moments['flags'] = flags
+    return moments
+
+cdef inline Py_ssize_t _centered_moments_work(int norders, int pmax,
+                                              int qmax) noexcept nogil:
+    """Number of doubles of work space _centered_moments needs."""
+    return (1 + norders + pmax + 1) * ELLIPMOM_LANES + qmax + 1 + norders
+
+@cython.cdivision(True)
+cdef int _centered_moments(const double* data, int ymax, int xmax,
+                           int norders, const int* p, const int* q,
+                           double Mx, double My,
+                           double Mxx, double Mxy, double Myy,
+                           const weight_stencil* s, double* work,
+                           double* sum_A, double* mu_pq) noexcept nogil:
+    """centered_moments on a C-ordered ymax x xmax image, without the GIL.
+
+    Sets mu_pq[k] for the orders p[k], q[k], which are zero if the weight is
+    nan, and the sum of the weighted pixels in sum_A unless it is NULL.
+    Returns the ELLIPMOM flags instead of printing, with ZERO_FLUX and nan
+    moments if that sum is zero. work holds
+    _centered_moments_work doubles. Each pixel is weighted once, with the
+    weights from s if it is not NULL, and each of its orders then takes one
+    multiply-add (see ellipmom_row_orders).
+    """
+
+    cdef weight_ellipse e
+    cdef weight_row r
+    cdef double* A
+    cdef double* mu
+    cdef double* xpow
+    cdef double* ypow
+    cdef double* y_My_q
+    cdef double A_total
+    cdef int y, k
+    cdef int pmax = 0
+    cdef int qmax = 0
+    cdef int flags = _weight_ellipse(Mx, My, Mxx, Mxy, Myy, ymax, &e)
+
+    # nan check! as in _weight_ellipse
+    if not (Myy >= 0):
+        for k in range(norders):
+            mu_pq[k] = 0
+        if sum_A != NULL:
+            sum_A[0] = 0
+        return flags
+
+    for k in range(norders):
+        pmax = max(pmax, p[k])
+        qmax = max(qmax, q[k])
+    A = work
+    mu = A + ELLIPMOM_LANES
+    xpow = mu + norders * ELLIPMOM_LANES
+    ypow = xpow + (pmax + 1) * ELLIPMOM_LANES
+    y_My_q = ypow + qmax + 1
+    memset(A, 0, (1 + norders) * ELLIPMOM_LANES * sizeof(double))
+    ypow[0] = 1
+    for y in range(e.iy1, e.iy2):
+        if _weight_row(&e, y, xmax, &r):
+            for k in range(1, qmax + 1):
+                ypow[k] = ypow[k - 1] * r.y_My
+            for k in range(norders):
+                y_My_q[k] = ypow[q[k]]
+            # y,x order!
+            ellipmom_row_orders(data + <Py_ssize_t>y * xmax,
+                                _stencil_row(s, &e, y), r.ix1, r.ix2,
+                                (ymax - y) * xmax, norders, p, y_My_q, pmax,
+                                Mx, e.Minv_xx, r.TwoMinv_xy__y_My,
+                                r.Minv_yy__y_My__y_My, xpow, A, mu)
+    ellipmom_sum_lanes(A, 1, &A_total)
+    ellipmom_sum_lanes(mu, norders, mu_pq)
+    if A_total == 0:
+        flags |= ZERO_FLUX
+        for k in range(norders):
+            mu_pq[k] = NAN
+    else:
+        for k in range(norders):
+            mu_pq[k] /= A_total
+    if sum_A != NULL:
+        sum_A[0] = A_total
+    return flags
 
 cpdef double centered_moment(
         np.ndarray[DTYPE_t, ndim=2] data,
@@ -327,7 +792,8 @@ cpdef double centered_moment(
     Returns
     -------
     mu_pq : float
-        The centered adaptive moment.
+        The centered adaptive moment. Raises ZeroDivisionError if the
+        weighted flux is zero.
 
     Notes
     -----
@@ -345,127 +811,287 @@ cpdef double centered_moment(
 
     """
 
-    cdef double A = 0
+    if p < 0 or q < 0:
+        raise ValueError('p and q must be non-negative')
+    cdef np.ndarray[DTYPE_t, ndim=2, mode='c'] cdata = np.ascontiguousarray(data)
+    cdef np.ndarray[DTYPE_t, ndim=1] work = \
+        np.empty(_centered_moments_work(1, p, q), dtype=DTYPE)
     cdef double mu_pq = 0
+    cdef int flags = _centered_moments(&cdata[0, 0], cdata.shape[0],
+                                       cdata.shape[1], 1, &p, &q,
+                                       Mx, My, Mxx, Mxy, Myy, NULL,
+                                       &work[0], NULL, &mu_pq)
+    # as the python version did, rather than return nan
+    if flags & ZERO_FLUX:
+        raise ZeroDivisionError('float division')
+    _print_flags(flags, data.shape[0], My, Myy)
+    return mu_pq
+
+def centered_moments(data, orders,
+                     double Mx, double My,
+                     double Mxx, double Mxy, double Myy):
+
+    """Calculate several centered moments in one pass over the image
 
-    cdef int xmin = 0
-    cdef int ymin = 0
-    cdef int ymax = data.shape[0]
-    cdef int xmax = data.shape[1]
+    Parameters
+    ----------
+    data : array
+        2d image array
 
-    cdef double detM = Mxx * Myy - Mxy * Mxy
-    if (detM <= 0) + (Mxx <= 0) + (Myy <= 0):
-        print("Error: non positive definite adaptive moments!\n")
+    orders : list of (p, q)
+        The moments we are interested in, p,q for x,y as in centered_moment,
+        e.g. [(2, 0), (1, 1), (0, 2), (4, 0), (2, 2), (0, 4)].
 
-    cdef double Minv_xx = Myy / detM
-    cdef double TwoMinv_xy = -Mxy / detM * 2.0
-    cdef double Minv_yy = Mxx / detM
-    cdef double Inv2Minv_xx = 0.5 / Minv_xx  # Will be useful later...
+    Mx, My, Mxx, Mxy, Myy : floats
+        The centroids and second moment weight matrix, as in centered_moment.
 
-    # rho2 = Minv_xx(x-Mx)^2 + 2Minv_xy(x-Mx)(y-My) + Minv_yy(y-My)^2
-    # The minimum/maximum y that have a solution rho2 = max_moment_nsig2 is at:
-    #   2*Minv_xx*(x-Mx) + 2Minv_xy(y-My) = 0
-    # rho2 = Minv_xx (Minv_xy(y-My)/Minv_xx)^2
-    #           - 2Minv_xy(Minv_xy(y-My)/Minv_xx)(y-My)
-    #           + Minv_yy(y-My)^2
-    #      = (Minv_xy^2/Minv_xx - 2Minv_xy^2/Minv_xx + Minv_yy) (y-My)^2
-    #      = (Minv_xx Minv_yy - Minv_xy^2)/Minv_xx (y-My)^2
-    #      = (1/detM) / Minv_xx (y-My)^2
-    #      = (1/Myy) (y-My)^2
-    #
-    # we are finding the limits for the iy values and then the ix values.
-    cdef double y_My = sqrt(MAX_MOMENT_NSIG2 * Myy)
-    # nan check!
-    if y_My != y_My:
-        return 0
+    Returns
+    -------
+    mu : array
+        centered_moment(data, p, q, ...) for each (p, q) in orders, nan if
+        the weighted flux is zero.
 
-    cdef double y1 = -y_My + My
-    cdef double y2 = y_My + My
+    Notes
+    -----
+    The weight of each pixel is only found once, and the powers of x - Mx and
+    y - My are built up by multiplication rather than taken for each order,
+    so asking for many orders costs little more than asking for one.
 
-    # stay within image bounds
-    cdef int iy1 = max(<int>(ceil(y1)), ymin)
-    cdef int iy2 = min(<int>(floor(y2)), ymax)
-    cdef int y
-    if iy1 > iy2:
-        print('iy1 > iy2', y1, ymin, y2, ymax, iy1, iy2)
-
-    cdef double a, b, c, d, sqrtd, inv2a, x1, x2, x_Mx, \
-        Minv_xx__x_Mx__x_Mx, rho2, intensity, \
-        TwoMinv_xy__y_My, Minv_yy__y_My__y_My, \
-        y_My_q
-    cdef int ix1, ix2, x
-
-    for y in xrange(iy1, iy2):
-
-        y_My = float(y) - My
-        y_My_q = y_My ** q
-
-        TwoMinv_xy__y_My = TwoMinv_xy * y_My
-        Minv_yy__y_My__y_My = Minv_yy * y_My ** 2
-
-        # Now for a particular value of y, we want to find the min/max x that satisfy
-        # rho2 < max_moment_nsig2.
-        #
-        # 0 = Minv_xx(x-Mx)^2 + 2Minv_xy(x-Mx)(y-My) + Minv_yy(y-My)^2 - max_moment_nsig2
-        # Simple quadratic formula:
-
-        a = Minv_xx
-        b = TwoMinv_xy__y_My
-        c = Minv_yy__y_My__y_My - MAX_MOMENT_NSIG2
-        d = b * b - 4 * a * c
-        sqrtd = sqrt(d)
-        inv2a = Inv2Minv_xx
-        x1 = inv2a * (-b - sqrtd) + Mx
-        x2 = inv2a * (-b + sqrtd) + Mx
+    """
 
-        # stay within image bounds
-        ix1 = max(<int>(ceil(x1)), xmin)
-        ix2 = min(<int>(floor(x2)), xmax)
-        # in the following two cases, ask if we somehow wanted to find
-        # pixels outside the image
-        if (ix1 > xmax) * (ix2 == xmax):
-            continue
-        elif (ix1 == xmin) * (ix2 < xmin):
-            continue
-        elif ix1 > ix2:
-            # print('ix1 > ix2', y, x1, xmin, x2, xmax, ix1, ix2)
-            # usually what happens is you want to take only one pixel and you
-            # end up due to the ceil and floor funcs with e.g. 15, 14 instead
-            # of 14, 15
-            # ix1, ix2 = ix2, ix1
-            # ix1 = max(ix1, xmin)
-            # ix2 = min(ix2, xmax)
-            continue
-
-        for x in xrange(ix1, ix2):
-
-            x_Mx = float(x) - Mx
-
-            # Compute displacement from weight centroid, then get elliptical
-            # radius and weight.
-            Minv_xx__x_Mx__x_Mx = Minv_xx * x_Mx ** 2
-            rho2 = Minv_yy__y_My__y_My + \
-                TwoMinv_xy__y_My * x_Mx + \
-                Minv_xx__x_Mx__x_Mx
-
-            # this shouldn't happen by construction
-            if (rho2 > MAX_MOMENT_NSIG2 + 1e8):
-                print('rho2 > max_moment_nsig2 !')
-                continue
-
-            intensity = exp(-0.5 * rho2) * data[y, x]  # y,x order!
-
-            A += intensity
-
-            if (p == 0) + (q == 0):
-                if p == 0:
-                    mu_pq += intensity * y_My_q
-                else:
-                    mu_pq += intensity * x_Mx ** p
-            else:
-                mu_pq += intensity * x_Mx ** p * y_My_q
+    orders = np.asarray(orders, dtype=np.intc).reshape(-1, 2)
+    if orders.size and orders.min() < 0:
+        raise ValueError('p and q must be non-negative')
+    cdef np.ndarray[DTYPE_t, ndim=2, mode='c'] cdata = np.ascontiguousarray(data)
+    cdef int[::1] p = np.ascontiguousarray(orders[:, 0])
+    cdef int[::1] q = np.ascontiguousarray(orders[:, 1])
+    cdef int norders = orders.shape[0]
+    cdef np.ndarray[DTYPE_t, ndim=1] mu = np.zeros(norders, dtype=DTYPE)
+    if norders == 0:
+        return mu
+    cdef np.ndarray[DTYPE_t, ndim=1] work = np.empty(
+        _centered_moments_work(norders, max(p), max(q)), dtype=DTYPE)
+    cdef int flags = _centered_moments(&cdata[0, 0], cdata.shape[0],
+                                       cdata.shape[1], norders, &p[0], &q[0],
+                                       Mx, My, Mxx, Mxy, Myy, NULL,
+                                       &work[0], NULL, &mu[0])
+    _print_flags(flags, data.shape[0], My, Myy)
+    return mu
+
+cdef class WeightStencil:
+
+    """The Gaussian weight of adaptive moments over an image, kept for reuse
+
+    Once adaptive_moments has converged, every further moment of the stamp is
+    taken with the same weight. WeightStencil finds the weights of the pixels
+    of each row inside the weight ellipse once, and its methods are then sums
+    over those pixels with no exp, giving the same values as find_ellipmom_1
+    and centered_moments.
+
+    Parameters
+    ----------
+    shape : (int, int)
+        Shape of the images, in y,x order.
+
+    Mx, My, Mxx, Mxy, Myy : floats
+        The weight, e.g. the first five values returned by adaptive_moments.
+
+    Attributes
+    ----------
+    size : int
+        Number of weights kept, padded to whole vector blocks on each row.
+
+    flags : int
+        ELLIPMOM flags raised by the weight, which the methods print.
+
+    """
+
+    cdef weight_ellipse e
+    cdef weight_stencil s
+    cdef weight_stencil s2
+    cdef np.ndarray wts
+    cdef np.ndarray wts2
+    cdef np.ndarray start
+    cdef readonly tuple shape
+    cdef readonly double Mx, My, Mxx, Mxy, Myy
+    cdef readonly Py_ssize_t size
+    cdef readonly int flags
+
+    def __cinit__(self, shape, double Mx, double My,
+                  double Mxx, double Mxy, double Myy):
+        cdef int ymax, xmax, y
+        cdef weight_row r
+        cdef Py_ssize_t n = 0
+        ymax, xmax = shape
+        if ymax <= 0 or xmax <= 0:
+            raise ValueError('shape must be positive')
+        self.shape = (ymax, xmax)
+        self.Mx, self.My = Mx, My
+        self.Mxx, self.Mxy, self.Myy = Mxx, Mxy, Myy
+        self.flags = _weight_ellipse(Mx, My, Mxx, Mxy, Myy, ymax, &self.e)
+
+        # each row of weights is padded with zeros to whole vector blocks, so
+        # the row kernels may read them the way they read the pixels
+        self.start = np.zeros(max(self.e.iy2 - self.e.iy1, 1), dtype=np.intp)
+        cdef Py_ssize_t[::1] start = self.start
+        for y in range(self.e.iy1, self.e.iy2):
+            start[y - self.e.iy1] = n
+            if _weight_row(&self.e, y, xmax, &r):
+                n += ((r.ix2 - r.ix1 + ELLIPMOM_LANES - 1) //
+                      ELLIPMOM_LANES * ELLIPMOM_LANES)
+        self.size = n
+        # every padded row is filled in
+        self.wts = np.zeros(1, dtype=DTYPE) if n == 0 else \
+            np.empty(n, dtype=DTYPE)
+        cdef double[::1] wts = self.wts
+        for y in range(self.e.iy1, self.e.iy2):
+            if _weight_row(&self.e, y, xmax, &r):
+                ellipmom_span_weights(r.ix1, r.ix2, Mx, self.e.Minv_xx,
+                                      r.TwoMinv_xy__y_My,
+                                      r.Minv_yy__y_My__y_My,
+                                      &wts[start[y - self.e.iy1]])
+        self.s.wts = &wts[0]
+        self.s.start = &start[0]
+        self.s2.wts = NULL
+        self.s2.start = &start[0]
+
+    cdef const weight_stencil* _squares(self):
+        # the squared weights, for variances, made when first needed
+        cdef double[::1] wts2
+        if self.wts2 is None:
+            self.wts2 = np.square(self.wts)
+            wts2 = self.wts2
+            self.s2.wts = &wts2[0]
+        return &self.s2
+
+    def _image(self, data):
+        if (type(data) is np.ndarray and data.dtype == DTYPE and
+                data.flags.c_contiguous and data.shape == self.shape):
+            return data
+        try:
+            return np.ascontiguousarray(
+                np.broadcast_to(np.asarray(data, dtype=DTYPE), self.shape))
+        except ValueError:
+            raise ValueError('data must have shape {0}'.format(self.shape))
+
+    def weight(self):
+        """The weight as an image, zero outside of the weight ellipse."""
+        cdef np.ndarray[DTYPE_t, ndim=2, mode='c'] ones = \
+            np.ones(self.shape, dtype=DTYPE)
+        cdef np.ndarray[DTYPE_t, ndim=2] image = np.zeros(self.shape, dtype=DTYPE)
+        cdef double[::1] wts = self.wts
+        cdef Py_ssize_t[::1] start = self.start
+        cdef weight_row r
+        cdef int y
+        for y in range(self.e.iy1, self.e.iy2):
+            if _weight_row(&self.e, y, self.shape[1], &r) and r.ix2 > r.ix1:
+                image[y, r.ix1:r.ix2] = \
+                    self.wts[start[y - self.e.iy1]:
+                             start[y - self.e.iy1] + r.ix2 - r.ix1]
+        return image
+
+    def find_ellipmom_1(self, data):
+        """find_ellipmom_1 of data with this weight.
+
+        Returns A, Bx, By, Cxx, Cxy, Cyy, rho4w, Cxxx, Cxxy, Cxyy, Cyyy."""
+
+        cdef np.ndarray[DTYPE_t, ndim=2, mode='c'] cdata = self._image(data)
+        cdef np.ndarray[DTYPE_t, ndim=1] return_array = np.zeros(11, dtype=DTYPE)
+        _ellipmom_1(&cdata[0, 0], cdata.shape[0], cdata.shape[1],
+                    self.Mx, self.My, self.Mxx, self.Mxy, self.Myy, &self.s,
+                    &return_array[0])
+        _print_flags(self.flags, self.shape[0], self.My, self.Myy)
+        return return_array
 
-    return mu_pq / A
+    def centered_moments(self, data, orders, variance=None):
+        """centered_moments of data with this weight
+
+        Parameters
+        ----------
+        data : array
+            2d image array of this shape
+
+        orders : list of (p, q)
+            The moments we are interested in, as in centered_moments.
+
+        variance : array or float, optional
+            Variance of each pixel of data, or of all of them.
+
+        Returns
+        -------
+        mu : array
+            The centered moments, nan if the weighted flux is zero.
+
+        var_mu : array
+            If variance is given, the variance of each moment, to first order
+            in the pixel noise.
+
+        """
+
+        orders = np.asarray(orders, dtype=np.intc).reshape(-1, 2)
+        if orders.size and orders.min() < 0:
+            raise ValueError('p and q must be non-negative')
+        cdef int norders = orders.shape[0]
+        cdef np.ndarray[DTYPE_t, ndim=1] mu = np.zeros(norders, dtype=DTYPE)
+        cdef double A = 0
+        cdef int flags = self.flags
+        if norders:
+            A = self._centered_moments(self._image(data), orders, &self.s, mu)
+            if A == 0:
+                flags |= ZERO_FLUX
+        _print_flags(flags, self.shape[0], self.My, self.Myy)
+        if variance is None:
+            return mu
+        if A == 0:
+            return mu, np.full(norders, np.nan)
+
+        # mu = sum(w z data) / A for z = x^p y^q, so
+        # var(mu) = sum(w^2 (z - mu)^2 variance) / A^2
+        #         = T00 (T[2p, 2q] - 2 mu T[p, q] + mu^2) / A^2
+        # with T the centered moments of variance with weight w^2
+        cdef np.ndarray[DTYPE_t, ndim=1] T = np.zeros(2 * norders, dtype=DTYPE)
+        cdef double T00 = 0
+        if norders:
+            T00 = self._centered_moments(self._image(variance),
+                                         np.concatenate((2 * orders, orders)),
+                                         self._squares(), T)
+        if T00 == 0:
+            return mu, np.zeros(norders, dtype=DTYPE)
+        var_mu = T00 * (T[:norders] - 2 * mu * T[norders:] + mu * mu) / (A * A)
+        return mu, var_mu
+
+    def flux(self, data, variance=None):
+        """The weighted flux A of data, and its variance if the variance of
+        the pixels (an array or one value for all) is given."""
+
+        cdef np.ndarray[DTYPE_t, ndim=1] mu = np.zeros(1, dtype=DTYPE)
+        cdef double A = self._centered_moments(self._image(data),
+                                               np.zeros((1, 2), dtype=np.intc),
+                                               &self.s, mu)
+        _print_flags(self.flags, self.shape[0], self.My, self.Myy)
+        if variance is None:
+            return A
+        cdef double var_A = self._centered_moments(
+            self._image(variance), np.zeros((1, 2), dtype=np.intc),
+            self._squares(), mu)
+        return A, var_A
+
+    cdef double _centered_moments(self, np.ndarray[DTYPE_t, ndim=2] data,
+                                  np.ndarray orders, const weight_stencil* s,
+                                  np.ndarray[DTYPE_t, ndim=1] mu):
+        # centered moments of data with the weights of s into mu, and the
+        # sum of the weighted data
+        cdef int[::1] p = np.ascontiguousarray(orders[:, 0])
+        cdef int[::1] q = np.ascontiguousarray(orders[:, 1])
+        cdef np.ndarray[DTYPE_t, ndim=1] work = np.empty(
+            _centered_moments_work(orders.shape[0], max(p), max(q)),
+            dtype=DTYPE)
+        cdef double sum_A = 0
+        _centered_moments(&data[0, 0], self.shape[0], self.shape[1],
+                          orders.shape[0], &p[0], &q[0], self.Mx, self.My,
+                          self.Mxx, self.Mxy, self.Myy, s, &work[0],
+                          &sum_A, &mu[0])
+        return sum_A
 
 def second_moment_to_ellipticity(x2, y2, xy, **args):
 
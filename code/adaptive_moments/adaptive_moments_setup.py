@@ -1,3 +1,4 @@
+import sys
 from distutils.core import setup
 from distutils.extension import Extension
 from Cython.Distutils import build_ext
@@ -15,9 +16,23 @@ print('python adaptive_moments_setup.py build_ext --inplace')
 ##         include_dirs=[get_include()])]
 ## )
 
+# adaptive_moments_batch runs its stamps on OpenMP threads. Apple's clang has
+# no -fopenmp, so there the batch runs serially.
+openmp = [] if sys.platform == 'darwin' else ['-fopenmp']
+
+# The row kernels in ellipmom.h are built for several ISA levels on x86-64
+# Linux, like r2d. -ffp-contract=off keeps the AVX-512 ones from fusing
+# multiply-adds, so they all give the same answer.
+# Add ('NO_SIMD', None) to define_macros for the plain scalar loops with libm exp.
+define_macros = []
+
 extensions = [
     Extension('adaptive_moments', ['adaptive_moments.pyx'],
-        include_dirs=[get_include()]),
+        include_dirs=[get_include(), '.'],
+        depends=['ellipmom.h'],
+        define_macros=define_macros,
+        extra_compile_args=['-O3', '-ffp-contract=off'] + openmp,
+        extra_link_args=openmp),
 ]
 setup(
         ext_modules = cythonize(extensions, annotate=True),
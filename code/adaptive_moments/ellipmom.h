@@ -0,0 +1,237 @@
+/*
+ *
+ *  	ellipmom.h
+ *
+ *  	Row kernels for the Gaussian-weighted moments in adaptive_moments.pyx.
+ *  	Each row span inside the weight ellipse is walked in blocks of
+ *  	ELLIPMOM_LANES pixels. Every lane keeps its own partial sums, so the
+ *  	compiler can put a block in vector registers without reassociating
+ *  	any sums, and the result does not depend on the vector width.
+ *  	The partial sums are added up in lane order by ellipmom_sum_lanes.
+ *  	The Gaussian weights of a span can also be kept (ellipmom_span_weights)
+ *  	and handed back to the kernels, which then take no exp at all.
+ *
+ */
+
+#ifndef _ELLIPMOM_H_
+#define _ELLIPMOM_H_
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#define ELLIPMOM_LANES 8
+
+// number of sums kept by ellipmom_row_1: A, Bx, By, Cxx, Cxy, Cyy, rho4w,
+// Cxxx, Cxxy, Cxyy, Cyyy, in the order find_ellipmom_1 returns them
+#define ELLIPMOM_NSUMS 11
+
+// the same per-ISA clones as r2d.c. Building with -DNO_SIMD compiles
+// the kernels once for the baseline ISA and uses the libm exp instead
+#if !defined(NO_SIMD) && defined(__GNUC__) && defined(__x86_64__) && defined(__linux__) && defined(__has_attribute)
+#if __has_attribute(target_clones)
+#define ELLIPMOM_TARGET_CLONES __attribute__((target_clones("default", "sse4.2", "avx2", "avx512f")))
+#endif
+#endif
+#ifndef ELLIPMOM_TARGET_CLONES
+#define ELLIPMOM_TARGET_CLONES
+#endif
+
+#ifdef NO_SIMD
+#define ellipmom_exp exp
+#else
+// exp(x) without branches or calls, so that it vectorizes. The argument is
+// rounded to k*ln2 + r with |r| <= ln2/2 by adding 1.5*2^52, which also
+// leaves k in the low bits, and exp(r) is its Taylor series to r^13.
+// Good to a couple of ulp between -708 and 708. Outside that, k is clamped
+// in integer arithmetic (a clamp on x compares doubles, which keeps GCC from
+// vectorizing unless -fno-trapping-math), and the result is merely tiny or huge.
+static inline double ellipmom_exp(double x) {
+	const double shift = 6755399441055744.0; // 1.5*2^52
+	double t, k, r, p;
+	int64_t bits;
+	t = x*1.4426950408889634 + shift;
+	k = t - shift;
+	r = x - k*6.93147180369123816490e-01; // ln2 in two parts
+	r = r - k*1.90821492927058770002e-10;
+	p = 1.0/6227020800.0;
+	p = p*r + 1.0/479001600.0;
+	p = p*r + 1.0/39916800.0;
+	p = p*r + 1.0/3628800.0;
+	p = p*r + 1.0/362880.0;
+	p = p*r + 1.0/40320.0;
+	p = p*r + 1.0/5040.0;
+	p = p*r + 1.0/720.0;
+	p = p*r + 1.0/120.0;
+	p = p*r + 1.0/24.0;
+	p = p*r + 1.0/6.0;
+	p = p*r + 0.5;
+	p = p*r + 1.0;
+	p = p*r + 1.0;
+	memcpy(&bits, &t, sizeof(bits));
+	bits -= 0x4338000000000000LL;
+	bits = bits < -1022 ? -1022 : bits;
+	bits = bits > 1023 ? 1023 : bits;
+	bits = (bits + 1023) << 52;
+	memcpy(&t, &bits, sizeof(t));
+	return p*t;
+}
+#endif
+
+// v if keep, and 0 otherwise, even if v is a nan. Masks the bits, since GCC
+// does not vectorize a ?: between doubles here
+static inline double ellipmom_keep(double v, int keep) {
+	int64_t bits;
+	memcpy(&bits, &v, sizeof(bits));
+	bits &= -(int64_t)(keep != 0);
+	memcpy(&v, &bits, sizeof(v));
+	return v;
+}
+
+// x - Mx and rho2 = Minv_xx*(x-Mx)^2 + TwoMinv_xy__y_My*(x-Mx) + Minv_yy__y_My__y_My
+// of the ELLIPMOM_LANES pixels from x0 of a row
+static inline void ellipmom_rho2(int x0, double Mx, double Minv_xx,
+		double TwoMinv_xy__y_My, double Minv_yy__y_My__y_My, double* x_Mx, double* rho2) {
+	int l;
+	for(l = 0; l < ELLIPMOM_LANES; ++l) {
+		x_Mx[l] = (double)(x0 + l) - Mx;
+		rho2[l] = Minv_yy__y_My__y_My + TwoMinv_xy__y_My*x_Mx[l] + Minv_xx*x_Mx[l]*x_Mx[l];
+	}
+}
+
+// Gaussian weights exp(-rho2/2)*row[x] of the pixels x0 <= x < x0 + n of a row
+// (n <= ELLIPMOM_LANES), with x - Mx and rho2 alongside. Lanes past n get no
+// weight. The row span keeps rho2 below the cutoff, so it is not checked here.
+// If wts is not NULL, it holds exp(-rho2/2) of these pixels, padded with zeros
+// to ELLIPMOM_LANES (see ellipmom_span_weights), and no exp is taken.
+// If full, all ELLIPMOM_LANES pixels from x0 may be read, which lets the
+// last block of a row go through the vector loop too.
+static inline void ellipmom_weights(const double* row, const double* wts, int x0, int n, int full,
+		double Mx, double Minv_xx, double TwoMinv_xy__y_My, double Minv_yy__y_My__y_My,
+		double* x_Mx, double* rho2, double* w) {
+	int l;
+	ellipmom_rho2(x0, Mx, Minv_xx, TwoMinv_xy__y_My, Minv_yy__y_My__y_My, x_Mx, rho2);
+	if(full) {
+		// the pixel is read and weighted either way, then dropped, so that
+		// the loop has no branches
+		if(wts)
+			for(l = 0; l < ELLIPMOM_LANES; ++l)
+				w[l] = ellipmom_keep(wts[l]*row[x0 + l], l < n);
+		else
+			for(l = 0; l < ELLIPMOM_LANES; ++l)
+				w[l] = ellipmom_keep(ellipmom_exp(-0.5*rho2[l])*row[x0 + l], l < n);
+		return;
+	}
+	for(l = 0; l < ELLIPMOM_LANES; ++l)
+		w[l] = 0.0;
+	for(l = 0; l < n; ++l)
+		w[l] = (wts ? wts[l] : ellipmom_exp(-0.5*rho2[l]))*row[x0 + l];
+}
+
+// fills wts with the Gaussian weights exp(-rho2/2) of the pixels ix1 <= x < ix2
+// of a row, as ellipmom_weights would find them, then zeros up to the next
+// multiple of ELLIPMOM_LANES
+ELLIPMOM_TARGET_CLONES
+static void ellipmom_span_weights(int ix1, int ix2,
+		double Mx, double Minv_xx, double TwoMinv_xy__y_My, double Minv_yy__y_My__y_My,
+		double* restrict wts) {
+	double x_Mx[ELLIPMOM_LANES], rho2[ELLIPMOM_LANES];
+	double* block;
+	int x0, l, n;
+	for(x0 = ix1; x0 < ix2; x0 += ELLIPMOM_LANES) {
+		// a pointer to the block, since an index with x0 in it keeps GCC from
+		// vectorizing under -fwrapv, which Python builds with
+		block = wts + (x0 - ix1);
+		n = ix2 - x0;
+		ellipmom_rho2(x0, Mx, Minv_xx, TwoMinv_xy__y_My, Minv_yy__y_My__y_My, x_Mx, rho2);
+		for(l = 0; l < ELLIPMOM_LANES; ++l)
+			block[l] = ellipmom_keep(ellipmom_exp(-0.5*rho2[l]), l < n);
+	}
+}
+
+// adds the pixels ix1 <= x < ix2 of a row at y - My = y_My to the lane sums
+// of find_ellipmom_1, ELLIPMOM_NSUMS rows of ELLIPMOM_LANES in sums.
+// xread is how many pixels from the start of the row may be read (at least ix2),
+// which is more than the row itself if the image carries on after it.
+// wts is NULL, or the weights of the span from ellipmom_span_weights.
+ELLIPMOM_TARGET_CLONES
+static void ellipmom_row_1(const double* restrict row, const double* restrict wts,
+		int ix1, int ix2, int xread, double y_My,
+		double Mx, double Minv_xx, double TwoMinv_xy__y_My, double Minv_yy__y_My__y_My,
+		double* restrict sums) {
+	double x_Mx[ELLIPMOM_LANES], rho2[ELLIPMOM_LANES], w[ELLIPMOM_LANES];
+	double wx, wy, wxx, wyy;
+	int x0, l, n;
+	for(x0 = ix1; x0 < ix2; x0 += ELLIPMOM_LANES) {
+		n = ix2 - x0 < ELLIPMOM_LANES ? ix2 - x0 : ELLIPMOM_LANES;
+		ellipmom_weights(row, wts ? wts + (x0 - ix1) : NULL, x0, n,
+				x0 + ELLIPMOM_LANES <= xread, Mx, Minv_xx,
+				TwoMinv_xy__y_My, Minv_yy__y_My__y_My, x_Mx, rho2, w);
+		for(l = 0; l < ELLIPMOM_LANES; ++l) {
+			wx = w[l]*x_Mx[l];
+			wy = w[l]*y_My;
+			wxx = wx*x_Mx[l];
+			wyy = wy*y_My;
+			sums[0*ELLIPMOM_LANES + l] += w[l];
+			sums[1*ELLIPMOM_LANES + l] += wx;
+			sums[2*ELLIPMOM_LANES + l] += wy;
+			sums[3*ELLIPMOM_LANES + l] += wxx;
+			sums[4*ELLIPMOM_LANES + l] += wx*y_My;
+			sums[5*ELLIPMOM_LANES + l] += wyy;
+			sums[6*ELLIPMOM_LANES + l] += w[l]*rho2[l]*rho2[l];
+			sums[7*ELLIPMOM_LANES + l] += wxx*x_Mx[l];
+			sums[8*ELLIPMOM_LANES + l] += wxx*y_My;
+			sums[9*ELLIPMOM_LANES + l] += wyy*x_Mx[l];
+			sums[10*ELLIPMOM_LANES + l] += wyy*y_My;
+		}
+	}
+}
+
+// adds the pixels ix1 <= x < ix2 of a row to the lane sums of the weight (A)
+// and, for each of norders orders k, of the weighted (x-Mx)^p[k] times
+// y_My_q[k] = (y-My)^q[k] (mu, norders rows of ELLIPMOM_LANES). The powers
+// of x-Mx up to pmax are built up once per pixel in xpow, pmax+1 rows of
+// ELLIPMOM_LANES, so that each order then costs one multiply-add.
+// wts and xread are as for ellipmom_row_1
+ELLIPMOM_TARGET_CLONES
+static void ellipmom_row_orders(const double* restrict row, const double* restrict wts,
+		int ix1, int ix2, int xread,
+		int norders, const int* restrict p, const double* restrict y_My_q, int pmax,
+		double Mx, double Minv_xx, double TwoMinv_xy__y_My, double Minv_yy__y_My__y_My,
+		double* restrict xpow, double* restrict A, double* restrict mu) {
+	double x_Mx[ELLIPMOM_LANES], rho2[ELLIPMOM_LANES], w[ELLIPMOM_LANES];
+	const double* xp;
+	double yq;
+	int x0, l, n, i, k;
+	for(x0 = ix1; x0 < ix2; x0 += ELLIPMOM_LANES) {
+		n = ix2 - x0 < ELLIPMOM_LANES ? ix2 - x0 : ELLIPMOM_LANES;
+		ellipmom_weights(row, wts ? wts + (x0 - ix1) : NULL, x0, n,
+				x0 + ELLIPMOM_LANES <= xread, Mx, Minv_xx,
+				TwoMinv_xy__y_My, Minv_yy__y_My__y_My, x_Mx, rho2, w);
+		for(l = 0; l < ELLIPMOM_LANES; ++l) {
+			A[l] += w[l];
+			xpow[l] = w[l];
+		}
+		for(i = 1; i <= pmax; ++i)
+			for(l = 0; l < ELLIPMOM_LANES; ++l)
+				xpow[i*ELLIPMOM_LANES + l] = xpow[(i - 1)*ELLIPMOM_LANES + l]*x_Mx[l];
+		for(k = 0; k < norders; ++k) {
+			xp = xpow + p[k]*ELLIPMOM_LANES;
+			yq = y_My_q[k];
+			for(l = 0; l < ELLIPMOM_LANES; ++l)
+				mu[k*ELLIPMOM_LANES + l] += xp[l]*yq;
+		}
+	}
+}
+
+// adds up the lanes of each of nsums sums, in lane order
+static inline void ellipmom_sum_lanes(const double* sums, int nsums, double* out) {
+	int i, l;
+	for(i = 0; i < nsums; ++i) {
+		out[i] = 0.0;
+		for(l = 0; l < ELLIPMOM_LANES; ++l)
+			out[i] += sums[i*ELLIPMOM_LANES + l];
+	}
+}
+
+#endif // _ELLIPMOM_H_
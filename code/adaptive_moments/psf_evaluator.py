@@ -6,7 +6,12 @@ Description: Module for evaluating psfs from images or parameters.
 
 """
 
-from adaptive_moments.adaptive_moments import adaptive_moments, convert_moments
+from adaptive_moments.adaptive_moments import (
+    adaptive_moments_batch,
+    convert_moments,
+    moment_names,
+    starting_moments,
+)
 from pandas import DataFrame
 import numpy as np
 
@@ -34,9 +39,15 @@ class PSF_Evaluator(object):
 
 
 class Moment_Evaluator(PSF_Evaluator):
-    """Class that takes a PSF image and evaluates its second and third moments."""
+    """Class that takes a PSF image and evaluates its second and third moments.
 
-    def __init__(self, **kwargs):
+    The adaptive moments start from guess_sig at the stamp centre, unless a
+    reference solution is set (e.g. the result for an undistorted PSF), or
+    warm_start is set, in which case each stamp starts from the one evaluated
+    before it. The number of iterations each stamp took is in num_iter.
+    """
+
+    def __init__(self, warm_start=False, reference=None, **kwargs):
         self.adaptive_moments_kwargs = dict(
             epsilon=1e-6,
             convergence_factor=1.0,
@@ -46,15 +57,49 @@ class Moment_Evaluator(PSF_Evaluator):
             guess_centroid=None,
             num_iter=0,
             num_iter_max=100,
+            nthreads=0,  # for adaptive_moments_batch, all cores if <= 0
+            newton=False,  # Newton steps, fewer iterations for non-Gaussian PSFs
         )
         self.adaptive_moments_kwargs.update(kwargs)
+        self.warm_start = warm_start
+        self.last_moments = None
+        self.reference = None
+        if reference is not None:
+            self.set_reference(reference)
+
+    def set_reference(self, reference):
+        # anything with Mx, My, Mxx, Mxy, Myy, like an earlier evaluation
+        self.reference = starting_moments(reference)
+
+    def guess_moments(self):
+        if self.reference is not None:
+            return self.reference
+        if self.warm_start:
+            return self.last_moments
+        return None
 
     def evaluate_one_psf(self, psf):
-        # get moment matrix
-        Mx, My, Mxx, Mxy, Myy, A, rho4, x2, xy, y2, x3, x2y, xy2, y3 = adaptive_moments(
-            psf, **self.adaptive_moments_kwargs
+        return_dict = self.evaluate_psf_stack(np.asarray(psf)[np.newaxis])
+        return {key: return_dict[key][0] for key in return_dict}
+
+    def evaluate_psf_stack(self, psfs):
+        # every stamp at once with the compiled iteration
+        moments = adaptive_moments_batch(
+            psfs,
+            guess_moments=self.guess_moments(),
+            warm_start=self.warm_start,
+            **self.adaptive_moments_kwargs
         )
+        if self.warm_start and moments["flags"][-1] == 0:
+            self.last_moments = starting_moments(moments[-1:])
+        return_dict = self.psf_statistics(*[moments[name] for name in moment_names])
+        return_dict["num_iter"] = moments["num_iter"]
+        return return_dict
 
+    def psf_statistics(
+        self, Mx, My, Mxx, Mxy, Myy, A, rho4, x2, xy, y2, x3, x2y, xy2, y3
+    ):
+        # works on single values as well as arrays of them
         fwhm = np.sqrt(np.sqrt(Mxx * Myy - Mxy * Mxy))
         whisker = np.sqrt(np.sqrt(Mxy * Mxy + 0.25 * np.square(Mxx - Myy)))
         # 2 (1 + a4) = rho4
@@ -95,9 +140,71 @@ class Moment_Evaluator(PSF_Evaluator):
                 )
             # boldly moving forth
             psfs = [psfs]
-        # now we iterate through psfs
-        evaluated_psfs = []
-        for psf_i, psf in enumerate(psfs):
-            evaluated_psfs.append(self.evaluate_one_psf(psf))
-        evaluated_psfs = DataFrame(evaluated_psfs)
+        # all the psfs go through in one batch
+        evaluated_psfs = DataFrame(self.evaluate_psf_stack(psfs))
         return evaluated_psfs
+
+
+if __name__ == "__main__":
+    # report iterations and time to convergence of the two update rules
+    import argparse
+    import time
+
+    parser = argparse.ArgumentParser(description="time adaptive moments")
+    parser.add_argument("--number", type=int, default=2000, help="stamps per stack")
+    parser.add_argument("--size", type=int, default=64, help="stamps are size x size")
+    parser.add_argument("--repeat", type=int, default=3)
+    parser.add_argument("--nthreads", type=int, default=0)
+    args = parser.parse_args()
+
+    def best_time(func, *fargs, **fkwargs):
+        times = []
+        for _ in range(args.repeat):
+            t0 = time.time()
+            result = func(*fargs, **fkwargs)
+            times.append(time.time() - t0)
+        return min(times), result
+
+    # one PSF seen through sub-percent distortions of the pixel grid
+    N = args.size
+    rng = np.random.RandomState(0)
+    y, x = np.mgrid[:N, :N].astype(float)
+    stretch = 1 + rng.normal(0, 0.003, (args.number, 2, 1, 1))
+    centre = N / 2.0 + rng.normal(0, 0.01, (args.number, 2, 1, 1))
+    r2 = np.square((x - centre[:, 0]) * stretch[:, 0]) + np.square(
+        (y - centre[:, 1]) * stretch[:, 1]
+    )
+    profiles = {
+        "moffat": (1 + r2 / 9.0) ** -4.765,
+        "gaussian": np.exp(-0.5 * r2 / 2.5**2),
+    }
+
+    print("{0} stamps of {1}x{1}".format(args.number, N))
+    print("profile   update  start    time (s)  mean iter  max iter  max diff")
+    for profile, stamps in profiles.items():
+        base = None
+        for newton in [False, True]:
+            for warm_start in [False, True]:
+                seconds, moments = best_time(
+                    adaptive_moments_batch,
+                    stamps,
+                    nthreads=args.nthreads,
+                    newton=newton,
+                    warm_start=warm_start,
+                )
+                if base is None:
+                    base = moments
+                diff = max(
+                    np.max(np.abs(moments[name] - base[name])) for name in moment_names
+                )
+                print(
+                    "{0:8s}  {1:6s}  {2:7s}  {3:8.3f}  {4:9.2f}  {5:8d}  {6:8.1e}".format(
+                        profile,
+                        "newton" if newton else "hsm",
+                        "chained" if warm_start else "cold",
+                        seconds,
+                        moments["num_iter"].mean(),
+                        moments["num_iter"].max(),
+                        diff,
+                    )
+                )
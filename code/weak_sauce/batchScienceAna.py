@@ -12,6 +12,7 @@ from weak_sauce.movers import (
     SimpleVerticesMover,
     UniformIlluminationMover,
 )
+from adaptive_moments.psf_evaluator import Moment_Evaluator
 import galsim
 import time
 
@@ -56,8 +57,11 @@ def batchScienceAna(*args):
     obj = obj.shift(cutout_side_length / 2, cutout_side_length / 2)
     # obj = obj.shear(e=params[0],beta=galsim.Angle(params[2],galsim.degrees))
 
-    # oversampled galaxy to plop down
-    stationary_source = Source(num_x=5 * (cutout_side_length) + 1, flux_func=obj)
+    # galaxy to plop down. Instead of oversampling, each pixel holds a
+    # finite-difference quadratic fit to obj (only that fit is deposited
+    # exactly). It spans [0, L + 2] in unit pixels, a pixel past the
+    # L + 1 pixels of the cutouts below
+    stationary_source = Source(num_x=cutout_side_length + 3, flux_func=obj, polyorder=2)
     illuminator = FixedIlluminationMover(stationary_source)
     areaFinder = UniformIlluminationMover()
 
@@ -68,6 +72,9 @@ def batchScienceAna(*args):
     ideal_mg.step()
     # ideal_mg.source.plot_pixel_grid()
     ideal_res = ideal_mg.evaluate_psf()
+    # the cutouts only differ from the ideal psf by a slight distortion, so
+    # their adaptive moments start from its solution
+    psf_evaluator = Moment_Evaluator(reference=ideal_res)
     # ideal_sex_res = ideal_mg.evaluate_sex()['FLUX_AUTO']
     # if len(ideal_sex_res == 0): ideal_res['FLUX_AUTO'] = ideal_sex_res[0]
     # else: ideal_res['FLUX_AUTO'] = 0
@@ -123,7 +130,7 @@ def batchScienceAna(*args):
                 yctr - cutout_side_length / 2 : yctr + cutout_side_length / 2 + 1,
             ]
             # mg.plot_pixel_grid()
-            fitted_res = mg.evaluate_psf()
+            fitted_res = psf_evaluator(mg.source.fluxes)
             # sex_res = mg.evaluate_sex()['FLUX_AUTO']
             # if len(sex_res == 0): fitted_res['FLUX_AUTO'] = sex_res[0]
             # else: ideal_res['FLUX_AUTO'] = 0
@@ -132,6 +139,7 @@ def batchScienceAna(*args):
             # fake_img[xctr-cutout_side_length/2:xctr+cutout_side_length/2+1,\
             #              yctr-cutout_side_length/2:yctr+cutout_side_length/2+1] += mg.source.fluxes
             residual = fitted_res - ideal_res
+            residual["num_iter"] = fitted_res["num_iter"]
             residual["xctr"] = xctr
             residual["yctr"] = yctr
             res_df = res_df.append(residual)
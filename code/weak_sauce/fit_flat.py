@@ -9,16 +9,35 @@ TODO: FlatFitter should be a moveable grid. The routine to create a step for mov
 TODO: Should the lnlike be wrt mean rms instead of sum? Would have to propogate it through the derivatives if so...
 """
 
-
 import numpy as np
 
 
 from weak_sauce.movers import UniformIlluminationMover
+from weak_sauce.r2d import deposit_gradient, vertex_gradient, flat_step
 from weak_sauce.grid import MoveableGrid
 
 
 class FlatFitter(MoveableGrid):
-    def __init__(self, source, true_fluxes, luminosity=1, step_size=1e-4, **kwargs):
+    """
+    If fused (the default), each fit step without illumination is done by
+    r2d.flat_step, which moves the vertices, sets the fluxes and finds lnlike
+    and the relative changes in one compiled pass over the mesh, on nthreads
+    threads (all cores if <= 0). The vertices and fluxes come out the same
+    as from MoveableGrid.fit_step. The centroids of the source are then
+    updated when fit is done instead of at every step. Fits with an
+    optimizer (see MoveableGrid.fit) take the numpy path.
+    """
+
+    def __init__(
+        self,
+        source,
+        true_fluxes,
+        luminosity=1,
+        step_size=1e-4,
+        fused=True,
+        nthreads=0,
+        **kwargs
+    ):
         mover = FlatMover(
             true_fluxes=true_fluxes,
             luminosity=luminosity,
@@ -26,21 +45,69 @@ class FlatFitter(MoveableGrid):
             **kwargs
         )
         super(FlatFitter, self).__init__(source, mover, **kwargs)
+        self.fused = fused
+        self.nthreads = nthreads
 
     def lnlike(self):
         return self.mover.lnlike(self.source.vertices, self.source.fluxes)
 
+    def fit(self, *args, **kwargs):
+        try:
+            return super(FlatFitter, self).fit(*args, **kwargs)
+        finally:
+            self.source.update_centroids()
+
+    def fit_step(self, step_size=None, **kwargs):
+        mover = self.mover
+        if (
+            not self.fused
+            or mover.illumination is not None
+            or self.optimizer is not None
+            or kwargs
+        ):
+            return super(FlatFitter, self).fit_step(step_size=step_size, **kwargs)
+        if step_size is None:
+            step_size = mover.step_size
+        vertices = self.source.vertices
+        fluxes = self.source.fluxes
+        sums = flat_step(
+            vertices,
+            fluxes,
+            mover.true_fluxes,
+            mover.luminosity,
+            step_size,
+            nthreads=self.nthreads,
+        )
+        nvertices = vertices.shape[0] * vertices.shape[1]
+        lnlike = -0.5 * sums[0]
+        deltas = np.sqrt(sums[1:] / [nvertices, nvertices, fluxes.size])
+        return lnlike, deltas
+
 
 class FlatMover(UniformIlluminationMover):
     """
     This Mover takes true_fluxes and uses them to tell the source how to move.
     move_fluxes method based on UniformIlluminationMover
+
+    If illumination (a FixedIlluminationMover) is given, the model fluxes are
+    luminosity times its image deposited onto the vertices instead, and the
+    derivatives come from r2d.deposit_gradient. That only holds for an
+    illumination of constant pixels (polyorder=0).
     """
 
-    def __init__(self, true_fluxes, luminosity=1, step_size=1e-4, lamda=0, **kwargs):
+    def __init__(
+        self,
+        true_fluxes,
+        luminosity=1,
+        step_size=1e-4,
+        lamda=0,
+        illumination=None,
+        **kwargs
+    ):
         super(FlatMover, self).__init__(luminosity=luminosity, **kwargs)
         self.true_fluxes = true_fluxes
         self.step_size = step_size
+        self.illumination = illumination
 
         # lamda == l2 regularization strength
         self.lamda = lamda
@@ -59,6 +126,8 @@ class FlatMover(UniformIlluminationMover):
         """
         lnlike = -0.5 * sum_ij((A_ij - L * Ahat_ij)^2)
         """
+        if self.illumination is not None:
+            return self.illuminated_derivatives(vertices, fluxes)
         luminosity = np.abs(self.luminosity)
         x = vertices[:, :, 0]
         y = vertices[:, :, 1]
@@ -122,6 +191,27 @@ class FlatMover(UniformIlluminationMover):
 
         return dLdvertices
 
+    def illuminated_derivatives(self, vertices, fluxes):
+        """
+        lnlike = -0.5 * sum_ij((D_ij - L * Dhat_ij)^2), with Dhat the
+        illumination deposited onto the quads
+        """
+        luminosity = np.abs(self.luminosity)
+        illumination = self.illumination
+        if illumination.coefficients is not None:
+            # deposit_gradient is for pixels of constant flux, not the
+            # polynomial model that move_fluxes deposits
+            raise NotImplementedError(
+                "no gradient for an illumination with polyorder > 0; "
+                "use a source with polyorder=0"
+            )
+        pixel_vertices = illumination.pixel_coordinates(vertices)
+        D, dD = deposit_gradient(illumination.fluxes, pixel_vertices)
+        w_ij = (self.true_fluxes - luminosity * D) * luminosity
+        # chain rule through the conversion to illumination pixels
+        dLdvertices = vertex_gradient(dD, w_ij) / (illumination.r1 - illumination.r0)
+        return dLdvertices
+
     def move_vertices(self, vertices, fluxes, step_size=None, **kwargs):
 
         if type(step_size) == type(None):
@@ -150,5 +240,10 @@ class FlatMover(UniformIlluminationMover):
         # old move_fluxes adds a new flux with time (ie integrate over some time step)
         # but here we are not changing time, but the actual area of pixels
         # so we want the difference between the two
+        if self.illumination is not None:
+            updated_fluxes = np.abs(self.luminosity) * self.illumination.deposit_fluxes(
+                vertices, fluxes
+            )
+            return updated_fluxes - fluxes
         updated_fluxes = super(FlatMover, self).move_fluxes(vertices, fluxes, **kwargs)
         return updated_fluxes - fluxes
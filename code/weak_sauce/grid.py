@@ -5,6 +5,8 @@ In here goes the grid class.
 import numpy as np
 import pickle
 
+from weak_sauce.optimizers import make_optimizer
+
 
 class MoveableGrid(object):
     """A mapper between two sets of grids -- say pixel and focal plane.
@@ -39,6 +41,7 @@ class MoveableGrid(object):
             self.mover = args[1]
         else:
             raise Exception("__init__ takes 1 or 2 arguments!")
+        self.optimizer = None
 
     def move_vertices(self, **kwargs):
         # some method that modifies self.vertices
@@ -58,7 +61,31 @@ class MoveableGrid(object):
     def step(self, **kwargs):
         # self.update_fluxes(**kwargs)
         # self.update_vertices(**kwargs)
-        self.mover(self.source, **kwargs)
+        if getattr(self, "optimizer", None) is None:
+            self.mover(self.source, **kwargs)
+        else:
+            self.optimizer_step(**kwargs)
+
+    def optimizer_step(self, step_size=None, **kwargs):
+        # move the vertices along the optimizer's step from the gradient of
+        # lnlike, then the fluxes as the mover would
+        mover = self.mover
+        source = self.source
+        if type(step_size) == type(None):
+            step_size = mover.step_size
+        dLdvertices = mover.derivatives(source.vertices, source.fluxes)
+
+        def lnlike(vertices):
+            fluxes = source.fluxes + mover.move_fluxes(
+                vertices, source.fluxes, **kwargs
+            )
+            return mover.lnlike(vertices, fluxes)
+
+        source.vertices += self.optimizer.step(
+            "vertices", source.vertices, dLdvertices, step_size, lnlike=lnlike
+        )
+        source.update_centroids()
+        source.fluxes += mover.move_fluxes(source.vertices, source.fluxes, **kwargs)
 
     def lnlike(self, **kwargs):
         raise NotImplementedError
@@ -72,6 +99,7 @@ class MoveableGrid(object):
         maxfun=None,
         verbose=False,
         learning_rate_decay=0,
+        optimizer=None,
         **kwargs
     ):
         """
@@ -87,75 +115,80 @@ class MoveableGrid(object):
             TODO: Currently not implimented
 
         learning_rate_decay : if step_size is specified, after every update, multiply step_size by (1 - learning_rate_decay)
+        optimizer : None for the mover's own gradient step, or an Optimizer
+            or the name of one in weak_sauce.optimizers ('sgd', 'momentum',
+            'nesterov', 'rmsprop', 'adam', 'lbfgs'), which moves the
+            vertices from mover.derivatives (eg FlatMover) instead. Its
+            state is reset at the start of every fit, and the previous
+            optimizer is put back at the end.
         """
-        # TODO: incorporate several different parameter update modes
+        if type(optimizer) != type(None):
+            optimizer = make_optimizer(optimizer)
+            optimizer.reset()
+        # the optimizer only lasts for this fit, so that step() afterwards
+        # moves as the mover would
+        optimizer_old = getattr(self, "optimizer", None)
+        self.optimizer = optimizer
+        try:
+            self.loss_history = [self.lnlike(**kwargs)]  # number, not object
+            self.average_relative_delta_param_history = []
+            for it in range(maxiter):
+                if verbose:
+                    print(it)
+                lnlike_old = self.loss_history[-1]
+                lnlike, deltas = self.fit_step(step_size=step_size, **kwargs)
+                if verbose:
+                    print(lnlike)
+                self.loss_history.append(lnlike)
+                if verbose:
+                    print(deltas)
+                self.average_relative_delta_param_history.append(deltas)
+
+                if type(step_size) != type(None):
+                    step_size *= 1 - learning_rate_decay
+
+                # check changes
+                if np.abs((lnlike - lnlike_old) / lnlike) < ftol:
+                    print("ftol reached")
+                    return
+                if np.all(deltas < xtol):
+                    print("xtol reached")
+                    return
+            print("maxiter reached")
+            return
+        finally:
+            self.optimizer = optimizer_old
+
+    def fit_step(self, step_size=None, **kwargs):
         """
-        if update == 'sgd':
-          dx = -learning_rate * grads[p]
-        elif update == 'momentum':
-          if not p in self.step_cache:
-            self.step_cache[p] = np.zeros(grads[p].shape)
-          dx = np.zeros_like(grads[p]) # you can remove this after
-          dx = momentum * self.step_cache[p] - learning_rate * grads[p]
-          self.step_cache[p] = dx
-        elif update == 'rmsprop':
-          decay_rate = 0.99 # you could also make this an option
-          if not p in self.step_cache:
-            self.step_cache[p] = np.zeros(grads[p].shape)
-          dx = np.zeros_like(grads[p]) # you can remove this after
-          self.step_cache[p] = self.step_cache[p] * decay_rate + (1.0 - decay_rate) * grads[p] ** 2
-          dx = -(learning_rate * grads[p]) / np.sqrt(self.step_cache[p] + 1e-8)
+        One iteration of fit: step, then return the new lnlike and the rms
+        relative changes (new - old) / new of the vertex x, the vertex y and
+        the fluxes
         """
-        self.loss_history = [self.lnlike(**kwargs)]  # number, not object
-        self.average_relative_delta_param_history = []
-        for it in range(maxiter):
-            if verbose:
-                print(it)
-            vertices_old = self.source.vertices.copy()
-            fluxes_old = self.source.fluxes.copy()
-            lnlike_old = self.loss_history[-1]
-            self.step(step_size=step_size, **kwargs)
-            lnlike = self.lnlike(**kwargs)
-            if verbose:
-                print(lnlike)
-            self.loss_history.append(lnlike)
-
-            delta_vx = np.sqrt(
-                np.mean(
-                    np.square(
-                        (self.source.vertices - vertices_old) / self.source.vertices
-                    )[:, :, 0]
-                )
+        vertices_old = self.source.vertices.copy()
+        fluxes_old = self.source.fluxes.copy()
+        self.step(step_size=step_size, **kwargs)
+        lnlike = self.lnlike(**kwargs)
+
+        delta_vx = np.sqrt(
+            np.mean(
+                np.square((self.source.vertices - vertices_old) / self.source.vertices)[
+                    :, :, 0
+                ]
             )
-            delta_vy = np.sqrt(
-                np.mean(
-                    np.square(
-                        (self.source.vertices - vertices_old) / self.source.vertices
-                    )[:, :, 1]
-                )
-            )
-            delta_fluxes = np.sqrt(
-                np.mean(
-                    np.square((self.source.fluxes - fluxes_old) / self.source.fluxes)
-                )
+        )
+        delta_vy = np.sqrt(
+            np.mean(
+                np.square((self.source.vertices - vertices_old) / self.source.vertices)[
+                    :, :, 1
+                ]
             )
-            deltas = np.array([delta_vx, delta_vy, delta_fluxes])
-            if verbose:
-                print(deltas)
-            self.average_relative_delta_param_history.append(deltas)
-
-            if type(step_size) != type(None):
-                step_size *= 1 - learning_rate_decay
-
-            # check changes
-            if np.abs((lnlike - lnlike_old) / lnlike) < ftol:
-                print("ftol reached")
-                return
-            if np.all(deltas < xtol):
-                print("xtol reached")
-                return
-        print("maxiter reached")
-        return
+        )
+        delta_fluxes = np.sqrt(
+            np.mean(np.square((self.source.fluxes - fluxes_old) / self.source.fluxes))
+        )
+        deltas = np.array([delta_vx, delta_vy, delta_fluxes])
+        return lnlike, deltas
 
     # wrap to the source object
     def evaluate_psf(self):
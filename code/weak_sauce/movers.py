@@ -7,7 +7,8 @@ TODO: Make sure all move methods are now differences, instead of total moves
 
 import numpy as np
 
-from weak_sauce.r2d import deposit, skim
+from weak_sauce.r2d import deposit, deposit_polynomial, skim
+from weak_sauce.r2d import OverlapOperator, mesh_key
 
 
 class Mover(object):
@@ -88,11 +89,17 @@ class FixedIlluminationMover(StationaryMover):
     Deposit grid onto funny vertices.
     """
 
-    def __init__(self, stationary_source, **kwargs):
+    def __init__(self, stationary_source, overlap_cache=None, **kwargs):
         super(FixedIlluminationMover, self).__init__(**kwargs)
         self.stationary_source = stationary_source
+        # if given a directory, rasterize each mesh once into an
+        # OverlapOperator, cached there and reused while the mesh is fixed
+        self.overlap_cache = overlap_cache
+        self.operator = None
         # self.centroids = self.stationary_source.centroids
         self.fluxes = self.stationary_source.fluxes
+        # per-pixel polynomial model of the source, if it has one
+        self.coefficients = getattr(self.stationary_source, "coefficients", None)
         self.r0 = self.stationary_source.r0
         self.r1 = self.stationary_source.r1
 
@@ -106,24 +113,39 @@ class FixedIlluminationMover(StationaryMover):
     def move_fluxes(self, vertices, fluxes, **kwargs):
         return self.deposit_fluxes(vertices, fluxes, **kwargs)
 
+    def overlap_operator(self, vertices):
+        # operator for the current mesh, if we are caching them
+        if self.overlap_cache is None:
+            return None
+        pixel_vertices = self.pixel_coordinates(vertices)
+        if self.operator is None or self.operator.key != mesh_key(
+            pixel_vertices, self.fluxes.shape
+        ):
+            self.operator = OverlapOperator.cached(
+                pixel_vertices, self.fluxes.shape, self.overlap_cache
+            )
+        return self.operator
+
     def deposit_fluxes(self, vertices, fluxes, **kwargs):
         # take our regular fluxes grid and deposit onto irregular vertices
+        if self.coefficients is not None:
+            return deposit_polynomial(
+                self.coefficients, self.pixel_coordinates(vertices)
+            )
+        operator = self.overlap_operator(vertices)
+        if operator is not None:
+            return operator.deposit(self.fluxes)
         dfluxes = deposit(self.fluxes, self.pixel_coordinates(vertices))
         return dfluxes
 
     def skim_fluxes(self, vertices, fluxes, **kwargs):
         # take irregular fluxes of source and return grid in our fluxes
-        pixel_verts = self.pixel_coordinates(vertices)
-        dfluxes_partial = skim(fluxes, pixel_verts)
-        # put dfluxes in same grid as mover's fluxes
-        x = pixel_verts[:, :, 0]
-        y = pixel_verts[:, :, 1]
-        xmax_all = int(x.max())
-        xmin_all = int(x.min())
-        ymax_all = int(y.max())
-        ymin_all = int(y.min())
-        dfluxes = np.zeros(self.fluxes.shape)
-        dfluxes[xmin_all : xmax_all + 1, ymin_all : ymax_all + 1] = dfluxes_partial
+        operator = self.overlap_operator(vertices)
+        if operator is not None:
+            return operator.skim(fluxes)
+        dfluxes = skim(
+            fluxes, self.pixel_coordinates(vertices), shape=self.fluxes.shape
+        )
         return dfluxes
 
 
@@ -0,0 +1,245 @@
+"""
+Optimizers turn the gradient of lnlike into a step for MoveableGrid.fit
+
+Each keeps its own state buffers per parameter (keyed by name, eg
+'vertices'), which are cleared by reset() at the start of every fit. All of
+them climb lnlike, so the gradient is d lnlike / d parameter, as returned by
+FlatMover.derivatives.
+
+step_size means different things for different optimizers: for SGD,
+Momentum and Nesterov it multiplies the gradient, as in the plain fit, while
+for RMSprop and Adam it is roughly how far (in vertex coordinates) each
+parameter moves per step. LBFGS ignores it after its first step and does a
+backtracking line search on lnlike instead.
+"""
+
+import numpy as np
+
+
+class Optimizer(object):
+    """
+    Class shell. step(key, x, grad, step_size, lnlike) returns dx, the
+    change to make to parameter x (lnlike(x) is only used by LBFGS)
+    """
+
+    def __init__(self, **kwargs):
+        self.state = {}
+
+    def reset(self):
+        self.state = {}
+
+    def step(self, key, x, grad, step_size, lnlike=None):
+        raise NotImplementedError
+
+
+class SGD(Optimizer):
+    """
+    dx = step_size * grad, which is what fit does without an optimizer
+    """
+
+    def step(self, key, x, grad, step_size, lnlike=None):
+        return step_size * grad
+
+
+class Momentum(Optimizer):
+    """
+    v = momentum * v + step_size * grad; dx = v
+    """
+
+    def __init__(self, momentum=0.9, **kwargs):
+        super(Momentum, self).__init__(**kwargs)
+        self.momentum = momentum
+
+    def step(self, key, x, grad, step_size, lnlike=None):
+        if key not in self.state:
+            self.state[key] = np.zeros(grad.shape)
+        v = self.state[key]
+        v *= self.momentum
+        v += step_size * grad
+        return v.copy()
+
+
+class Nesterov(Momentum):
+    """
+    Nesterov momentum, with the gradient at the look-ahead point. We keep x
+    at the look-ahead point so that no extra gradient is needed:
+    v_new = momentum * v + step_size * grad;
+    dx = (1 + momentum) * v_new - momentum * v
+    """
+
+    def step(self, key, x, grad, step_size, lnlike=None):
+        if key not in self.state:
+            self.state[key] = np.zeros(grad.shape)
+        v = self.state[key]
+        dx = -self.momentum * v
+        v *= self.momentum
+        v += step_size * grad
+        dx += (1 + self.momentum) * v
+        return dx
+
+
+class RMSprop(Optimizer):
+    """
+    cache = decay_rate * cache + (1 - decay_rate) * grad ** 2;
+    dx = step_size * grad / sqrt(cache + eps)
+    """
+
+    def __init__(self, decay_rate=0.99, eps=1e-8, **kwargs):
+        super(RMSprop, self).__init__(**kwargs)
+        self.decay_rate = decay_rate
+        self.eps = eps
+
+    def step(self, key, x, grad, step_size, lnlike=None):
+        if key not in self.state:
+            self.state[key] = np.zeros(grad.shape)
+        cache = self.state[key]
+        cache *= self.decay_rate
+        cache += (1 - self.decay_rate) * np.square(grad)
+        return step_size * grad / np.sqrt(cache + self.eps)
+
+
+class Adam(Optimizer):
+    """
+    Adam (Kingma & Ba), with bias-corrected first and second moments m, v of
+    the gradient: dx = step_size * m_hat / (sqrt(v_hat) + eps)
+    """
+
+    def __init__(self, beta1=0.9, beta2=0.999, eps=1e-8, **kwargs):
+        super(Adam, self).__init__(**kwargs)
+        self.beta1 = beta1
+        self.beta2 = beta2
+        self.eps = eps
+
+    def step(self, key, x, grad, step_size, lnlike=None):
+        if key not in self.state:
+            self.state[key] = [0, np.zeros(grad.shape), np.zeros(grad.shape)]
+        state = self.state[key]
+        state[0] += 1
+        t, m, v = state
+        m *= self.beta1
+        m += (1 - self.beta1) * grad
+        v *= self.beta2
+        v += (1 - self.beta2) * np.square(grad)
+        m_hat = m / (1 - self.beta1**t)
+        v_hat = v / (1 - self.beta2**t)
+        return step_size * m_hat / (np.sqrt(v_hat) + self.eps)
+
+
+class LBFGS(Optimizer):
+    """
+    Limited-memory BFGS on -lnlike, keeping the last history_size position
+    and gradient changes. The first step (and any step after the history is
+    thrown out) is step_size * grad. Each step is then halved until lnlike
+    rises by at least c1 times what the gradient predicts, up to
+    max_backtracks times; if that fails the history is cleared and the step
+    is 0, so the next one starts over from the gradient.
+    """
+
+    def __init__(self, history_size=10, c1=1e-4, max_backtracks=20, **kwargs):
+        super(LBFGS, self).__init__(**kwargs)
+        self.history_size = history_size
+        self.c1 = c1
+        self.max_backtracks = max_backtracks
+
+    def direction(self, state, grad, step_size):
+        # two-loop recursion for the ascent direction
+        q = grad.ravel().copy()
+        if not state["s"]:
+            return step_size * q
+        alphas = []
+        for s, y, rho in zip(
+            reversed(state["s"]), reversed(state["y"]), reversed(state["rho"])
+        ):
+            alpha = rho * np.dot(s, q)
+            q -= alpha * y
+            alphas.append(alpha)
+        s, y = state["s"][-1], state["y"][-1]
+        q *= np.dot(s, y) / np.dot(y, y)
+        for s, y, rho, alpha in zip(
+            state["s"], state["y"], state["rho"], reversed(alphas)
+        ):
+            beta = rho * np.dot(y, q)
+            q += (alpha - beta) * s
+        return q
+
+    def step(self, key, x, grad, step_size, lnlike=None):
+        if lnlike is None:
+            raise ValueError("LBFGS needs lnlike to do its line search")
+        if key not in self.state:
+            self.state[key] = {
+                "s": [],
+                "y": [],
+                "rho": [],
+                "x": None,
+                "g": None,
+                "accepted": None,
+            }
+        state = self.state[key]
+        g = grad.ravel()
+
+        # update history with the step just taken. y is the change in the
+        # gradient of -lnlike
+        if state["x"] is not None:
+            s = x.ravel() - state["x"]
+            y = state["g"] - g
+            sy = np.dot(s, y)
+            if sy > 1e-10 * np.sqrt(np.dot(s, s) * np.dot(y, y)):
+                state["s"].append(s)
+                state["y"].append(y)
+                state["rho"].append(1.0 / sy)
+                if len(state["s"]) > self.history_size:
+                    del state["s"][0], state["y"][0], state["rho"][0]
+        state["x"] = x.ravel().copy()
+        state["g"] = g.copy()
+
+        d = self.direction(state, g, step_size)
+        slope = np.dot(g, d)
+        if slope <= 0:
+            # not an ascent direction: start over from the gradient
+            del state["s"][:], state["y"][:], state["rho"][:]
+            d = step_size * g
+            slope = np.dot(g, d)
+        # lnlike at x is known if x is where the last line search ended
+        accepted = state["accepted"]
+        if accepted is not None and np.array_equal(accepted[0], x):
+            lnlike_0 = accepted[1]
+        else:
+            lnlike_0 = lnlike(x)
+        t = 1.0
+        for i in range(self.max_backtracks):
+            dx = (t * d).reshape(x.shape)
+            x_new = x + dx
+            lnlike_new = lnlike(x_new)
+            if lnlike_new >= lnlike_0 + self.c1 * t * slope:
+                state["accepted"] = (x_new, lnlike_new)
+                return dx
+            t *= 0.5
+        del state["s"][:], state["y"][:], state["rho"][:]
+        return np.zeros(x.shape)
+
+
+optimizers = {
+    "sgd": SGD,
+    "momentum": Momentum,
+    "nesterov": Nesterov,
+    "rmsprop": RMSprop,
+    "adam": Adam,
+    "lbfgs": LBFGS,
+}
+
+
+def make_optimizer(optimizer, **kwargs):
+    """
+    optimizer is either an Optimizer, which is returned as is, or one of the
+    names in optimizers, which is made with kwargs
+    """
+    if isinstance(optimizer, Optimizer):
+        return optimizer
+    try:
+        return optimizers[optimizer.lower()](**kwargs)
+    except KeyError:
+        raise ValueError(
+            "unknown optimizer {0}! Try one of {1}".format(
+                optimizer, sorted(optimizers)
+            )
+        )
@@ -3,15 +3,19 @@ Interfaces with the r2d C library
 """
 
 import numpy as np
+import scipy.sparse
 import ctypes
+import hashlib
 import os
 
-# load library
+# load library. Calls through ctypes.CDLL release the GIL until they return,
+# so other Python threads keep running while r2d rasterizes. Arrays are
+# passed as numpy buffers (see r2d_array below) and written in place.
 r2d = ctypes.CDLL(os.path.dirname(os.path.realpath(__file__)) + "/r3d/r2d_lib.so")
 
 # define some types
 r2d_int = ctypes.c_int
-r2d_long = ctypes.c_int
+r2d_long = ctypes.c_int64
 # r2d_real = ctypes.c_float
 r2d_real = ctypes.c_double
 
@@ -46,6 +50,14 @@ class r2d_info(ctypes.Structure):
         ("vtot", r2d_real),
         ("vox_min", r2d_real),
         ("vox_max", r2d_real),
+        ("nrect", ctypes.c_int64),
+        ("nedge", ctypes.c_int64),
+        ("nclip", ctypes.c_int64),
+        ("num_in", ctypes.c_int64),
+        ("num_clip", ctypes.c_int64),
+        ("num_out", ctypes.c_int64),
+        ("ntree", ctypes.c_int64),
+        ("nflat", ctypes.c_int64),
     ]
 
 
@@ -55,14 +67,174 @@ class r2d_info(ctypes.Structure):
 r2d.r2d_init.restype = r2d_info
 r2d.r2d_init.argtypes = [r2d_int]
 
+r2d_array = np.ctypeslib.ndpointer(dtype=r2d_real, flags="C_CONTIGUOUS")
 
-# r2d.r2d_set_dest_grid
-# r2d.r2d_set_dest_grid.argtypes = [ctypes.POINTER(r2d_real),
-#                                  r2d_dvec2, r2d_rvec2]
-# r2d.r2d_finalize
-# r2d.r2d_finalize.restype = ctypes.c_void
-# r2d.r2d_finalize.argtypes
-# r2d.r2d_rasterize_quad
+r2d.r2d_set_dest_grid.restype = r2d_info
+r2d.r2d_set_dest_grid.argtypes = [r2d_array, r2d_dvec2, r2d_rvec2]
+
+r2d.r2d_finalize.restype = None
+r2d.r2d_finalize.argtypes = []
+
+r2d.r2d_rasterize_quad.restype = r2d_info
+r2d.r2d_rasterize_quad.argtypes = [r2d_real, (r2d_plane * 4), (r2d_dvec2 * 2)]
+
+r2d.r2du_faces_from_verts.restype = None
+r2d.r2du_faces_from_verts.argtypes = [r2d_array, r2d_int, (r2d_plane * 4)]
+
+# reentrant, unlike the global API above
+r2d.r2d_rasterize_quad_verts.restype = r2d_info
+r2d.r2d_rasterize_quad_verts.argtypes = [
+    r2d_real,
+    r2d_array,
+    r2d_array,
+    r2d_dvec2,
+    r2d_rvec2,
+]
+
+# whole-mesh entry points
+
+
+def _declare_mesh(lib, info, array):
+    # argument types of the whole-mesh entry points of lib, whose r2d_info
+    # and real arrays are info and array
+    lib.r2d_deposit_mesh.restype = info
+    lib.r2d_deposit_mesh.argtypes = [
+        array,
+        r2d_dvec2,
+        array,
+        r2d_dvec2,
+        array,
+        r2d_int,
+    ]
+
+    lib.r2d_deposit_mesh_poly.restype = info
+    lib.r2d_deposit_mesh_poly.argtypes = [
+        array,
+        r2d_dvec2,
+        array,
+        r2d_int,
+        r2d_dvec2,
+        array,
+        r2d_int,
+    ]
+
+    lib.r2d_deposit_mesh_multi.restype = info
+    lib.r2d_deposit_mesh_multi.argtypes = [
+        array,
+        r2d_dvec2,
+        array,
+        r2d_int,
+        r2d_int,
+        r2d_dvec2,
+        array,
+        r2d_int,
+    ]
+
+    lib.r2d_deposit_mesh_grad.restype = info
+    lib.r2d_deposit_mesh_grad.argtypes = [
+        array,
+        r2d_dvec2,
+        array,
+        r2d_dvec2,
+        array,
+        array,
+        r2d_int,
+    ]
+
+    lib.r2d_overlap_mesh.restype = info
+    lib.r2d_overlap_mesh.argtypes = [
+        array,
+        r2d_dvec2,
+        r2d_dvec2,
+        r2d_long_array,
+        r2d_long_array,
+        array,
+        r2d_long,
+        r2d_int,
+    ]
+
+    lib.r2d_skim_mesh.restype = info
+    lib.r2d_skim_mesh.argtypes = [
+        array,
+        r2d_dvec2,
+        array,
+        array,
+        r2d_dvec2,
+        r2d_int,
+    ]
+
+    lib.r2d_deposit_polygons.restype = info
+    lib.r2d_deposit_polygons.argtypes = [
+        array,
+        r2d_long_array,
+        r2d_int,
+        array,
+        r2d_dvec2,
+        array,
+        r2d_int,
+    ]
+
+    lib.r2d_flat_step.restype = info
+    lib.r2d_flat_step.argtypes = [
+        array,
+        r2d_dvec2,
+        array,
+        array,
+        r2d_real,
+        r2d_real,
+        array,
+        r2d_int,
+    ]
+
+    lib.r2d_set_tree_threshold.restype = None
+    lib.r2d_set_tree_threshold.argtypes = [r2d_long]
+    lib.r2d_get_tree_threshold.restype = r2d_long
+    lib.r2d_get_tree_threshold.argtypes = []
+
+
+r2d_long_array = np.ctypeslib.ndpointer(dtype=np.int64, flags="C_CONTIGUOUS")
+_declare_mesh(r2d, r2d_info, r2d_array)
+
+# the same library built with -DSINGLE_PRECISION (make r2d_lib_single), for
+# large meshes where halving the bytes moved matters more than the last
+# digits. Only its whole-mesh entry points are declared, and it is loaded
+# the first time a function is called with precision="single"
+r2d_single = None
+
+
+class r2d_info_single(ctypes.Structure):
+    _fields_ = [
+        (name, ctypes.c_float if ftype is r2d_real else ftype)
+        for name, ftype in r2d_info._fields_
+    ]
+
+
+r2d_single_array = np.ctypeslib.ndpointer(dtype=np.float32, flags="C_CONTIGUOUS")
+
+
+def _library(precision):
+    # the r2d library and numpy dtype to use for precision "double" or "single"
+    global r2d_single
+    if precision == "double":
+        return r2d, np.float64
+    if precision != "single":
+        raise ValueError(
+            "precision must be 'double' or 'single', not {0!r}".format(precision)
+        )
+    if r2d_single is None:
+        lib = ctypes.CDLL(
+            os.path.dirname(os.path.realpath(__file__)) + "/r3d/r2d_lib_single.so"
+        )
+        _declare_mesh(lib, r2d_info_single, r2d_single_array)
+        lib.r2d_set_tree_threshold(r2d.r2d_get_tree_threshold())
+        r2d_single = lib
+    return r2d_single, np.float32
+
+
+def _errmsg(info):
+    if not info.errmsg:
+        return ""
+    return ctypes.cast(info.errmsg, ctypes.c_char_p).value.decode()
 
 
 def get_box_index_bounds(vertices):
@@ -79,61 +251,17 @@ def get_box_index_bounds(vertices):
 def overlap_pixel(vertices, dest_window, verts_test, ij, bounds):
     # get the overlap deposits of a bounding box around the vertices
     # dest_window = np.ceil(np.max(vertices, axis=0)).astype(int).tolist()
-
-    dest_window_c = r2d_rvec2(*dest_window)
-    r2d.r2d_init(np.prod(dest_window) * 10)
-    nverts = r2d_int(4)  # assume always 4
-
-    dest_dims = dest_window
-    dest_grid = np.zeros(np.prod(dest_dims))
-    ibounds = (r2d_dvec2 * 2)()
-    ibounds[0].x = 0
-    ibounds[0].y = 0
-    ibounds[1].x = dest_dims[0]
-    ibounds[1].y = dest_dims[1]
-
-    # put in some verts
-    # verts = (r2d_vertex * 4)()
-    # despite their name, they are not of the vertex class.
-    verts = (r2d_rvec2 * 4)()
-    for i in range(len(verts)):
-        verts[i] = r2d_rvec2(*vertices[i])
-    # buffers
-    faces = (r2d_plane * 4)()
-
-    r2d.r2du_faces_from_verts.argtypes = [
-        ctypes.POINTER(type(verts)),
-        r2d_int,
-        ctypes.POINTER(type(faces)),
-    ]
-    r2d.r2du_faces_from_verts(ctypes.pointer(verts), nverts, ctypes.pointer(faces))
-
-    dest_dims_c = r2d_dvec2(*dest_dims)
-    dest_grid_c = (r2d_real * len(dest_grid))(*dest_grid)
-    dest_grid = dest_grid.reshape(dest_dims)
-    r2d.r2d_set_dest_grid.argtypes = [
-        ctypes.POINTER(type(dest_grid_c)),
-        r2d_dvec2,
-        r2d_rvec2,
-    ]
-    r2d.r2d_set_dest_grid.restype = r2d_info
-    info2 = r2d.r2d_set_dest_grid(
-        ctypes.pointer(dest_grid_c), dest_dims_c, dest_window_c
+    # the grid is filled in place by r2d, which uses its own context, so
+    # this may be called from several threads at once
+    dest_dims = tuple(dest_window)
+    dest_grid = np.zeros(dest_dims)
+    verts = np.ascontiguousarray(vertices[:4], dtype=np.float64)  # assume 4
+
+    info = r2d.r2d_rasterize_quad_verts(
+        1.0, verts, dest_grid, r2d_dvec2(*dest_dims), r2d_rvec2(*dest_window)
     )
-    r2d.r2d_rasterize_quad.restype = r2d_info
-    r2d.r2d_rasterize_quad.argtypes = [r2d_real, (r2d_plane * 4), (r2d_dvec2 * 2)]
-    info3 = r2d.r2d_rasterize_quad(r2d_real(1.0), faces, ibounds)
-
-    r2d.r2d_finalize()
 
-    # deposit the results
-    for i in range(dest_grid.size):
-        x = int(i / dest_dims[1])
-        y = int(i % dest_dims[1])
-        # print(i, x, y, dest_grid_c[i])
-        dest_grid[x, y] = dest_grid_c[i]
-
-    if info3.good == 0:
+    if info.good == 0:
         print("vertices")
         print(vertices)
         print(verts_test)
@@ -141,91 +269,310 @@ def overlap_pixel(vertices, dest_window, verts_test, ij, bounds):
         print(bounds)
         print("dest_window")
         print(dest_window)
-        print("info 2")
-        print(info2.good)
-        print(info2.vtot)
-        print(info2.vox_min)
-        print(info2.vox_max)
-        print("info 3")
-        print(info3.good)
-        print(info3.vtot)
-        print(info3.vox_min)
-        print(info3.vox_max)
+        print("info")
+        print(info.good)
+        print(_errmsg(info))
+        print(info.vtot)
+        print(info.vox_min)
+        print(info.vox_max)
         print("\n\n")
 
     return dest_grid
 
 
-def deposit(source_array, vertices):
+def _output(out, shape, dtype=np.float64):
+    # results are written straight into out when it is given, so it must
+    # already be a C-contiguous array of the right shape and dtype
+    shape = tuple(int(n) for n in shape)
+    if out is None:
+        return np.zeros(shape, dtype=dtype)
+    if out.shape != shape or out.dtype != dtype or not out.flags.c_contiguous:
+        raise ValueError(
+            "out must be a C-contiguous {0} array of shape {1}".format(
+                np.dtype(dtype).name, shape
+            )
+        )
+    return out
+
+
+def deposit(source_array, vertices, nthreads=0, out=None, precision="double"):
     # deposit regular grid onto irregular grid
     # vertices are in units of pixels on the regular source grid
     # which is to say (x,y) = (0,0) corresponds to corner of fluxes[0,0]
     # and (x,y) = (1,1) corresponds to opposite corner of fluxes[0,0]
-    x = vertices[:, :, 0]
-    y = vertices[:, :, 1]
+    # nthreads <= 0 uses all cores. If given, out is overwritten with the
+    # fluxes instead of allocating a new array. precision="single" uses the
+    # float build of r2d, and returns float32 fluxes
+    lib, dtype = _library(precision)
+    vertices = np.ascontiguousarray(vertices, dtype=dtype)
+    source_array = np.ascontiguousarray(source_array, dtype=dtype)
     Nx, Ny = np.array(vertices.shape[:2]) - 1
+    fluxes = _output(out, (Nx, Ny), dtype)
+
+    info = lib.r2d_deposit_mesh(
+        vertices,
+        r2d_dvec2(Nx, Ny),
+        source_array,
+        r2d_dvec2(*source_array.shape),
+        fluxes,
+        nthreads,
+    )
+    if info.good == 0:
+        print("Warning! r2d_deposit_mesh failed: {0}".format(_errmsg(info)))
+
+    return fluxes
+
+
+# number of polynomial coefficients per pixel for each polyorder
+num_moments = [1, 3, 6]
+
+
+def tree_threshold(ncells=None):
+    # number of cells in a quad's index box above which r2d searches it with
+    # a quadtree rather than a flat scan (0 for never). Returns the old
+    # value, and sets a new one if ncells is given
+    old = r2d.r2d_get_tree_threshold()
+    if ncells is not None:
+        r2d.r2d_set_tree_threshold(int(ncells))
+        if r2d_single is not None:
+            r2d_single.r2d_set_tree_threshold(int(ncells))
+    return old
+
+
+def path_counts(vertices, shape, nthreads=0):
+    # how many quads of the irregular grid r2d rasterizes as axis-aligned
+    # rectangles, by integrating along their edges, and by clipping cells,
+    # when depositing from a regular grid of the given shape. Of the clipped
+    # ones, tree and flat say how many were searched with the quadtree
+    vertices = np.ascontiguousarray(vertices, dtype=np.float64)
+    Nx, Ny = np.array(vertices.shape[:2]) - 1
+    source = np.zeros(shape)
     fluxes = np.zeros((Nx, Ny))
+    info = r2d.r2d_deposit_mesh(
+        vertices, r2d_dvec2(Nx, Ny), source, r2d_dvec2(*shape), fluxes, nthreads
+    )
+    return {
+        "rect": info.nrect,
+        "edge": info.nedge,
+        "clip": info.nclip,
+        "tree": info.ntree,
+        "flat": info.nflat,
+    }
+
+
+def deposit_polynomial(
+    coefficients, vertices, nthreads=0, out=None, precision="double"
+):
+    # deposit a regular grid whose pixels hold polynomials onto an irregular
+    # grid, exactly. coefficients is (Nx, Ny, 1, 3 or 6) for constant, linear
+    # or quadratic pixels, giving the coefficients of 1, x, y, x*x, y*y, x*y
+    # with x and y in pixels from each pixel center.
+    # vertices, out and precision are as in deposit
+    lib, dtype = _library(precision)
+    vertices = np.ascontiguousarray(vertices, dtype=dtype)
+    coefficients = np.ascontiguousarray(coefficients, dtype=dtype)
+    polyorder = num_moments.index(coefficients.shape[2])
+    Nx, Ny = np.array(vertices.shape[:2]) - 1
+    fluxes = _output(out, (Nx, Ny), dtype)
+
+    info = lib.r2d_deposit_mesh_poly(
+        vertices,
+        r2d_dvec2(Nx, Ny),
+        coefficients,
+        polyorder,
+        r2d_dvec2(*coefficients.shape[:2]),
+        fluxes,
+        nthreads,
+    )
+    if info.good == 0:
+        print("Warning! r2d_deposit_mesh_poly failed: {0}".format(_errmsg(info)))
 
-    # check that the vertices are within the source_array limits
-    Sx, Sy = np.array(source_array.shape) + 1
+    return fluxes
 
-    for i in range(Nx):
-        for j in range(Ny):
 
-            vertices_ij = np.array(
-                [
-                    [x[i, j], y[i, j]],
-                    [x[i + 1, j], y[i + 1, j]],
-                    [x[i + 1, j + 1], y[i + 1, j + 1]],
-                    [x[i, j + 1], y[i, j + 1]],
-                ]
-            )
+def deposit_stack(source_stack, vertices, nthreads=0, precision="double"):
+    # deposit K regular grids onto the same irregular grid at once. Each quad
+    # is only clipped once, and its overlaps are reused for every image.
+    # source_stack is (K, Nx, Ny), or (K, Nx, Ny, 1, 3 or 6) for polynomial
+    # pixels as in deposit_polynomial. Returns (K, Nx', Ny') fluxes.
+    # vertices and precision are as in deposit
+    lib, dtype = _library(precision)
+    vertices = np.ascontiguousarray(vertices, dtype=dtype)
+    source_stack = np.asarray(source_stack, dtype=dtype)
+    K = source_stack.shape[0]
+    if source_stack.ndim == 3:
+        source_stack = source_stack[..., None]
+    polyorder = num_moments.index(source_stack.shape[3])
+    # the C side wants the images interleaved pixel by pixel
+    coefficients = np.ascontiguousarray(np.moveaxis(source_stack, 0, 2))
+    Nx, Ny = np.array(vertices.shape[:2]) - 1
+    fluxes = np.zeros((Nx, Ny, K), dtype=dtype)
+
+    info = lib.r2d_deposit_mesh_multi(
+        vertices,
+        r2d_dvec2(Nx, Ny),
+        coefficients,
+        K,
+        polyorder,
+        r2d_dvec2(*coefficients.shape[:2]),
+        fluxes,
+        nthreads,
+    )
+    if info.good == 0:
+        print("Warning! r2d_deposit_mesh_multi failed: {0}".format(_errmsg(info)))
+
+    return np.moveaxis(fluxes, 2, 0)
 
-            vertices_ij_floored = vertices_ij - np.floor(np.min(vertices_ij, axis=0))
-            xmin, ymin, xmax, ymax = get_box_index_bounds(vertices_ij)
-            if xmin < 0:
-                xmin = 0
-            if ymin < 0:
-                ymin = 0
-            if xmax >= source_array.shape[0]:
-                xmax = source_array.shape[0] - 1
-            if ymax >= source_array.shape[1]:
-                ymax = source_array.shape[1] - 1
-            source_ij = source_array[xmin : xmax + 1, ymin : ymax + 1]
-            dest_window = np.array([xmax - xmin + 1, ymax - ymin + 1])
-            dest_window = np.where(dest_window > 0, dest_window, 0)
-            overlap_ij = overlap_pixel(
-                vertices_ij_floored,
-                dest_window,
-                vertices_ij,
-                [i, j],
-                get_box_index_bounds(vertices_ij),
+
+def deposit_gradient(source_array, vertices, nthreads=0, precision="double"):
+    # deposit as in deposit, and also return the exact derivatives of each
+    # flux with respect to its quad's corners, (Nx, Ny, 4, 2), with the
+    # corners ordered as in quad_corners. Use vertex_gradient to turn these
+    # into the gradient of a function of the fluxes
+    lib, dtype = _library(precision)
+    vertices = np.ascontiguousarray(vertices, dtype=dtype)
+    source_array = np.ascontiguousarray(source_array, dtype=dtype)
+    Nx, Ny = np.array(vertices.shape[:2]) - 1
+    fluxes = np.zeros((Nx, Ny), dtype=dtype)
+    dfluxes = np.zeros((Nx, Ny, 4, 2), dtype=dtype)
+
+    info = lib.r2d_deposit_mesh_grad(
+        vertices,
+        r2d_dvec2(Nx, Ny),
+        source_array,
+        r2d_dvec2(*source_array.shape),
+        fluxes,
+        dfluxes,
+        nthreads,
+    )
+    if info.good == 0:
+        print("Warning! r2d_deposit_mesh_grad failed: {0}".format(_errmsg(info)))
+
+    return fluxes, dfluxes
+
+
+# most corners r2d takes in a polygon (R2D_MAX_FACES)
+max_polygon_vertices = 64
+
+
+def deposit_polygon(source_array, polygons, nthreads=0, precision="double"):
+    # integrate the regular grid over convex polygons, such as blocks of
+    # merged pixels or object footprints, each clipped in one go rather
+    # than split into quads. A polygon is an (n, 2) array of its corners
+    # in pixels, as for the vertices in deposit, in either orientation,
+    # with 3 <= n <= max_polygon_vertices and no repeats. Given one
+    # polygon this returns its flux, and given a list of them an array of
+    # fluxes. nthreads and precision are as in deposit
+    lib, dtype = _library(precision)
+    single = isinstance(polygons, np.ndarray) and polygons.ndim == 2
+    if single:
+        polygons = [polygons]
+    corners = []
+    for polygon in polygons:
+        polygon = np.asarray(polygon, dtype=dtype)
+        if not 3 <= len(polygon) <= max_polygon_vertices:
+            raise ValueError(
+                "polygons need 3 to {0} corners, not {1}".format(
+                    max_polygon_vertices, len(polygon)
+                )
             )
-            # if j == 6:
-            #     # import ipdb; ipdb.set_trace()
-            if np.any(np.array(overlap_ij.shape) != np.array(source_ij.shape)):
-                print(i, j)
-                print(overlap_ij)
-                print(source_ij)
-                print(vertices_ij_floored)
-                print(vertices_ij)
-                print(xmin, ymin, xmax, ymax)
-                print(vertices.shape, source_array.shape)
-                print(overlap_ij.shape, source_ij.shape)
-            fluxes[i, j] += np.sum(overlap_ij * source_ij)
+        # r2d wants them counterclockwise
+        x = polygon[:, 0]
+        y = polygon[:, 1]
+        if np.sum(x * np.roll(y, -1) - np.roll(x, -1) * y) < 0:
+            polygon = polygon[::-1]
+        corners.append(polygon)
+    fluxes = np.zeros(len(corners), dtype=dtype)
+    if not corners:
+        return fluxes
+    offsets = np.zeros(len(corners) + 1, dtype=np.int64)
+    offsets[1:] = np.cumsum([len(polygon) for polygon in corners])
+    vertices = np.ascontiguousarray(np.concatenate(corners), dtype=dtype)
+    source_array = np.ascontiguousarray(source_array, dtype=dtype)
+
+    info = lib.r2d_deposit_polygons(
+        vertices,
+        offsets,
+        len(corners),
+        source_array,
+        r2d_dvec2(*source_array.shape),
+        fluxes,
+        nthreads,
+    )
+    if info.good == 0:
+        print("Warning! r2d_deposit_polygons failed: {0}".format(_errmsg(info)))
 
+    if single:
+        return fluxes[0]
     return fluxes
 
 
-def skim(source_array, vertices):
-    # TODO: I should be able to do this for the entire grid at once in the C
-    #       program, not pixel by pixel
+def vertex_gradient(dfluxes, weights):
+    # sum_ij weights_ij * dfluxes_ij / dvertices, gathering each quad's four
+    # corner derivatives onto the shared (Nx + 1, Ny + 1, 2) vertices
+    Nx, Ny = dfluxes.shape[:2]
+    dw = dfluxes * weights[:, :, None, None]
+    grad = np.zeros((Nx + 1, Ny + 1, 2))
+    grad[:-1, :-1] += dw[:, :, 0]
+    grad[1:, :-1] += dw[:, :, 1]
+    grad[1:, 1:] += dw[:, :, 2]
+    grad[:-1, 1:] += dw[:, :, 3]
+    return grad
+
+
+def flat_step(vertices, fluxes, true_fluxes, luminosity, step_size, nthreads=0):
+    # one step of FlatMover (without illumination) in place: vertices move by
+    # step_size times the gradient of its lnlike, and fluxes become
+    # luminosity * |area|, as from MoveableGrid.step, in one compiled sweep.
+    # Returns the sums of the squared residuals fluxes - true_fluxes, of the
+    # squared relative changes (new - old) / new of the vertex x and y, and
+    # of those of the fluxes. nthreads <= 0 uses all cores
+    v = np.ascontiguousarray(vertices, dtype=np.float64)
+    f = np.ascontiguousarray(fluxes, dtype=np.float64)
+    Nx, Ny = np.array(v.shape[:2]) - 1
+    if f.shape != (Nx, Ny) or np.shape(true_fluxes) != (Nx, Ny):
+        raise ValueError(
+            "fluxes and true_fluxes must be {0}, not {1} and {2}".format(
+                (Nx, Ny), f.shape, np.shape(true_fluxes)
+            )
+        )
+    sums = np.zeros(4)
+
+    info = r2d.r2d_flat_step(
+        v,
+        r2d_dvec2(Nx, Ny),
+        np.ascontiguousarray(true_fluxes, dtype=np.float64),
+        f,
+        luminosity,
+        step_size,
+        sums,
+        nthreads,
+    )
+    if info.good == 0:
+        raise MemoryError("r2d_flat_step failed: {0}".format(_errmsg(info)))
+    # write back if the arrays had to be copied
+    if v is not vertices:
+        vertices[...] = v
+    if f is not fluxes:
+        fluxes[...] = f
+
+    return sums
+
+
+def skim(source_array, vertices, shape=None, nthreads=0, precision="double"):
     # deposit irregular grid onto regular grid
     # vertices are in units of pixels on the regular grid
     # which is to say (x,y) = (0,0) corresponds to corner of fluxes[0,0]
     # and (x,y) = (1,1) corresponds to opposite corner of fluxes[0,0]
     # key difference here is that now we divide by area of irregular pixel
-
+    #
+    # if shape is None, the returned grid only spans the vertices, starting
+    # at pixel (int(x.min()), int(y.min())). Otherwise it is the full regular
+    # grid of the given shape. nthreads <= 0 uses all cores, and precision
+    # is as in deposit
+    lib, dtype = _library(precision)
+    vertices = np.ascontiguousarray(vertices, dtype=dtype)
+    source_array = np.ascontiguousarray(source_array, dtype=dtype)
     x = vertices[:, :, 0]
     y = vertices[:, :, 1]
     Nx, Ny = np.array(vertices.shape[:2]) - 1
@@ -234,83 +581,253 @@ def skim(source_array, vertices):
     if y.min() < 0:
         print("Warning! y coordinate less than 0 in skimmed grid!")
 
-    # final fluxes
-    xmax_all = int(x.max())
-    xmin_all = int(x.min())
-    ymax_all = int(y.max())
-    ymin_all = int(y.min())
-    fluxes = np.zeros((xmax_all - xmin_all + 1, ymax_all - ymin_all + 1))
-    # fluxes = np.zeros((int(x.max()) + 1, int(y.max()) + 1))
-
-    # unsigned areas of irregular pixels
-    A = (
-        (x[:-1, :-1] - x[1:, 1:]) * (y[:-1, 1:] - y[1:, :-1])
-        - (x[:-1, 1:] - x[1:, :-1]) * (y[:-1, :-1] - y[1:, 1:])
-    ) * 0.5
-    A = np.abs(A)
-
-    # check that the vertices are within the source_array limits
-    Sx, Sy = np.array(source_array.shape) + 1
-
-    for i in range(Nx):
-        for j in range(Ny):
-
-            vertices_ij = np.array(
-                [
-                    [x[i, j], y[i, j]],
-                    [x[i + 1, j], y[i + 1, j]],
-                    [x[i + 1, j + 1], y[i + 1, j + 1]],
-                    [x[i, j + 1], y[i, j + 1]],
-                ]
-            )
+    if shape is None:
+        # final fluxes
+        xmax_all = int(x.max())
+        xmin_all = int(x.min())
+        ymax_all = int(y.max())
+        ymin_all = int(y.min())
+        shape = (xmax_all - xmin_all + 1, ymax_all - ymin_all + 1)
+        vertices = vertices - np.array([xmin_all, ymin_all], dtype=dtype)
+    fluxes = np.zeros(shape, dtype=dtype)
+
+    info = lib.r2d_skim_mesh(
+        vertices,
+        r2d_dvec2(Nx, Ny),
+        source_array,
+        fluxes,
+        r2d_dvec2(*fluxes.shape),
+        nthreads,
+    )
+    if info.good == 0:
+        print("Warning! r2d_skim_mesh failed: {0}".format(_errmsg(info)))
+
+    return fluxes
+
+
+def precision_deviation(source_array, vertices, nthreads=0):
+    # largest absolute and relative differences between the fluxes deposited
+    # by the single and double precision builds of r2d, the latter relative
+    # to the largest double flux
+    double = deposit(source_array, vertices, nthreads)
+    single = deposit(source_array, vertices, nthreads, precision="single")
+    deviation = np.max(np.abs(single - double))
+    return deviation, deviation / np.max(np.abs(double))
+
+
+def quad_corners(vertices):
+    # the four corners of each irregular pixel, (4, Nx, Ny, 2)
+    return np.array(
+        [vertices[:-1, :-1], vertices[1:, :-1], vertices[1:, 1:], vertices[:-1, 1:]]
+    )
+
+
+def quad_areas(vertices):
+    # unsigned area of each irregular pixel, as used by skim
+    r0, r1, r2, r3 = quad_corners(vertices)
+    return 0.5 * np.abs(
+        (r0[..., 0] - r2[..., 0]) * (r3[..., 1] - r1[..., 1])
+        - (r3[..., 0] - r1[..., 0]) * (r0[..., 1] - r2[..., 1])
+    )
+
 
-            vertices_ij_floored = vertices_ij - np.floor(np.min(vertices_ij, axis=0))
-            xmin, ymin, xmax, ymax = get_box_index_bounds(vertices_ij)
-            # apply x_min_all transformation
-            xmin -= xmin_all
-            xmax -= xmin_all
-            ymin -= ymin_all
-            ymax -= ymin_all
-            if xmin < 0:
-                xmin = 0
-            if ymin < 0:
-                ymin = 0
-            if xmax >= fluxes.shape[0]:
-                xmax = fluxes.shape[0] - 1
-            if ymax >= fluxes.shape[1]:
-                ymax = fluxes.shape[1] - 1
-            source_ij = source_array[i, j]  # xmin:xmax + 1, ymin:ymax + 1]
-            dest_window = np.array([xmax - xmin + 1, ymax - ymin + 1])
-            dest_window = np.where(dest_window > 0, dest_window, 0)
-            overlap_ij = overlap_pixel(
-                vertices_ij_floored,
-                dest_window,
-                vertices_ij,
-                [i, j],
-                (xmin, ymin, xmax, ymax),
+def overlap_matrix(vertices, shape, nthreads=0):
+    # sparse (Nx * Ny, shape[0] * shape[1]) matrix of the overlap area of each
+    # irregular pixel with each regular pixel, so that deposit(source, vertices)
+    # is (A @ source.ravel()).reshape(Nx, Ny). vertices are as in deposit
+    vertices = np.ascontiguousarray(vertices, dtype=np.float64)
+    Nx, Ny = np.array(vertices.shape[:2]) - 1
+
+    # pixel bounding boxes of the quads bound the number of nonzeros
+    corners = quad_corners(vertices)
+    lo = np.floor(corners.min(axis=0))
+    hi = np.floor(corners.max(axis=0)) + 1
+    nx = np.clip(hi[..., 0], 0, shape[0]) - np.clip(lo[..., 0], 0, shape[0])
+    ny = np.clip(hi[..., 1], 0, shape[1]) - np.clip(lo[..., 1], 0, shape[1])
+    capacity = int(np.sum(np.clip(nx, 0, None) * np.clip(ny, 0, None)))
+
+    indptr = np.zeros(Nx * Ny + 1, dtype=np.int64)
+    indices = np.zeros(capacity, dtype=np.int64)
+    data = np.zeros(capacity)
+    info = r2d.r2d_overlap_mesh(
+        vertices,
+        r2d_dvec2(Nx, Ny),
+        r2d_dvec2(*shape),
+        indptr,
+        indices,
+        data,
+        capacity,
+        nthreads,
+    )
+    if info.good == 0:
+        print("Warning! r2d_overlap_mesh failed: {0}".format(_errmsg(info)))
+
+    nnz = indptr[-1]
+    return scipy.sparse.csr_matrix(
+        (data[:nnz], indices[:nnz], indptr), shape=(Nx * Ny, shape[0] * shape[1])
+    )
+
+
+def mesh_key(vertices, shape):
+    # hash identifying a mesh and the regular grid it is rasterized onto
+    vertices = np.ascontiguousarray(vertices, dtype=np.float64)
+    sha = hashlib.sha1()
+    sha.update(np.array(vertices.shape + tuple(shape), dtype=np.int64).tobytes())
+    sha.update(vertices.tobytes())
+    return sha.hexdigest()
+
+
+class OverlapOperator(object):
+    """
+    Overlaps of a fixed irregular mesh with a regular grid, rasterized once.
+    After that, deposit and skim are sparse matrix products. Operators can be
+    saved to disk, and cached() picks them up again by the hash of the mesh.
+    """
+
+    def __init__(self, vertices, shape, nthreads=0):
+        self.key = mesh_key(vertices, shape)
+        self.shape = tuple(shape)
+        self.mesh_shape = tuple(np.array(vertices.shape[:2]) - 1)
+        self.matrix = overlap_matrix(vertices, shape, nthreads)
+        self.areas = quad_areas(vertices)
+
+    def deposit(self, source_array):
+        # same as deposit(source_array, vertices)
+        return (self.matrix @ np.ravel(source_array)).reshape(self.mesh_shape)
+
+    def skim(self, source_array):
+        # same as skim(source_array, vertices, shape)
+        C = np.zeros(self.mesh_shape)
+        good = self.areas > 0
+        C[good] = source_array[good] / self.areas[good]
+        return (self.matrix.T @ C.ravel()).reshape(self.shape)
+
+    def save(self, filename):
+        np.savez(
+            filename,
+            key=self.key,
+            shape=self.shape,
+            mesh_shape=self.mesh_shape,
+            indptr=self.matrix.indptr,
+            indices=self.matrix.indices,
+            data=self.matrix.data,
+            areas=self.areas,
+        )
+
+    @classmethod
+    def load(cls, filename):
+        saved = np.load(filename)
+        operator = cls.__new__(cls)
+        operator.key = str(saved["key"])
+        operator.shape = tuple(saved["shape"])
+        operator.mesh_shape = tuple(saved["mesh_shape"])
+        operator.matrix = scipy.sparse.csr_matrix(
+            (saved["data"], saved["indices"], saved["indptr"]),
+            shape=(np.prod(operator.mesh_shape), np.prod(operator.shape)),
+        )
+        operator.areas = saved["areas"]
+        return operator
+
+    @classmethod
+    def cached(cls, vertices, shape, cache_dir, nthreads=0):
+        # load the operator for this mesh from cache_dir, or make and save it
+        filename = os.path.join(
+            cache_dir, "overlap_{0}.npz".format(mesh_key(vertices, shape))
+        )
+        if os.path.exists(filename):
+            return cls.load(filename)
+        operator = cls(vertices, shape, nthreads)
+        if not os.path.exists(cache_dir):
+            os.makedirs(cache_dir)
+        operator.save(filename)
+        return operator
+
+
+if __name__ == "__main__":
+    # report deposit and skim rates against number of threads
+    import argparse
+    import time
+
+    parser = argparse.ArgumentParser(description="time r2d deposit and skim")
+    parser.add_argument("--size", type=int, default=4096, help="mesh is size x size")
+    parser.add_argument("--repeat", type=int, default=3)
+    parser.add_argument(
+        "--stack", type=int, default=0, help="also time a stack of this many images"
+    )
+    parser.add_argument(
+        "--single",
+        action="store_true",
+        help="also time the single precision build, and its deviation from double",
+    )
+    args = parser.parse_args()
+
+    def best_time(func, *fargs):
+        times = []
+        for _ in range(args.repeat):
+            t0 = time.time()
+            func(*fargs)
+            times.append(time.time() - t0)
+        return min(times)
+
+    N = args.size
+    rng = np.random.RandomState(0)
+    source = rng.rand(N, N)
+    vertices = np.stack(
+        np.meshgrid(np.arange(N + 1.0), np.arange(N + 1.0), indexing="ij"), axis=-1
+    )
+    vertices[1:-1, 1:-1] += rng.uniform(-0.2, 0.2, (N - 1, N - 1, 2))
+
+    print(
+        "quads by path: {0}".format(
+            ", ".join(
+                "{0} {1}".format(path, count)
+                for path, count in path_counts(vertices, source.shape).items()
             )
-            A_ij = A[i, j]  # xmin:xmax + 1, ymin:ymax + 1]
-            # if ((j == 5 and i == 5) or
-            #     (j == 5 and i == 4)):
-            #     print(i, j)
-            #     print(overlap_ij.shape)
-            #     print((xmin, xmax), (ymin, ymax))
-            #     print((xmin_all, xmax_all), (ymin_all, ymax_all))
-            #     print((xmax + 1 - xmin), (ymax + 1 - ymin))
-            #     print(vertices_ij)
-            #     print(vertices_ij_floored)
-            #     print(fluxes.shape)
-            #     # print(overlap_ij)
-            #     # print(A_ij)
-            #     # print(overlap_ij / A_ij)
-            #     # print(dest_window)
-            #     # print(source_ij)
-            #     # print(vertices_ij_floored)
-            #     # print(vertices_ij)
-            #     # print(xmin, ymin, xmax, ymax)
-            #     # print(vertices.shape, source_array.shape)
-            #     # print(overlap_ij.shape, source_ij.shape)
-            #     print('\n')
-            fluxes[xmin : xmax + 1, ymin : ymax + 1] += overlap_ij * source_ij / A_ij
+        )
+    )
 
-    return fluxes
+    ncores = os.cpu_count()
+    nthreads = [1]
+    while nthreads[-1] * 2 <= ncores:
+        nthreads.append(nthreads[-1] * 2)
+    if nthreads[-1] != ncores:
+        nthreads.append(ncores)
+
+    print("{0}x{0} mesh, {1} cores".format(N, ncores))
+    print("threads  deposit (s)  deposits/s  skim (s)  skims/s  speedup")
+    for n in nthreads:
+        tdep = best_time(deposit, source, vertices, n)
+        tskim = best_time(skim, source, vertices, source.shape, n)
+        if n == 1:
+            tdep1 = tdep
+        print(
+            "{0:7d}  {1:11.3f}  {2:10.3g}  {3:8.3f}  {4:7.3g}  {5:7.2f}".format(
+                n, tdep, N * N / tdep, tskim, N * N / tskim, tdep1 / tdep
+            )
+        )
+
+    if args.stack:
+        stack = rng.rand(args.stack, N, N)
+        tone = best_time(lambda: [deposit(image, vertices, 0) for image in stack])
+        tstack = best_time(deposit_stack, stack, vertices, 0)
+        print(
+            "{0} images: one at a time {1:.3f} s, stacked {2:.3f} s ({3:.2f}x)".format(
+                args.stack, tone, tstack, tone / tstack
+            )
+        )
+
+    if args.single:
+        tdouble = best_time(deposit, source, vertices, 0)
+        # converted up front, so that only the deposit itself is timed
+        source32 = source.astype(np.float32)
+        vertices32 = vertices.astype(np.float32)
+        tsingle = best_time(
+            lambda: deposit(source32, vertices32, 0, precision="single")
+        )
+        absolute, relative = precision_deviation(source, vertices)
+        print(
+            "single precision: {0:.3f} s against {1:.3f} s ({2:.2f}x), "
+            "max flux deviation {3:.3g} ({4:.3g} relative)".format(
+                tsingle, tdouble, tdouble / tsingle, absolute, relative
+            )
+        )
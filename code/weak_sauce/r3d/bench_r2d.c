@@ -0,0 +1,202 @@
+/*
+ *
+ *
+ *  	bench_r2d.c
+ *
+ *  	Times r2d_deposit_mesh on randomly distorted meshes for each
+ *  	rasterization mode, so that one build can compare them all.
+ *  	Build with "make bench_r2d" and run "./bench_r2d -h" for options.
+ *
+ *
+ */
+
+#include "r2d.h"
+#include <time.h>
+
+#define MAX_LIST 32
+
+// modes to compare. The noclip ones give the cost of clipping by difference
+typedef struct {
+	const char* name;
+	r2d_int mode;
+} bench_mode;
+
+static const bench_mode all_modes[] = {
+	{"analytic", 0},
+	{"flat", R2D_NO_ANALYTIC},
+	{"flat-noclip", R2D_NO_ANALYTIC | R2D_NO_CLIPPING},
+	{"tree", R2D_TREE | R2D_NO_ANALYTIC},
+	{"tree-noclip", R2D_TREE | R2D_NO_ANALYTIC | R2D_NO_CLIPPING},
+};
+#define NUM_MODES (sizeof(all_modes)/sizeof(bench_mode))
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1.0e-9*ts.tv_nsec;
+}
+
+// xorshift, so that meshes are the same everywhere
+static uint64_t rng_state = 88172645463325252ULL;
+static double uniform() {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return (rng_state >> 11)*(1.0/9007199254740992.0);
+}
+
+// parses a comma-separated list of numbers
+static int parse_list(char* arg, double* vals) {
+	int n = 0;
+	char* tok;
+	for(tok = strtok(arg, ","); tok && n < MAX_LIST; tok = strtok(NULL, ","))
+		vals[n++] = atof(tok);
+	return n;
+}
+
+static void usage(const char* prog) {
+	printf("usage: %s [-s sizes] [-d distortions] [-m modes] [-r repeats] [-t threads]\n", prog);
+	printf("  -s  comma-separated mesh sizes N, for N x N quads on an N x N image (default 50,500,4096)\n");
+	printf("  -d  comma-separated vertex jitter amplitudes, in pixels (default 0,0.01,0.1,0.3)\n");
+	printf("  -m  comma-separated modes (default all):");
+	for(unsigned int m = 0; m < NUM_MODES; ++m) printf(" %s", all_modes[m].name);
+	printf("\n  -r  best of this many runs, up to a few seconds (default 3)\n");
+	printf("  -t  threads for r2d_deposit_mesh (default 1)\n");
+}
+
+int main(int argc, char** argv) {
+
+	double sizes[MAX_LIST] = {50, 500, 4096};
+	double dists[MAX_LIST] = {0.0, 0.01, 0.1, 0.3};
+	int nsizes = 3, ndists = 4, repeats = 3, nthreads = 1;
+	int use[NUM_MODES], nuse;
+	double tbest[NUM_MODES];
+	r2d_info infos[NUM_MODES];
+	int a, s, d, r, i, j, noclip;
+	unsigned int m, mm;
+	r2d_int N;
+	r2d_dvec2 dims;
+	r2d_real *verts, *source, *fluxes;
+	r2d_info info;
+	double t0, t, spent, ncells, nquads, nsclip;
+	char* tok;
+
+	for(m = 0; m < NUM_MODES; ++m) use[m] = 1;
+	for(a = 1; a < argc; ++a) {
+		if(!strcmp(argv[a], "-h")) {
+			usage(argv[0]);
+			return 0;
+		}
+		if(a + 1 >= argc) {
+			usage(argv[0]);
+			return 1;
+		}
+		if(!strcmp(argv[a], "-s")) nsizes = parse_list(argv[++a], sizes);
+		else if(!strcmp(argv[a], "-d")) ndists = parse_list(argv[++a], dists);
+		else if(!strcmp(argv[a], "-r")) repeats = atoi(argv[++a]);
+		else if(!strcmp(argv[a], "-t")) nthreads = atoi(argv[++a]);
+		else if(!strcmp(argv[a], "-m")) {
+			for(m = 0; m < NUM_MODES; ++m) use[m] = 0;
+			for(tok = strtok(argv[++a], ","); tok; tok = strtok(NULL, ",")) {
+				for(m = 0; m < NUM_MODES; ++m)
+					if(!strcmp(tok, all_modes[m].name)) use[m] = 1;
+			}
+		}
+		else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	for(nuse = 0, m = 0; m < NUM_MODES; ++m) nuse += use[m];
+	if(!nuse || repeats < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	printf("%6s %8s %-12s %12s %10s %10s %7s %7s %7s %7s %7s %7s\n", "size", "distort", "mode",
+			"quads/s", "ns/quad", "ns/clip", "in%", "bnd%", "out%", "rect%", "edge%", "clip%");
+
+	for(s = 0; s < nsizes; ++s) {
+
+		N = (r2d_int) sizes[s];
+		dims.x = N;
+		dims.y = N;
+		verts = (r2d_real*) malloc((size_t) 2*(N+1)*(N+1)*sizeof(r2d_real));
+		source = (r2d_real*) malloc((size_t) N*N*sizeof(r2d_real));
+		fluxes = (r2d_real*) malloc((size_t) N*N*sizeof(r2d_real));
+		if(!verts || !source || !fluxes) {
+			printf("Could not allocate a %d x %d mesh\n", N, N);
+			return 1;
+		}
+		for(i = 0; i < N*N; ++i) source[i] = uniform();
+
+		for(d = 0; d < ndists; ++d) {
+
+			// a regular grid with its interior vertices jittered
+			for(i = 0; i <= N; ++i)
+			for(j = 0; j <= N; ++j) {
+				verts[2*((N+1)*i + j)] = i;
+				verts[2*((N+1)*i + j) + 1] = j;
+				if(i > 0 && i < N && j > 0 && j < N) {
+					verts[2*((N+1)*i + j)] += dists[d]*(2.0*uniform() - 1.0);
+					verts[2*((N+1)*i + j) + 1] += dists[d]*(2.0*uniform() - 1.0);
+				}
+			}
+
+			for(m = 0; m < NUM_MODES; ++m) {
+				if(!use[m]) continue;
+				r2d_set_default_mode(all_modes[m].mode);
+				tbest[m] = 1.0e99;
+				spent = 0.0;
+				for(r = 0; r < repeats && (r == 0 || spent < 3.0); ++r) {
+					t0 = now();
+					info = r2d_deposit_mesh(verts, dims, source, dims, fluxes, nthreads);
+					t = now() - t0;
+					spent += t;
+					if(t < tbest[m]) tbest[m] = t;
+				}
+				if(!info.good) printf("r2d_deposit_mesh failed: %s\n", info.errmsg);
+				infos[m] = info;
+			}
+
+			for(m = 0; m < NUM_MODES; ++m) {
+				if(!use[m]) continue;
+				info = infos[m];
+				printf("%6d %8.3g %-12s %12.4g %10.1f", N, dists[d], all_modes[m].name,
+						(double) N*N/tbest[m], 1.0e9*tbest[m]/((double) N*N));
+
+				// clipping cost from the same traversal without clipping
+				noclip = -1;
+				if(!(all_modes[m].mode & R2D_NO_CLIPPING))
+				for(mm = 0; mm < NUM_MODES; ++mm)
+					if(use[mm] && all_modes[mm].mode == (all_modes[m].mode | R2D_NO_CLIPPING)) noclip = mm;
+				if(noclip >= 0 && info.num_clip > 0) {
+					nsclip = 1.0e9*(tbest[m] - tbest[noclip])/info.num_clip;
+					printf(" %10.1f", nsclip);
+				}
+				else printf(" %10s", "-");
+
+				// cell fractions, for the quads that went through the grid search
+				ncells = (double) info.num_in + info.num_clip + info.num_out;
+				if(ncells > 0)
+					printf(" %7.2f %7.2f %7.2f", 100.0*info.num_in/ncells,
+							100.0*info.num_clip/ncells, 100.0*info.num_out/ncells);
+				else
+					printf(" %7s %7s %7s", "-", "-", "-");
+
+				// and the fractions of quads taking each path, since the
+				// closed-form ones do not sort their cells
+				nquads = (double) info.nrect + info.nedge + info.nclip;
+				if(nquads > 0)
+					printf(" %7.2f %7.2f %7.2f\n", 100.0*info.nrect/nquads,
+							100.0*info.nedge/nquads, 100.0*info.nclip/nquads);
+				else
+					printf(" %7s %7s %7s\n", "-", "-", "-");
+			}
+		}
+		free(verts);
+		free(source);
+		free(fluxes);
+	}
+	return 0;
+}
@@ -0,0 +1,211 @@
+/*
+ *
+ *
+ *  	bench_r3d.c
+ *
+ *  	Times r3d_voxelize_mesh on the tets of a randomly distorted cubic mesh,
+ *  	for each voxelization mode.
+ *  	Build with "make bench_r3d" and run "./bench_r3d -h" for options.
+ *
+ *
+ */
+
+#include "r3d.h"
+
+#define MAX_LIST 32
+
+// modes to compare. The noclip ones give the cost of clipping by difference
+typedef struct {
+	const char* name;
+	r3d_int mode;
+} bench_mode;
+
+static const bench_mode all_modes[] = {
+	{"flat", 0},
+	{"flat-noclip", R3D_NO_CLIPPING},
+	{"tree", R3D_TREE},
+	{"tree-noclip", R3D_TREE | R3D_NO_CLIPPING},
+};
+#define NUM_MODES (sizeof(all_modes)/sizeof(bench_mode))
+
+// the six tets of a cube, as paths from corner 0 to corner 7
+static const r3d_int cube_tets[6][4] = {
+	{0, 1, 3, 7}, {0, 1, 5, 7}, {0, 2, 3, 7},
+	{0, 2, 6, 7}, {0, 4, 5, 7}, {0, 4, 6, 7},
+};
+
+// xorshift, so that meshes are the same everywhere
+static uint64_t rng_state = 88172645463325252ULL;
+static double uniform() {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return (rng_state >> 11)*(1.0/9007199254740992.0);
+}
+
+// parses a comma-separated list of numbers
+static int parse_list(char* arg, double* vals) {
+	int n = 0;
+	char* tok;
+	for(tok = strtok(arg, ","); tok && n < MAX_LIST; tok = strtok(NULL, ","))
+		vals[n++] = atof(tok);
+	return n;
+}
+
+static void usage(const char* prog) {
+	printf("usage: %s [-s sizes] [-d distortions] [-m modes] [-r repeats] [-t threads]\n", prog);
+	printf("  -s  comma-separated mesh sizes N, for 6 N^3 tets on an N^3 grid (default 16,32,64)\n");
+	printf("  -d  comma-separated vertex jitter amplitudes, in cells (default 0,0.01,0.1,0.3)\n");
+	printf("  -m  comma-separated modes (default all):");
+	for(unsigned int m = 0; m < NUM_MODES; ++m) printf(" %s", all_modes[m].name);
+	printf("\n  -r  best of this many runs, up to a few seconds (default 3)\n");
+	printf("  -t  threads for r3d_voxelize_mesh (default 1)\n");
+}
+
+int main(int argc, char** argv) {
+
+	double sizes[MAX_LIST] = {16, 32, 64};
+	double dists[MAX_LIST] = {0.0, 0.01, 0.1, 0.3};
+	int nsizes = 3, ndists = 4, repeats = 3, nthreads = 1;
+	int use[NUM_MODES], nuse;
+	double tbest[NUM_MODES];
+	r3d_info infos[NUM_MODES];
+	int a, s, d, r, i, j, k, c, v, noclip;
+	unsigned int m, mm;
+	r3d_int N;
+	r3d_long ntets, nverts, t;
+	r3d_real* verts;
+	r3d_long* tets;
+	r3d_real* image;
+	r3d_dest_grid grid;
+	r3d_info info;
+	double spent, ncells, nsclip;
+	char* tok;
+
+	for(m = 0; m < NUM_MODES; ++m) use[m] = 1;
+	for(a = 1; a < argc; ++a) {
+		if(!strcmp(argv[a], "-h")) {
+			usage(argv[0]);
+			return 0;
+		}
+		if(a + 1 >= argc) {
+			usage(argv[0]);
+			return 1;
+		}
+		if(!strcmp(argv[a], "-s")) nsizes = parse_list(argv[++a], sizes);
+		else if(!strcmp(argv[a], "-d")) ndists = parse_list(argv[++a], dists);
+		else if(!strcmp(argv[a], "-r")) repeats = atoi(argv[++a]);
+		else if(!strcmp(argv[a], "-t")) nthreads = atoi(argv[++a]);
+		else if(!strcmp(argv[a], "-m")) {
+			for(m = 0; m < NUM_MODES; ++m) use[m] = 0;
+			for(tok = strtok(argv[++a], ","); tok; tok = strtok(NULL, ",")) {
+				for(m = 0; m < NUM_MODES; ++m)
+					if(!strcmp(tok, all_modes[m].name)) use[m] = 1;
+			}
+		}
+		else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	for(nuse = 0, m = 0; m < NUM_MODES; ++m) nuse += use[m];
+	for(d = 0; d < ndists; ++d) if(dists[d] < 0.0 || dists[d] >= 0.5) nuse = 0;
+	if(!nuse || repeats < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	memset(&grid, 0, sizeof(grid));
+	grid.polyorder = 0;
+	grid.d.x = grid.d.y = grid.d.z = 1.0;
+
+	printf("%6s %8s %-12s %12s %10s %10s %7s %7s %7s\n", "size", "distort", "mode",
+			"tets/s", "ns/tet", "ns/clip", "in%", "bnd%", "out%");
+
+	for(s = 0; s < nsizes; ++s) {
+
+		N = (r3d_int) sizes[s];
+		ntets = 6*(r3d_long) N*N*N;
+		nverts = (r3d_long)(N+1)*(N+1)*(N+1);
+		verts = (r3d_real*) malloc(3*nverts*sizeof(r3d_real));
+		tets = (r3d_long*) malloc(4*ntets*sizeof(r3d_long));
+		image = (r3d_real*) malloc((r3d_long) N*N*N*sizeof(r3d_real));
+		if(!verts || !tets || !image) {
+			printf("Could not allocate a %d^3 mesh\n", N);
+			return 1;
+		}
+		grid.n.i = grid.n.j = grid.n.k = N;
+		grid.moments[0] = image;
+
+		// six tets per cube
+		t = 0;
+		for(i = 0; i < N; ++i)
+		for(j = 0; j < N; ++j)
+		for(k = 0; k < N; ++k)
+		for(c = 0; c < 6; ++c, ++t)
+		for(v = 0; v < 4; ++v)
+			tets[4*t + v] = ((r3d_long)(i + ((cube_tets[c][v] >> 2) & 1))*(N+1)
+					+ j + ((cube_tets[c][v] >> 1) & 1))*(N+1) + k + (cube_tets[c][v] & 1);
+
+		for(d = 0; d < ndists; ++d) {
+
+			// a regular grid with its interior vertices jittered
+			for(i = 0; i <= N; ++i)
+			for(j = 0; j <= N; ++j)
+			for(k = 0; k <= N; ++k) {
+				r3d_real* vp = &verts[3*(((r3d_long) i*(N+1) + j)*(N+1) + k)];
+				vp[0] = i;
+				vp[1] = j;
+				vp[2] = k;
+				if(i > 0 && i < N && j > 0 && j < N && k > 0 && k < N) {
+					vp[0] += dists[d]*(2.0*uniform() - 1.0);
+					vp[1] += dists[d]*(2.0*uniform() - 1.0);
+					vp[2] += dists[d]*(2.0*uniform() - 1.0);
+				}
+			}
+
+			for(m = 0; m < NUM_MODES; ++m) {
+				if(!use[m]) continue;
+				grid.mode = all_modes[m].mode;
+				tbest[m] = 1.0e99;
+				spent = 0.0;
+				for(r = 0; r < repeats && (r == 0 || spent < 3.0); ++r) {
+					memset(image, 0, (r3d_long) N*N*N*sizeof(r3d_real));
+					info = r3d_voxelize_mesh(verts, tets, ntets, grid, nthreads);
+					spent += info.seconds;
+					if(info.seconds < tbest[m]) tbest[m] = info.seconds;
+				}
+				if(!info.good) printf("r3d_voxelize_mesh failed\n");
+				infos[m] = info;
+			}
+
+			for(m = 0; m < NUM_MODES; ++m) {
+				if(!use[m]) continue;
+				info = infos[m];
+				printf("%6d %8.3g %-12s %12.4g %10.1f", N, dists[d], all_modes[m].name,
+						ntets/tbest[m], 1.0e9*tbest[m]/ntets);
+
+				// clipping cost from the same traversal without clipping
+				noclip = -1;
+				if(!(all_modes[m].mode & R3D_NO_CLIPPING))
+				for(mm = 0; mm < NUM_MODES; ++mm)
+					if(use[mm] && all_modes[mm].mode == (all_modes[m].mode | R3D_NO_CLIPPING)) noclip = mm;
+				if(noclip >= 0 && info.num_clip > 0) {
+					nsclip = 1.0e9*(tbest[m] - tbest[noclip])/info.num_clip;
+					printf(" %10.1f", nsclip);
+				}
+				else printf(" %10s", "-");
+
+				ncells = (double) info.num_in + info.num_clip + info.num_out;
+				if(ncells > 0)
+					printf(" %7.2f %7.2f %7.2f\n", 100.0*info.num_in/ncells,
+							100.0*info.num_clip/ncells, 100.0*info.num_out/ncells);
+				else
+					printf(" %7s %7s %7s\n", "-", "-", "-");
+			}
+		}
+		free(verts);
+		free(tets);
+		free(image);
+	}
+	return 0;
+}
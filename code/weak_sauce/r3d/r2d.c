@@ -12,11 +12,17 @@
  */
 
 #include "r2d.h"
+#include <pthread.h>
+#include <unistd.h>
 
 // tells us which bit signals a clipped vertex
 // the last one - leaving seven to flag faces
 #define CLIP_MASK 0x80 
-#define CLIP_MASK_64 0x8000000000000000 
+
+// useful constants
+#define ONE_THIRD 0.333333333333333333333333333333333333333333333333333333
+#define ONE_SIXTH 0.166666666666666666666666666666666666666666666666666667
+#define ONE_TWELFTH 0.0833333333333333333333333333333333333333333333333333333
 
 // macros for vector manipulation
 #define dot(va, vb) (va.x*vb.x + va.y*vb.y)
@@ -30,6 +36,22 @@
 	v.y /= (tmplen + 1.0e-299);		\
 }
 
+// compiles the hot scalar kernels (the clipping and reduction inlined into
+// r2d_ctx_rasterize_quad, the closed-form paths, and the scalar orientation
+// fallback) once for each ISA level, and has the dynamic loader bind the best
+// one for the CPU through an ifunc. The AVX-512 levels also allow FMA, so
+// the Makefile passes -ffp-contract=off to have every node round the same
+// way. Needs GCC or clang on x86-64 Linux; elsewhere, or with -DNO_SIMD, each
+// kernel is compiled once for the baseline ISA
+#if !defined(NO_SIMD) && defined(__GNUC__) && defined(__x86_64__) && defined(__linux__) && defined(__has_attribute)
+#if __has_attribute(target_clones)
+#define R2D_TARGET_CLONES __attribute__((target_clones("default", "sse4.2", "avx2", "avx512f")))
+#endif
+#endif
+#ifndef R2D_TARGET_CLONES
+#define R2D_TARGET_CLONES
+#endif
+
 double
 TestWoot(double x)
 {
@@ -38,13 +60,31 @@ TestWoot(double x)
     return x2 + 1;
 }
 
-// dest grid (global for now)
-static r2d_real* r2d_dest_grid;
-static r2d_dvec2 r2d_dest_dims;
-static r2d_rvec2 r2d_d;
+// context behind the global (non-reentrant) API
+static r2d_context r2d_global_ctx;
+
+// mode given to new contexts. The compile-time flags only set its
+// starting value, so that one build can time every variant
+static r2d_int r2d_default_mode = 0
+#ifdef USE_TREE
+	| R2D_TREE
+#endif
+#ifdef NO_SHIFTING
+	| R2D_NO_SHIFTING
+#endif
+#ifdef NO_CLIPPING
+	| R2D_NO_CLIPPING
+#endif
+#ifdef NO_REDUCTION
+	| R2D_NO_REDUCTION
+#endif
+#ifdef NO_ANALYTIC
+	| R2D_NO_ANALYTIC
+#endif
+	;
 
-// return information (global)
-static r2d_info current_info;
+// tree threshold given to new contexts
+static r2d_long r2d_default_tree_threshold = R2D_TREE_THRESHOLD;
 
 //////////////// r2du: utility functions for r2d ///////////////////
 //////////////////////////////////////////////////////////////////
@@ -88,6 +128,12 @@ inline void r2du_clip_quad(r2d_vertex* vertbuffer, r2d_int* nverts, unsigned cha
 		searching = 1;
 		while(searching) { 
 			vnext = vertbuffer[vcur].pnbrs[1];
+			if(vnext == vstart) {
+				// made it all the way around, so what is left of the
+				// polygon lies entirely outside this face. Nothing remains.
+				vertbuffer[vcur].fflags |= CLIP_MASK;
+				return;
+			}
 			if(fmask & vertbuffer[vnext].fflags) {
 				// vnext is inside the face
 
@@ -169,35 +215,217 @@ inline void r2du_clip_quad(r2d_vertex* vertbuffer, r2d_int* nverts, unsigned cha
 	}
 }
 
-inline void r2du_reduce(r2d_vertex* vertbuffer, r2d_int* nverts, r2d_real C, r2d_long flatind) {
+// adds the moments of the triangle (0, v0, v1), up to polyorder
+static inline void r2du_tri_moments(r2d_rvec2 v0, r2d_rvec2 v1, r2d_int polyorder, r2d_real* moments) {
+
+	r2d_real tetvol = 0.5*(v0.x*v1.y - v0.y*v1.x); 
+	moments[0] += tetvol; 
+
+	// higher moments of the triangle (0, v0, v1)
+	if(polyorder >= 1) {
+		moments[1] += ONE_THIRD*tetvol*(v0.x + v1.x); // x
+		moments[2] += ONE_THIRD*tetvol*(v0.y + v1.y); // y
+	}
+	if(polyorder >= 2) {
+		moments[3] += ONE_SIXTH*tetvol*(v0.x*v0.x + v0.x*v1.x + v1.x*v1.x); // x*x
+		moments[4] += ONE_SIXTH*tetvol*(v0.y*v0.y + v0.y*v1.y + v1.y*v1.y); // y*y
+		moments[5] += ONE_TWELFTH*tetvol*(2.0*v0.x*v0.y + v0.x*v1.y + v1.x*v0.y + 2.0*v1.x*v1.y); // x*y
+	}
+}
+
+// shifts the moments of a clipped cell from the vertex frame to the grid
+// frame, and adds C times them to the destination
+static inline void r2du_ctx_add_clipped(r2d_context* ctx, r2d_real C, r2d_real* moments, r2d_long flatind, r2d_rvec2 origin) {
+
+	unsigned char m;
+	r2d_real locvol = moments[0];
+
+	if(ctx->polyorder >= 2) {
+		moments[3] += 2.0*origin.x*moments[1] + origin.x*origin.x*moments[0];
+		moments[4] += 2.0*origin.y*moments[2] + origin.y*origin.y*moments[0];
+		moments[5] += origin.x*moments[2] + origin.y*moments[1] + origin.x*origin.y*moments[0];
+	}
+	if(ctx->polyorder >= 1) {
+		moments[1] += origin.x*moments[0];
+		moments[2] += origin.y*moments[0];
+	}
+
+	for(m = 0; m < r2d_num_moments[ctx->polyorder]; ++m)
+		ctx->moments[m][flatind] += C*moments[m];
+
+	ctx->info.vtot += locvol;
+	if(locvol < ctx->info.vox_min) ctx->info.vox_min = locvol;
+	if(locvol > ctx->info.vox_max) ctx->info.vox_max = locvol;
+}
+
+inline void r2du_ctx_reduce(r2d_context* ctx, r2d_vertex* vertbuffer, r2d_int* nverts, r2d_real C, r2d_long flatind, r2d_rvec2 origin) {
 
-	r2d_real tetvol, locvol;
-	unsigned char v;
-	r2d_rvec2 v0, v1; 
+	r2d_real moments[6];
+	unsigned char v, m;
 
 	// iterate over vertices and compute sum for this voxel
-	locvol = 0.0;
+	for(m = 0; m < 6; ++m)
+		moments[m] = 0.0;
 
 	// finally, get the moments of each decomposed simplex
 	for(v = 0; v < *nverts; ++v) {
 		if(vertbuffer[v].fflags & CLIP_MASK) continue;
-		v0 = vertbuffer[v].pos;
-		v1 = vertbuffer[vertbuffer[v].pnbrs[1]].pos;
+		r2du_tri_moments(vertbuffer[v].pos, vertbuffer[vertbuffer[v].pnbrs[1]].pos, ctx->polyorder, moments);
+	}
+	r2du_ctx_add_clipped(ctx, C, moments, flatind, origin);
+}
+
+// Clips a cell against up to R2D_MAX_FACES faces, as r2du_clip_quad does
+// against four. Needs room for 2*nfaces more vertices in vertbuffer.
+inline void r2du_clip_n(r2d_vertex64* vertbuffer, r2d_int* nverts, r2d_ulong andcmp, r2d_int nfaces) {
+
+	r2d_int v, f, ff;
+	r2d_int vstart, vnext, vcur, searching;
+	r2d_ulong fmask, ffmask;
+
+	// loop over faces
+	for(f = 0; f < nfaces; ++f) {
+
+		fmask = ((r2d_ulong) 1 << f);
+		if(andcmp & fmask) continue;
+
+		// find the first vertex lying outside of the face
+		// only need to find one (taking advantage of convexity)
+		vcur = -1;
+		for(v = 0; vcur < 0 && v < *nverts; ++v) 
+			if(!vertbuffer[v].clipped && !(vertbuffer[v].fflags & fmask)) vcur = v;
+		if(vcur < 0) continue;
+
+		// traverse to the right
+		vstart = vcur;
+		searching = 1;
+		while(searching) { 
+			vnext = vertbuffer[vcur].pnbrs[1];
+			if(vnext == vstart) {
+				// made it all the way around, so nothing remains
+				vertbuffer[vcur].clipped = 1;
+				return;
+			}
+			if(fmask & vertbuffer[vnext].fflags) {
+				// vnext is inside the face
+
+				// compute the intersection point using a weighted
+				// average of perpendicular distances to the plane
+				wav(vertbuffer[vcur].pos, vertbuffer[vnext].fdist[f],
+					vertbuffer[vnext].pos, -vertbuffer[vcur].fdist[f],
+					vertbuffer[*nverts].pos);
+				
+				vertbuffer[*nverts].pnbrs[1] = vnext;
+
+				// reciprocal connetivity
+				vertbuffer[vnext].pnbrs[0] = *nverts;
+
+				// do face intersections and flags
+				vertbuffer[*nverts].fflags = 0x00;
+				vertbuffer[*nverts].clipped = 0;
+				for(ff = f + 1; ff < nfaces; ++ff) {
+
+					// skip if all initial verts are inside ff
+					ffmask = ((r2d_ulong) 1 << ff); 
+					if(andcmp & ffmask) continue;
+
+					// weighted average keeps us in a relative coordinate system
+					vertbuffer[*nverts].fdist[ff] = (vertbuffer[vcur].fdist[ff]*vertbuffer[vnext].fdist[f] 
+							- vertbuffer[vnext].fdist[ff]*vertbuffer[vcur].fdist[f])
+							/(vertbuffer[vnext].fdist[f] - vertbuffer[vcur].fdist[f]);
+					if(vertbuffer[*nverts].fdist[ff] > 0.0) vertbuffer[*nverts].fflags |= ffmask;
+				}
+				++(*nverts);
+				searching = 0;
+			}
+			vertbuffer[vcur].clipped = 1;
+			vcur = vnext;
+		}
+
+		// traverse to the left
+		vcur = vstart;
+		searching = 1;
+		while(searching) { 
+			vnext = vertbuffer[vcur].pnbrs[0];
+			if(fmask & vertbuffer[vnext].fflags) {
+				// vnext is inside the face
+
+				// compute the intersection point using a weighted
+				// average of perpendicular distances to the plane
+				wav(vertbuffer[vcur].pos, vertbuffer[vnext].fdist[f],
+					vertbuffer[vnext].pos, -vertbuffer[vcur].fdist[f],
+					vertbuffer[*nverts].pos);
+				
+				vertbuffer[*nverts].pnbrs[0] = vnext;
+
+				// reciprocal connetivity
+				vertbuffer[vnext].pnbrs[1] = *nverts;
+
+				// do face intersections and flags
+				vertbuffer[*nverts].fflags = 0x00;
+				vertbuffer[*nverts].clipped = 0;
+				for(ff = f + 1; ff < nfaces; ++ff) {
+
+					// skip if all verts are inside ff
+					ffmask = ((r2d_ulong) 1 << ff); 
+					if(andcmp & ffmask) continue;
+
+					// weighted average keeps us in a relative coordinate system
+					vertbuffer[*nverts].fdist[ff] = (vertbuffer[vcur].fdist[ff]*vertbuffer[vnext].fdist[f] 
+							- vertbuffer[vnext].fdist[ff]*vertbuffer[vcur].fdist[f])
+							/(vertbuffer[vnext].fdist[f] - vertbuffer[vcur].fdist[f]);
+					if(vertbuffer[*nverts].fdist[ff] > 0.0) vertbuffer[*nverts].fflags |= ffmask;
+				}
+				++(*nverts);
+				searching = 0;
+			}
+			vertbuffer[vcur].clipped = 1;
+			vcur = vnext;
+		}
+		vertbuffer[*nverts-2].pnbrs[0] = *nverts-1; 
+		vertbuffer[*nverts-1].pnbrs[1] = *nverts-2;
+	}
+}
 
-		tetvol = 0.5*(v0.x*v1.y - v0.y*v1.x); 
-		locvol += tetvol; 
+inline void r2du_ctx_reduce_n(r2d_context* ctx, r2d_vertex64* vertbuffer, r2d_int* nverts, r2d_real C, r2d_long flatind, r2d_rvec2 origin) {
 
-		/*
-		 * HIGHER_ORDER MOMENTS, TO BE IMPLEMENTED.
-		*/
+	r2d_real moments[6];
+	r2d_int v, m;
+
+	for(m = 0; m < 6; ++m)
+		moments[m] = 0.0;
+	for(v = 0; v < *nverts; ++v) {
+		if(vertbuffer[v].clipped) continue;
+		r2du_tri_moments(vertbuffer[v].pos, vertbuffer[vertbuffer[v].pnbrs[1]].pos, ctx->polyorder, moments);
 	}
+	r2du_ctx_add_clipped(ctx, C, moments, flatind, origin);
+}
+
+void r2du_reduce(r2d_vertex* vertbuffer, r2d_int* nverts, r2d_real C, r2d_long flatind) {
+	r2d_rvec2 origin = {0.0, 0.0};
+	r2du_ctx_reduce(&r2d_global_ctx, vertbuffer, nverts, C, flatind, origin);
+}
+
+// adds the moments of grid cell (i, j), which lies entirely inside the primitive
+static inline void r2du_ctx_fill_cell(r2d_context* ctx, r2d_real C, r2d_int i, r2d_int j, r2d_long flatind) {
 
-	r2d_dest_grid[flatind] += C*locvol;
+	r2d_real locvol = ctx->d.x*ctx->d.y;
+	r2d_real* const* mom = ctx->moments;
 
-	current_info.vtot += locvol;
-	if(locvol < current_info.vox_min) current_info.vox_min = locvol;
-	if(locvol > current_info.vox_max) current_info.vox_max = locvol;
+	mom[0][flatind] += C*locvol; // 1
+	if(ctx->polyorder >= 1) {
+		mom[1][flatind] += C*locvol*ctx->d.x*(i + 0.5); // x
+		mom[2][flatind] += C*locvol*ctx->d.y*(j + 0.5); // y
+	}
+	if(ctx->polyorder >= 2) {
+		mom[3][flatind] += C*locvol*ONE_THIRD*ctx->d.x*ctx->d.x*(1 + 3.0*i + 3.0*i*i); // x*x
+		mom[4][flatind] += C*locvol*ONE_THIRD*ctx->d.y*ctx->d.y*(1 + 3.0*j + 3.0*j*j); // y*y
+		mom[5][flatind] += C*locvol*0.25*ctx->d.x*ctx->d.y*(1 + 2.0*i)*(1 + 2.0*j); // x*y
+	}
 
+	ctx->info.vtot += locvol;
+	if(locvol < ctx->info.vox_min) ctx->info.vox_min = locvol;
+	if(locvol > ctx->info.vox_max) ctx->info.vox_max = locvol;
 }
 
 inline void r2du_init_box(r2d_vertex* vertbuffer, r2d_int* nverts, r2d_rvec2 rbounds[2]) {
@@ -243,37 +471,32 @@ inline void r2du_faces_from_verts(r2d_rvec2* verts, r2d_int nverts, r2d_plane* f
 	}
 }
 
-inline void r2du_get_box_index_bounds(r2d_dvec2* ibounds, r2d_real xmin, r2d_real ymin,
+inline void r2du_ctx_get_box_index_bounds(r2d_context* ctx, r2d_dvec2* ibounds,
+										r2d_real xmin, r2d_real ymin,
 										r2d_real xmax, r2d_real ymax) {
 	// get integer bounds
-	ibounds[0].x = floor(xmin/r2d_d.x);
-	ibounds[0].y = floor(ymin/r2d_d.y);
-	ibounds[1].x = ceil(xmax/r2d_d.x);
-	ibounds[1].y = ceil(ymax/r2d_d.y);
+	ibounds[0].x = floor(xmin/ctx->d.x);
+	ibounds[0].y = floor(ymin/ctx->d.y);
+	ibounds[1].x = ceil(xmax/ctx->d.x);
+	ibounds[1].y = ceil(ymax/ctx->d.y);
 
 	// and clamp to the projection window
 	if(ibounds[0].x < 0) ibounds[0].x = 0;
 	if(ibounds[0].y < 0) ibounds[0].y = 0;
-	if(ibounds[1].x > r2d_dest_dims.x) ibounds[1].x = r2d_dest_dims.x;
-	if(ibounds[1].y > r2d_dest_dims.y) ibounds[1].y = r2d_dest_dims.y;
+	if(ibounds[1].x > ctx->dest_dims.x) ibounds[1].x = ctx->dest_dims.x;
+	if(ibounds[1].y > ctx->dest_dims.y) ibounds[1].y = ctx->dest_dims.y;
 
 }
 
+void r2du_get_box_index_bounds(r2d_dvec2* ibounds, r2d_real xmin, r2d_real ymin,
+										r2d_real xmax, r2d_real ymax) {
+	r2du_ctx_get_box_index_bounds(&r2d_global_ctx, ibounds, xmin, ymin, xmax, ymax);
+}
+
 //////////////////////////////////////////
 /// r2d //////////////////////////////////
 //////////////////////////////////////////
 
-typedef struct {
-	r2d_real fdist[4];
-	unsigned char fflags;
-} r2d_gridpoint;
-
-// typedef struct {
-// 	r2d_real fdist[64];
-// 	r2d_ulong fflags;
-// } r2d_gridpoint64;
-
-#ifdef USE_TREE
 // tree node for recursive splitting
 typedef struct {
 	r2d_int imin, jmin;
@@ -281,724 +504,799 @@ typedef struct {
 	r2d_gridpoint gridpt[4];
 } r2d_treenode;
 
-// long version for many clip faces
-// typedef struct {
-// 	r2d_int imin, jmin;
-// 	r2d_int ioff, joff;
-// 	r2d_gridpoint gridpt64[4];
-// } r2d_treenode64;
-
-#else // !USE_TREE
-static r2d_long r2d_gblen;
-static r2d_gridpoint* r2d_gridbuffer;
-// static r2d_gridpoint64* r2d_gridbuffer64;
-#endif // USE_TREE 
+// long version for many clip faces. The face distances are only needed
+// at the cells that get clipped, so just the flags are kept
+typedef struct {
+	r2d_int imin, jmin;
+	r2d_int ioff, joff;
+	r2d_ulong fflags[4];
+} r2d_treenode64;
+
+// Orientation kernels for the flat (non-tree) path. Each fills rows
+// of the structure-of-arrays grid buffer with the signed distance of every
+// grid vertex (i, j), 0 <= i <= nx, 0 <= j <= ny, to each face, and sets bit
+// f of the vertex flags if it lies inside face f. The vector versions work
+// along j and are picked at runtime from what the CPU supports.
+typedef void (*r2d_orient_fn)(r2d_real* gdist[4], unsigned char* gflags,
+		r2d_plane faces[4], r2d_rvec2 d, r2d_int nx, r2d_int ny);
+
+R2D_TARGET_CLONES
+static void r2d_orient_scalar(r2d_real* gdist[4], unsigned char* gflags,
+		r2d_plane faces[4], r2d_rvec2 d, r2d_int nx, r2d_int ny) {
+
+	r2d_int i, j, f;
+	r2d_long vv0;
+	r2d_real gor;
+	r2d_rvec2 gpt;
 
-r2d_info r2d_init(r2d_int bufsz) {
+	for(i = 0; i <= nx; ++i)
+	for(j = 0; j <= ny; ++j) {
 
-	// start keeping information
-	current_info.good = 1;
+		gpt.x = i*d.x; gpt.y = j*d.y;
+		vv0 = (ny+1)*i + j;
+		gflags[vv0] = 0x00;
 
-#ifndef USE_TREE
-	// initial allocation. This buffer is resized on the fly if needed
-	r2d_gblen = bufsz; 
-	r2d_gridbuffer = (r2d_gridpoint*) malloc(r2d_gblen*sizeof(r2d_gridpoint));
-//	r2d_gridbuffer64 = (r2d_gridpoint64*) malloc(r2d_gblen*sizeof(r2d_gridpoint64));
-	if(!r2d_gridbuffer /* || !r2d_gridbuffer64 */) {
-		current_info.good = 0;
-		current_info.errmsg = "Bad allocation of grid buffer";
+		// flag the vertex for each face it lies inside
+		// also save its distance from each face
+		for(f = 0; f < 4; ++f) {
+			gor = faces[f].d + dot(gpt, faces[f].n);
+			if(gor > 0.0) gflags[vv0] |= (1 << f);
+			gdist[f][vv0] = gor;
+		}
 	}
-#endif
-	
-	return current_info;
-
 }
 
-void r2d_finalize() {
-#ifndef USE_TREE
-	if(r2d_gridbuffer) free(r2d_gridbuffer);
-	//if(r2d_gridbuffer64) free(r2d_gridbuffer64);
-#endif
-}
+#if !defined(NO_SIMD) && !defined(SINGLE_PRECISION) && defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define R2D_HAVE_SIMD
 
+__attribute__((target("avx2")))
+static void r2d_orient_avx2(r2d_real* gdist[4], unsigned char* gflags,
+		r2d_plane faces[4], r2d_rvec2 d, r2d_int nx, r2d_int ny) {
 
-r2d_info r2d_set_dest_grid(r2d_real* dest, r2d_dvec2 dims, r2d_rvec2 window) {
-	r2d_dest_grid = dest;
-	r2d_dest_dims = dims;
-	r2d_d.x = window.x/r2d_dest_dims.x; 
-	r2d_d.y = window.y/r2d_dest_dims.y; 
-	if(dims.x <= 0 || dims.y <= 0 || window.x <= 0.0 || window.y <= 0.0) {
-		current_info.good = 0;
-		current_info.errmsg = "Invalid grid dimensions";
-	}
-	return current_info;
-}
+	r2d_int i, j, f;
+	r2d_long row;
+	r2d_real gor, gx;
+	int32_t fl[4];
+	__m256d vbase[4], vny[4], vbit[4], vy, vgor, vfl;
+	__m128i vfl32;
+	const __m256d zero = _mm256_setzero_pd();
+	const __m256d lanes = _mm256_set_pd(3.0, 2.0, 1.0, 0.0);
 
+	for(f = 0; f < 4; ++f) {
+		vny[f] = _mm256_set1_pd(faces[f].n.y);
+		vbit[f] = _mm256_set1_pd((r2d_real) (1 << f));
+	}
 
-///// WARNING! MODIFIES THE INPUT FACES! ///////
-r2d_info r2d_rasterize_quad(r2d_real C, r2d_plane faces[4], r2d_dvec2 ibounds[2]) {
+	for(i = 0; i <= nx; ++i) {
 
-	// variables used in this function
-	r2d_real gor, locvol;
-	r2d_rvec2 gpt;
-	r2d_int i, j, nx, ny;
-	unsigned char v, f;
-	unsigned char orcmp, andcmp;
+		row = (r2d_long) (ny+1)*i;
+		gx = i*d.x;
+		for(f = 0; f < 4; ++f)
+			vbase[f] = _mm256_set1_pd(gx*faces[f].n.x);
 
-// macros for grid access
-#define vind(i, j) (r2d_dest_dims.y*(i + ibounds[0].x) + (j + ibounds[0].y))
-#ifdef USE_TREE
-	// stack for the tree
-	r2d_treenode treestack[256];
-	r2d_int ntreestack;
-	r2d_treenode curnode;
-#else
-#define gind(i, j) ((ny+1)*(i) + (j))
-	r2d_long vv[4];
-	r2d_long vv0;
-#endif
+		// four vertices at a time. Summing the masked face bits
+		// as doubles gives the flags without leaving the vector unit
+		for(j = 0; j + 3 <= ny; j += 4) {
+			vy = _mm256_mul_pd(_mm256_add_pd(_mm256_set1_pd((r2d_real) j), lanes), _mm256_set1_pd(d.y));
+			vfl = zero;
+			for(f = 0; f < 4; ++f) {
+				vgor = _mm256_add_pd(_mm256_set1_pd(faces[f].d),
+						_mm256_add_pd(vbase[f], _mm256_mul_pd(vy, vny[f])));
+				_mm256_storeu_pd(&gdist[f][row + j], vgor);
+				vfl = _mm256_add_pd(vfl, _mm256_and_pd(_mm256_cmp_pd(vgor, zero, _CMP_GT_OQ), vbit[f]));
+			}
+			vfl32 = _mm256_cvtpd_epi32(vfl);
+			_mm_storeu_si128((__m128i*) fl, vfl32);
+			gflags[row + j] = fl[0];
+			gflags[row + j + 1] = fl[1];
+			gflags[row + j + 2] = fl[2];
+			gflags[row + j + 3] = fl[3];
+		}
 
-	// voxel bounds in shifted coordinates
-	r2d_rvec2 rbounds[2] = {
-		{-0.5*r2d_d.x, -0.5*r2d_d.y}, {0.5*r2d_d.x, 0.5*r2d_d.y}
-	};
-	// vertex buffer
-	r2d_int nverts;
-	r2d_vertex vertbuffer[128];
+		// remainder of the row
+		for(; j <= ny; ++j) {
+			gflags[row + j] = 0x00;
+			for(f = 0; f < 4; ++f) {
+				gor = faces[f].d + (gx*faces[f].n.x + j*d.y*faces[f].n.y);
+				if(gor > 0.0) gflags[row + j] |= (1 << f);
+				gdist[f][row + j] = gor;
+			}
+		}
+	}
+}
 
-	// start keeping track for this quad
-	current_info.good = 1;
-	current_info.vtot = 0.0;
-	current_info.vox_min = 1.0e99;
-	current_info.vox_max = -1.0e99;
+__attribute__((target("avx512f")))
+static void r2d_orient_avx512(r2d_real* gdist[4], unsigned char* gflags,
+		r2d_plane faces[4], r2d_rvec2 d, r2d_int nx, r2d_int ny) {
 
-	
-	// shift the faces to align with
-	// the working range of indices
-	// THIS CHANGES THE INPUT FACES
-	for(f = 0; f < 4; ++f) {
-		faces[f].d += ibounds[0].x*r2d_d.x*faces[f].n.x
-							+ ibounds[0].y*r2d_d.y*faces[f].n.y;
-	}
-	nx = ibounds[1].x - ibounds[0].x; 
-	ny = ibounds[1].y - ibounds[0].y; 
+	r2d_int i, j, f;
+	r2d_long row;
+	r2d_real gor, gx;
+	__m512d vbase[4], vny[4], vy, vgor;
+	__m512i vbit[4], vfl;
+	__mmask8 inside;
+	const __m512d zero = _mm512_setzero_pd();
+	const __m512d lanes = _mm512_set_pd(7.0, 6.0, 5.0, 4.0, 3.0, 2.0, 1.0, 0.0);
 
-#ifdef USE_TREE
-	
-	// get the initial face orientations for each corner of the node
-	gpt.x = nx*r2d_d.x;
-	gpt.y = 0.0;
-	curnode.gridpt[0].fflags = 0x00;
-	for(f = 0; f < 4; ++f) {
-		gor = faces[f].d + dot(gpt, faces[f].n);
-		if(gor > 0.0) curnode.gridpt[0].fflags |= (1 << f);
-		curnode.gridpt[0].fdist[f] = gor;
-	}
-	gpt.y = ny*r2d_d.y;
-	curnode.gridpt[1].fflags = 0x00;
-	for(f = 0; f < 4; ++f) {
-		gor = faces[f].d + dot(gpt, faces[f].n);
-		if(gor > 0.0) curnode.gridpt[1].fflags |= (1 << f);
-		curnode.gridpt[1].fdist[f] = gor;
-	}
-	gpt.x = 0.0;
-	curnode.gridpt[2].fflags = 0x00;
-	for(f = 0; f < 4; ++f) {
-		gor = faces[f].d + dot(gpt, faces[f].n);
-		if(gor > 0.0) curnode.gridpt[2].fflags |= (1 << f);
-		curnode.gridpt[2].fdist[f] = gor;
-	}
-	gpt.y = 0.0;
-	curnode.gridpt[3].fflags = 0x00;
 	for(f = 0; f < 4; ++f) {
-		gor = faces[f].d + dot(gpt, faces[f].n);
-		if(gor > 0.0) curnode.gridpt[3].fflags |= (1 << f);
-		curnode.gridpt[3].fdist[f] = gor;
+		vny[f] = _mm512_set1_pd(faces[f].n.y);
+		vbit[f] = _mm512_set1_epi64(1 << f);
 	}
 
-	curnode.imin = 0;
-	curnode.jmin = 0;
-	curnode.ioff = nx;
-	curnode.joff = ny;
+	for(i = 0; i <= nx; ++i) {
 
-	ntreestack = 0;
-	treestack[ntreestack++] = curnode;
-	while(ntreestack > 0) {
+		row = (r2d_long) (ny+1)*i;
+		gx = i*d.x;
+		for(f = 0; f < 4; ++f)
+			vbase[f] = _mm512_set1_pd(gx*faces[f].n.x);
 
-		// pop the top node
-		curnode = treestack[--ntreestack];
+		// eight vertices at a time, or-ing in each face bit
+		// under the compare mask and narrowing to bytes at the end
+		for(j = 0; j + 7 <= ny; j += 8) {
+			vy = _mm512_mul_pd(_mm512_add_pd(_mm512_set1_pd((r2d_real) j), lanes), _mm512_set1_pd(d.y));
+			vfl = _mm512_setzero_si512();
+			for(f = 0; f < 4; ++f) {
+				vgor = _mm512_add_pd(_mm512_set1_pd(faces[f].d),
+						_mm512_add_pd(vbase[f], _mm512_mul_pd(vy, vny[f])));
+				_mm512_storeu_pd(&gdist[f][row + j], vgor);
+				inside = _mm512_cmp_pd_mask(vgor, zero, _CMP_GT_OQ);
+				vfl = _mm512_mask_or_epi64(vfl, inside, vfl, vbit[f]);
+			}
+			_mm_storel_epi64((__m128i*) &gflags[row + j], _mm512_cvtepi64_epi8(vfl));
+		}
 
-		orcmp = 0x00;
-        andcmp = 0x0f;
-		for(v = 0; v < 4; ++v) {
-			orcmp |= curnode.gridpt[v].fflags; 
-			andcmp &= curnode.gridpt[v].fflags; 
+		// remainder of the row
+		for(; j <= ny; ++j) {
+			gflags[row + j] = 0x00;
+			for(f = 0; f < 4; ++f) {
+				gor = faces[f].d + (gx*faces[f].n.x + j*d.y*faces[f].n.y);
+				if(gor > 0.0) gflags[row + j] |= (1 << f);
+				gdist[f][row + j] = gor;
+			}
 		}
+	}
+}
+#endif // R2D_HAVE_SIMD
+
+// picks the widest orientation kernel this CPU can run
+static r2d_orient_fn r2d_orient_select() {
+#ifdef R2D_HAVE_SIMD
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx512f")) return r2d_orient_avx512;
+	if(__builtin_cpu_supports("avx2")) return r2d_orient_avx2;
+#endif
+	return r2d_orient_scalar;
+}
 
-		if(andcmp == 0x0f) {
-			
-			// all cells in this leaf are fully contained
-#ifndef NO_REDUCTION
-			locvol = r2d_d.x*r2d_d.y;
-			
-			for(i = curnode.imin; i < curnode.imin + curnode.ioff; ++i)
-			for(j = curnode.jmin; j < curnode.jmin + curnode.joff; ++j) {
+// (re)allocates the grid buffer to hold at least len vertices. Outside
+// of the flat path it only serves as scratch space for r2d_ctx_edge_quad
+static r2d_int r2d_ctx_alloc_grid(r2d_context* ctx, r2d_long len) {
+	r2d_int f;
+	if(ctx->gbdist[0]) free(ctx->gbdist[0]);
+	if(ctx->gbflags) free(ctx->gbflags);
+	ctx->gbdist[0] = (r2d_real*) malloc(4*len*sizeof(r2d_real));
+	ctx->gbflags = (unsigned char*) malloc(len*sizeof(unsigned char));
+	for(f = 1; f < 4; ++f)
+		ctx->gbdist[f] = ctx->gbdist[0] ? ctx->gbdist[0] + f*len : NULL;
+	ctx->gblen = len;
+	return ctx->gbdist[0] && ctx->gbflags;
+}
 
-				r2d_dest_grid[vind(i, j)] += C*locvol;
+r2d_info r2d_ctx_init(r2d_context* ctx, r2d_int bufsz) {
 
-				current_info.vtot += locvol;
-				if(locvol < current_info.vox_min) current_info.vox_min = locvol;
-				if(locvol > current_info.vox_max) current_info.vox_max = locvol;
-			
-			}
-#endif // NO_REDUCTION
-			continue;
-		}
-		if(orcmp != 0x0f) {
-			// the leaf lies entirely outside the tet
-			// skip it
-			continue;
-		}
-		if(curnode.ioff == 1 && curnode.joff == 1) {
-			// we've reached a single cell that straddles the tet boundary 
-			// Clip and voxelize it.
+	// start keeping information
+	memset(&ctx->info, 0, sizeof(r2d_info));
+	ctx->info.good = 1;
+	memset(ctx->gbdist, 0, sizeof(ctx->gbdist));
+	ctx->gbflags = NULL;
+	ctx->gblen = 0;
+	ctx->orient = NULL;
+	memset(ctx->moments, 0, sizeof(ctx->moments));
+	ctx->polyorder = 0;
+	ctx->mode = r2d_default_mode;
+	ctx->tree_threshold = r2d_default_tree_threshold;
 
-			// initialize the unit cube connectivity 
-			// copy all flags from tree traversal
-			
-			// if cell shifting is off, use the absolute vertex coordinates
+	// initial allocation. This buffer is resized on the fly if needed
+	ctx->orient = (void*) r2d_orient_select();
+	if(!r2d_ctx_alloc_grid(ctx, bufsz)) {
+		ctx->info.good = 0;
+		ctx->info.errmsg = "Bad allocation of grid buffer";
+	}
+	
+	return ctx->info;
 
-#ifdef NO_SHIFTING
-			// voxel bounds in shifted coordinates
-			rbounds[0].x = curnode.imin*r2d_d.x;
-			rbounds[0].y = curnode.jmin*r2d_d.y;
-			rbounds[1].x = (curnode.imin+1)*r2d_d.x;
-			rbounds[1].y = (curnode.jmin+1)*r2d_d.y;
-#endif // NO_SHIFTING
+}
 
-			r2du_init_box(vertbuffer, &nverts, rbounds);
-			for(v = 0; v < nverts; ++v) {
-				vertbuffer[v].fflags = curnode.gridpt[v].fflags;
-				for(f = 0; f < 4; ++f)
-					vertbuffer[v].fdist[f] = curnode.gridpt[v].fdist[f];
-			}
+void r2d_ctx_finalize(r2d_context* ctx) {
+	if(ctx->gbdist[0]) free(ctx->gbdist[0]);
+	if(ctx->gbflags) free(ctx->gbflags);
+	memset(ctx->gbdist, 0, sizeof(ctx->gbdist));
+	ctx->gbflags = NULL;
+	ctx->gblen = 0;
+}
 
-			// Clipping
-#ifndef NO_CLIPPING
-			r2du_clip_quad(vertbuffer, &nverts, andcmp);
-#endif // NO_CLIPPING
 
-			// Reducetion
-#ifndef NO_REDUCTION
-			r2du_reduce(vertbuffer, &nverts, C, vind(curnode.imin, curnode.jmin));
-#endif // NO_REDUCTION
-			continue;	
-		}
+r2d_info r2d_ctx_set_dest_grid(r2d_context* ctx, r2d_real* dest, r2d_dvec2 dims, r2d_rvec2 window) {
+	return r2d_ctx_set_dest_moments(ctx, &dest, 0, dims, window);
+}
 
-		// else, split the node along its longest dimension
-		// and push to the the stack
-		i = curnode.ioff/2;
-		j = curnode.joff/2;
-		if(i >= j) {
-
-			// LEFT NODE
-			treestack[ntreestack].imin = curnode.imin;
-			treestack[ntreestack].ioff = i;
-			treestack[ntreestack].jmin = curnode.jmin;
-			treestack[ntreestack].joff = curnode.joff;
-			treestack[ntreestack].gridpt[2] = curnode.gridpt[2];
-			treestack[ntreestack].gridpt[3] = curnode.gridpt[3];
-
-			// RIGHT NODE
-			treestack[ntreestack+1].imin = curnode.imin + i;
-			treestack[ntreestack+1].ioff = curnode.ioff - i;
-			treestack[ntreestack+1].jmin = curnode.jmin;
-			treestack[ntreestack+1].joff = curnode.joff;
-			treestack[ntreestack+1].gridpt[0] = curnode.gridpt[0];
-			treestack[ntreestack+1].gridpt[1] = curnode.gridpt[1];
-
-			// FILL IN COMMON POINTS
-			gpt.x = r2d_d.x*(curnode.imin + i);
-			gpt.y = r2d_d.y*curnode.jmin;
-			treestack[ntreestack].gridpt[0].fflags = 0x00;
-			treestack[ntreestack+1].gridpt[3].fflags = 0x00;
-			for(f = 0; f < 4; ++f) {
-				gor = faces[f].d + dot(gpt, faces[f].n);
-				treestack[ntreestack].gridpt[0].fdist[f] = gor;
-				treestack[ntreestack+1].gridpt[3].fdist[f] = gor;
-				if(gor > 0.0) {
-					treestack[ntreestack].gridpt[0].fflags |= (1 << f);
-					treestack[ntreestack+1].gridpt[3].fflags |= (1 << f);
-				}
-			}
-			gpt.y = r2d_d.y*(curnode.jmin + curnode.joff);
-			treestack[ntreestack].gridpt[1].fflags = 0x00;
-			treestack[ntreestack+1].gridpt[2].fflags = 0x00;
-			for(f = 0; f < 4; ++f) {
-				gor = faces[f].d + dot(gpt, faces[f].n);
-				treestack[ntreestack].gridpt[1].fdist[f] = gor;
-				treestack[ntreestack+1].gridpt[2].fdist[f] = gor;
-				if(gor > 0.0) {
-					treestack[ntreestack].gridpt[1].fflags |= (1 << f);
-					treestack[ntreestack+1].gridpt[2].fflags |= (1 << f);
-				}
-			}
-			ntreestack += 2;
-			continue;
-		}
-		else { // j > i
-
-			// LEFT NODE
-			treestack[ntreestack].imin = curnode.imin;
-			treestack[ntreestack].ioff = curnode.ioff;
-			treestack[ntreestack].jmin = curnode.jmin;
-			treestack[ntreestack].joff = j;
-			treestack[ntreestack].gridpt[0] = curnode.gridpt[0];
-			treestack[ntreestack].gridpt[3] = curnode.gridpt[3];
-
-			// RIGHT NODE
-			treestack[ntreestack+1].imin = curnode.imin;
-			treestack[ntreestack+1].ioff = curnode.ioff;
-			treestack[ntreestack+1].jmin = curnode.jmin + j;
-			treestack[ntreestack+1].joff = curnode.joff - j;
-			treestack[ntreestack+1].gridpt[1] = curnode.gridpt[1];
-			treestack[ntreestack+1].gridpt[2] = curnode.gridpt[2];
-
-			// FILL IN COMMON POINTS
-			gpt.x = r2d_d.x*curnode.imin;
-			gpt.y = r2d_d.y*(curnode.jmin + j);
-			treestack[ntreestack].gridpt[2].fflags = 0x00;
-			treestack[ntreestack+1].gridpt[3].fflags = 0x00;
-			for(f = 0; f < 4; ++f) {
-				gor = faces[f].d + dot(gpt, faces[f].n);
-				treestack[ntreestack].gridpt[2].fdist[f] = gor;
-				treestack[ntreestack+1].gridpt[3].fdist[f] = gor;
-				if(gor > 0.0) {
-					treestack[ntreestack].gridpt[2].fflags |= (1 << f);
-					treestack[ntreestack+1].gridpt[3].fflags |= (1 << f);
-				}
-			}
-			gpt.x = r2d_d.x*(curnode.imin + curnode.ioff);
-			treestack[ntreestack].gridpt[1].fflags = 0x00;
-			treestack[ntreestack+1].gridpt[0].fflags = 0x00;
-			for(f = 0; f < 4; ++f) {
-				gor = faces[f].d + dot(gpt, faces[f].n);
-				treestack[ntreestack].gridpt[1].fdist[f] = gor;
-				treestack[ntreestack+1].gridpt[0].fdist[f] = gor;
-				if(gor > 0.0) {
-					treestack[ntreestack].gridpt[1].fflags |= (1 << f);
-					treestack[ntreestack+1].gridpt[0].fflags |= (1 << f);
-				}
-			}
-			ntreestack += 2;
-			continue;
-		}
+r2d_info r2d_ctx_set_dest_moments(r2d_context* ctx, r2d_real** dest, r2d_int polyorder, r2d_dvec2 dims, r2d_rvec2 window) {
+	r2d_int m;
+	if(polyorder < 0 || polyorder > 2) {
+		ctx->info.good = 0;
+		ctx->info.errmsg = "Polynomial order must be 0, 1, or 2";
+		return ctx->info;
 	}
-
-#else // !USE_TREE
-
-	// make sure the grid buffer is large enough
-	if(r2d_gblen < (nx+1)*(ny+1)) {
-		r2d_gblen = (nx+1)*(ny+1)*2; // extra factor of two to minimize reallocations 
-		r2d_gridpoint* ngb = (r2d_gridpoint*) realloc((void*) r2d_gridbuffer, r2d_gblen*sizeof(r2d_gridpoint));
-		if(ngb == r2d_gridbuffer) {
-			current_info.errmsg = "Bad reallocation of grid buffer";
-			current_info.good = 0;
-			return current_info;
-		}
-		r2d_gridbuffer = ngb;//(r2d_gridpoint*) realloc((void*) r2d_gridbuffer, r2d_gblen*sizeof(r2d_gridpoint));
+	ctx->polyorder = polyorder;
+	for(m = 0; m < 6; ++m)
+		ctx->moments[m] = (m < r2d_num_moments[polyorder]) ? dest[m] : NULL;
+	ctx->dest_dims = dims;
+	ctx->d.x = window.x/ctx->dest_dims.x; 
+	ctx->d.y = window.y/ctx->dest_dims.y; 
+	if(dims.x <= 0 || dims.y <= 0 || window.x <= 0.0 || window.y <= 0.0) {
+		ctx->info.good = 0;
+		ctx->info.errmsg = "Invalid grid dimensions";
 	}
+	return ctx->info;
+}
 
-	// check all grid vertices in the patch against each tet face
-	for(i = 0; i <= nx; ++i)
-	for(j = 0; j <= ny; ++j) {
+void r2d_set_default_mode(r2d_int mode) {
+	r2d_default_mode = mode;
+}
 
-		gpt.x = i*r2d_d.x; gpt.y = j*r2d_d.y;
-		vv0 = gind(i, j);
-		r2d_gridbuffer[vv0].fflags = 0x00;
+r2d_int r2d_get_default_mode() {
+	return r2d_default_mode;
+}
 
-		// flag the vertex for each face it lies inside
-		// also save its distance from each face
-		for(f = 0; f < 4; ++f) {
-			gor = faces[f].d + dot(gpt, faces[f].n);
-			if(gor > 0.0) r2d_gridbuffer[vv0].fflags |= (1 << f);
-			r2d_gridbuffer[vv0].fdist[f] = gor;
-		}
-	}
+void r2d_set_tree_threshold(r2d_long ncells) {
+	r2d_default_tree_threshold = ncells;
+}
 
-	// iterate over all voxels in the patch
-	for(i = 0; i < nx; ++i)
-	for(j = 0; j < ny; ++j) {
+r2d_long r2d_get_tree_threshold() {
+	return r2d_default_tree_threshold;
+}
 
-		// precompute flattened grid indices
-		vv[0] = gind(i+1, j);
-		vv[1] = gind(i+1, j+1);
-		vv[2] = gind(i, j+1);
-		vv[3] = gind(i, j);
-	
-		// check inclusion of each voxel within the tet
-		orcmp = 0x00;
-        andcmp = 0x0f;
-		for(v = 0; v < 4; ++v) {
-			orcmp |= r2d_gridbuffer[vv[v]].fflags; 
-			andcmp &= r2d_gridbuffer[vv[v]].fflags; 
-		}
+// the global API is a thin shim over a single static context
+r2d_info r2d_init(r2d_int bufsz) {
+	return r2d_ctx_init(&r2d_global_ctx, bufsz);
+}
 
-		if(andcmp == 0x0f) {
-			// the voxel is entirely inside the quad
+void r2d_finalize() {
+	r2d_ctx_finalize(&r2d_global_ctx);
+}
 
-#ifndef NO_REDUCTION
-			
-			locvol = r2d_d.x*r2d_d.y;
+r2d_info r2d_set_dest_grid(r2d_real* dest, r2d_dvec2 dims, r2d_rvec2 window) {
+	return r2d_ctx_set_dest_grid(&r2d_global_ctx, dest, dims, window);
+}
 
-			r2d_dest_grid[vind(i, j)] += C*locvol;
+r2d_info r2d_rasterize_quad(r2d_real C, r2d_plane faces[4], r2d_dvec2 ibounds[2]) {
+	return r2d_ctx_rasterize_quad(&r2d_global_ctx, C, faces, ibounds);
+}
 
-			current_info.vtot += locvol;
-			if(locvol < current_info.vox_min) current_info.vox_min = locvol;
-			if(locvol > current_info.vox_max) current_info.vox_max = locvol;
+r2d_info r2d_rasterize_n(r2d_real C, r2d_plane* faces, r2d_int nfaces, r2d_dvec2 ibounds[2]) {
+	return r2d_ctx_rasterize_n(&r2d_global_ctx, C, faces, nfaces, ibounds);
+}
 
-#endif // NO_REDUCTION
-		}	
-		else if(orcmp == 0x0f) {
-			// the voxel crosses the boundary of the tet
-			// need to process further
-			
-			// initialize the unit cube connectivity 
-			// if shifting is turned off, use absolute coordinates
+r2d_info r2d_rasterize_quad_verts(r2d_real C, r2d_real* verts, r2d_real* dest,
+		r2d_dvec2 dims, r2d_rvec2 window) {
+
+	r2d_context ctx;
+	r2d_plane faces[4];
+	r2d_dvec2 ibounds[2];
+	r2d_info info;
+
+	// a private context, so that any number of these may run at once
+	info = r2d_ctx_init(&ctx, (dims.x+1)*(dims.y+1));
+	if(info.good) info = r2d_ctx_set_dest_grid(&ctx, dest, dims, window);
+	if(info.good) {
+		r2du_faces_from_verts((r2d_rvec2*) verts, 4, faces);
+		ibounds[0].x = 0;
+		ibounds[0].y = 0;
+		ibounds[1] = dims;
+		info = r2d_ctx_rasterize_quad(&ctx, C, faces, ibounds);
+	}
+	r2d_ctx_finalize(&ctx);
+	return info;
+}
 
-#ifdef NO_SHIFTING
-			// voxel bounds in shifted coordinates
-			rbounds[0].x = i*r2d_d.x;
-			rbounds[0].y = j*r2d_d.y;
-			rbounds[1].x = (i+1)*r2d_d.x;
-			rbounds[1].y = (j+1)*r2d_d.y;
-#endif // NO_SHIFTING
+// adds C times the moments mom of one cell, and its area to the stats
+static inline void r2du_ctx_add_cell(r2d_context* ctx, r2d_real C, r2d_real* mom, r2d_long flatind) {
+	r2d_int m;
+	for(m = 0; m < r2d_num_moments[ctx->polyorder]; ++m)
+		ctx->moments[m][flatind] += C*mom[m];
+	ctx->info.vtot += mom[0];
+	if(mom[0] < ctx->info.vox_min) ctx->info.vox_min = mom[0];
+	if(mom[0] > ctx->info.vox_max) ctx->info.vox_max = mom[0];
+}
 
-			r2du_init_box(vertbuffer, &nverts, rbounds);
-			for(v = 0; v < nverts; ++v) {
-				vertbuffer[v].fflags = r2d_gridbuffer[vv[v]].fflags;
-				for(f = 0; f < 4; ++f)
-					vertbuffer[v].fdist[f] = r2d_gridbuffer[vv[v]].fdist[f];
+// Recovers the corners of a quad from its faces, with corner f shared by
+// faces f-1 and f. Returns 0 unless the quad is convex and CCW with no
+// nearly straight corners, in which case the closed-form paths apply.
+static r2d_int r2du_verts_from_faces(r2d_plane faces[4], r2d_rvec2 verts[4]) {
+	r2d_int f;
+	r2d_real det;
+	r2d_plane *f0, *f1;
+	for(f = 0; f < 4; ++f) {
+		f0 = &faces[(f+3)%4];
+		f1 = &faces[f];
+		det = f0->n.x*f1->n.y - f0->n.y*f1->n.x;
+		if(!(det >= 1.0e-6)) return 0;
+		verts[f].x = (f1->d*f0->n.y - f0->d*f1->n.y)/det;
+		verts[f].y = (f0->d*f1->n.x - f1->d*f0->n.x)/det;
+	}
+	return 1;
+}
+
+// Rasterizes an axis-aligned rectangle [lo.x, hi.x] x [lo.y, hi.y], given in
+// the shifted frame. The overlap with each cell is a rectangle, so its moments
+// are products of 1D moments, taken about the cell center for precision.
+static void r2d_ctx_rect_quad(r2d_context* ctx, r2d_real C, r2d_rvec2 lo, r2d_rvec2 hi,
+		r2d_dvec2 ibounds[2], r2d_int nx, r2d_int ny) {
+
+	r2d_int i, j;
+	r2d_real a0, a1, gx, gy;
+	r2d_real xm[3], ym[3], mom[6];
+
+	for(i = 0; i < nx; ++i) {
+		a0 = lo.x - (i + 0.5)*ctx->d.x;
+		a1 = hi.x - (i + 0.5)*ctx->d.x;
+		if(a0 < -0.5*ctx->d.x) a0 = -0.5*ctx->d.x;
+		if(a1 > 0.5*ctx->d.x) a1 = 0.5*ctx->d.x;
+		if(a1 <= a0) continue;
+		xm[0] = a1 - a0;
+		xm[1] = 0.5*(a1*a1 - a0*a0);
+		xm[2] = ONE_THIRD*(a1*a1*a1 - a0*a0*a0);
+		gx = (i + ibounds[0].x + 0.5)*ctx->d.x;
+		for(j = 0; j < ny; ++j) {
+			a0 = lo.y - (j + 0.5)*ctx->d.y;
+			a1 = hi.y - (j + 0.5)*ctx->d.y;
+			if(a0 < -0.5*ctx->d.y) a0 = -0.5*ctx->d.y;
+			if(a1 > 0.5*ctx->d.y) a1 = 0.5*ctx->d.y;
+			if(a1 <= a0) continue;
+			ym[0] = a1 - a0;
+			ym[1] = 0.5*(a1*a1 - a0*a0);
+			ym[2] = ONE_THIRD*(a1*a1*a1 - a0*a0*a0);
+			gy = (j + ibounds[0].y + 0.5)*ctx->d.y;
+			mom[0] = xm[0]*ym[0];
+			if(ctx->polyorder >= 1) {
+				mom[1] = (xm[1] + gx*xm[0])*ym[0];
+				mom[2] = xm[0]*(ym[1] + gy*ym[0]);
+			}
+			if(ctx->polyorder >= 2) {
+				mom[3] = (xm[2] + 2.0*gx*xm[1] + gx*gx*xm[0])*ym[0];
+				mom[4] = xm[0]*(ym[2] + 2.0*gy*ym[1] + gy*gy*ym[0]);
+				mom[5] = (xm[1] + gx*xm[0])*(ym[1] + gy*ym[0]);
 			}
+			r2du_ctx_add_cell(ctx, C, mom, ctx->dest_dims.y*(i + ibounds[0].x) + (j + ibounds[0].y));
+		}
+	}
+}
 
-			// Clipping
-#ifndef NO_CLIPPING
-		r2du_clip_quad(vertbuffer, &nverts, andcmp);
-		/*r2du_clip_n(vertbuffer, &nverts, faces, 4);*/
-#endif // NO_CLIPPING
+// Adds the part of an edge lying in one row of cells, from x = xs to x = xe
+// while y changes by dy. Within cell i, the edge adds the signed area between
+// itself and the far side of the cell, and every cell beyond it gets the full
+// width. acc holds the differences along x, so that a running sum over i
+// gives each cell's area once all edges are in.
+static inline void r2du_edge_row(r2d_real* acc, r2d_int nx, r2d_int ny, r2d_real dx,
+		r2d_real xs, r2d_real xe, r2d_real dy) {
+
+	r2d_int i, iend, step;
+	r2d_real xb, xcur, cover, part;
+
+#define r2du_column(px) ((px) < 0.0 ? -1 : ((px) >= nx*dx ? nx : (r2d_int) floor((px)/dx)))
+#define r2du_edge_cell(i, x0, x1, sdy) {					\
+	cover = -(sdy)*dx;								\
+	if((i) < 0) acc[0] += cover;					\
+	else if((i) < nx) {								\
+		part = -(sdy)*(((i) + 1)*dx - 0.5*((x0) + (x1)));	\
+		acc[ny*(i)] += part;						\
+		acc[ny*((i) + 1)] += cover - part;			\
+	}												\
+}
+	i = r2du_column(xs);
+	iend = r2du_column(xe);
+	if(i == iend) {
+		r2du_edge_cell(i, xs, xe, dy);
+		return;
+	}
+
+	// split the edge where it crosses the cell boundaries
+	step = (iend > i) ? 1 : -1;
+	xcur = xs;
+	for(; i != iend; i += step) {
+		xb = ((step > 0) ? i + 1 : i)*dx;
+		r2du_edge_cell(i, xcur, xb, dy*(xb - xcur)/(xe - xs));
+		xcur = xb;
+	}
+	r2du_edge_cell(iend, xcur, xe, dy*(xe - xcur)/(xe - xs));
+#undef r2du_edge_cell
+#undef r2du_column
+}
+
+// Rasterizes the area of a convex quad with corners verts, given in the
+// shifted frame, by integrating along its edges instead of clipping each
+// cell. acc must hold (nx+1)*ny values.
+static void r2d_ctx_edge_quad(r2d_context* ctx, r2d_real C, r2d_rvec2 verts[4], r2d_real* acc,
+		r2d_dvec2 ibounds[2], r2d_int nx, r2d_int ny) {
 
-#ifndef NO_REDUCTION
-		r2du_reduce(vertbuffer, &nverts, C, vind(i, j));
-#endif // NO_REDUCTION
+	r2d_int i, j, jend, f, step;
+	r2d_real yb, ycur, xcur, xb, slope;
+	r2d_rvec2 v0, v1;
+	r2d_real mom[1];
+
+#define aind(i, j) (ny*(i) + (j))
+#define r2du_row(py) ((py) < 0.0 ? -1 : ((py) >= ny*ctx->d.y ? ny : (r2d_int) floor((py)/ctx->d.y)))
+
+	memset((void*) acc, 0, (r2d_long) (nx+1)*ny*sizeof(r2d_real));
+	for(f = 0; f < 4; ++f) {
+
+		v0 = verts[f];
+		v1 = verts[(f+1)%4];
+		if(v0.y == v1.y) continue;
+
+		// split the edge into rows
+		j = r2du_row(v0.y);
+		jend = r2du_row(v1.y);
+		slope = (v1.x - v0.x)/(v1.y - v0.y);
+		step = (jend > j) ? 1 : -1;
+		xcur = v0.x;
+		ycur = v0.y;
+		for(; j != jend; j += step) {
+			yb = ((step > 0) ? j + 1 : j)*ctx->d.y;
+			xb = v0.x + (yb - v0.y)*slope;
+			if(j >= 0 && j < ny)
+				r2du_edge_row(&acc[aind(0, j)], nx, ny, ctx->d.x, xcur, xb, yb - ycur);
+			xcur = xb;
+			ycur = yb;
 		}
+		if(j >= 0 && j < ny)
+			r2du_edge_row(&acc[aind(0, j)], nx, ny, ctx->d.x, xcur, v1.x, v1.y - ycur);
 	}
-#endif // USE_TREE
 
-	return current_info;
+	// running sums along x give the area of each cell
+	for(i = 0; i < nx; ++i) {
+		for(j = 0; j < ny; ++j) {
+			if(i > 0) acc[aind(i, j)] += acc[aind(i-1, j)];
+			mom[0] = acc[aind(i, j)];
+			if(mom[0] != 0.0)
+				r2du_ctx_add_cell(ctx, C, mom, ctx->dest_dims.y*(i + ibounds[0].x) + (j + ibounds[0].y));
+		}
+	}
+#undef r2du_row
+#undef aind
 }
 
+// Tries the closed-form paths for the quad with shifted faces. Axis-aligned
+// rectangles are handled for any polynomial order, other convex quads for
+// areas only. Returns 1 if the quad was rasterized here.
+R2D_TARGET_CLONES
+static r2d_int r2d_ctx_analytic_quad(r2d_context* ctx, r2d_real C, r2d_plane faces[4],
+		r2d_dvec2 ibounds[2], r2d_int nx, r2d_int ny) {
+
+	r2d_int f, rect;
+	r2d_rvec2 verts[4], lo, hi;
+
+	if(!r2du_verts_from_faces(faces, verts)) return 0;
+
+	rect = 1;
+	for(f = 0; f < 4; ++f)
+		if(faces[f].n.x != 0.0 && faces[f].n.y != 0.0) rect = 0;
+	if(rect) {
+		lo = hi = verts[0];
+		for(f = 1; f < 4; ++f) {
+			if(verts[f].x < lo.x) lo.x = verts[f].x;
+			if(verts[f].x > hi.x) hi.x = verts[f].x;
+			if(verts[f].y < lo.y) lo.y = verts[f].y;
+			if(verts[f].y > hi.y) hi.y = verts[f].y;
+		}
+		r2d_ctx_rect_quad(ctx, C, lo, hi, ibounds, nx, ny);
+		ctx->info.nrect++;
+		return 1;
+	}
+	if(ctx->polyorder) return 0;
+
+	// the edge sums go in the grid buffer
+	if(4*ctx->gblen < (r2d_long) (nx+1)*ny) {
+		if(!r2d_ctx_alloc_grid(ctx, (r2d_long) (nx+1)*(ny+1)*2)) {
+			ctx->info.errmsg = "Bad reallocation of grid buffer";
+			ctx->info.good = 0;
+			return 1;
+		}
+	}
+	r2d_ctx_edge_quad(ctx, C, verts, ctx->gbdist[0], ibounds, nx, ny);
+	ctx->info.nedge++;
+	return 1;
+}
 
 
-#if 0
 ///// WARNING! MODIFIES THE INPUT FACES! ///////
-r2d_info r2d_rasterize_n(r2d_real C, r2d_plane* faces, r2d_int nfaces, r2d_dvec2 ibounds[2]) {
+R2D_TARGET_CLONES
+r2d_info r2d_ctx_rasterize_quad(r2d_context* ctx, r2d_real C, r2d_plane faces[4], r2d_dvec2 ibounds[2]) {
 
 	// variables used in this function
-	r2d_real gor, locvol;
-	r2d_rvec2 gpt;
+	r2d_rvec2 origin;
 	r2d_int i, j, nx, ny;
 	unsigned char v, f;
 	unsigned char orcmp, andcmp;
 
 // macros for grid access
-#define vind(i, j) (r2d_dest_dims.y*(i + ibounds[0].x) + (j + ibounds[0].y))
-#ifdef USE_TREE
+#define vind(i, j) (ctx->dest_dims.y*(i + ibounds[0].x) + (j + ibounds[0].y))
+#define gind(i, j) ((ny+1)*(i) + (j))
+	r2d_long vv[4];
+
 	// stack for the tree
-	r2d_treenode treestack[256]; // longer
+	r2d_real gor;
+	r2d_rvec2 gpt;
+	r2d_treenode treestack[256];
 	r2d_int ntreestack;
 	r2d_treenode curnode;
-#else
-#define gind(i, j) ((ny+1)*(i) + (j))
-	r2d_long vv[4];
-	r2d_long vv0;
-#endif
 
 	// voxel bounds in shifted coordinates
 	r2d_rvec2 rbounds[2] = {
-		{-0.5*r2d_d.x, -0.5*r2d_d.y}, {0.5*r2d_d.x, 0.5*r2d_d.y}
+		{-0.5*ctx->d.x, -0.5*ctx->d.y}, {0.5*ctx->d.x, 0.5*ctx->d.y}
 	};
 	// vertex buffer
 	r2d_int nverts;
-	r2d_vertex vertbuffer[128]; // longer
+	r2d_vertex vertbuffer[128];
 
 	// start keeping track for this quad
-	current_info.good = 1;
-	current_info.vtot = 0.0;
-	current_info.vox_min = 1.0e99;
-	current_info.vox_max = -1.0e99;
+	ctx->info.good = 1;
+	ctx->info.vtot = 0.0;
+	ctx->info.vox_min = 1.0e99;
+	ctx->info.vox_max = -1.0e99;
+	ctx->info.nrect = 0;
+	ctx->info.nedge = 0;
+	ctx->info.nclip = 0;
+	ctx->info.num_in = 0;
+	ctx->info.num_clip = 0;
+	ctx->info.num_out = 0;
+	ctx->info.ntree = 0;
+	ctx->info.nflat = 0;
 
 	
 	// shift the faces to align with
 	// the working range of indices
 	// THIS CHANGES THE INPUT FACES
-	for(f = 0; f < nfaces; ++f) {
-		faces[f].d += ibounds[0].x*r2d_d.x*faces[f].n.x
-							+ ibounds[0].y*r2d_d.y*faces[f].n.y;
+	for(f = 0; f < 4; ++f) {
+		faces[f].d += ibounds[0].x*ctx->d.x*faces[f].n.x
+							+ ibounds[0].y*ctx->d.y*faces[f].n.y;
 	}
 	nx = ibounds[1].x - ibounds[0].x; 
 	ny = ibounds[1].y - ibounds[0].y; 
 
-#ifdef USE_TREE
-	
-	// get the initial face orientations for each corner of the node
-	gpt.x = nx*r2d_d.x;
-	gpt.y = 0.0;
-	curnode.gridpt[0].fflags = 0x00;
-	for(f = 0; f < nfaces; ++f) {
-		gor = faces[f].d + dot(gpt, faces[f].n);
-		if(gor > 0.0) curnode.gridpt[0].fflags |= (1 << f);
-		curnode.gridpt[0].fdist[f] = gor;
-	}
-	gpt.y = ny*r2d_d.y;
-	curnode.gridpt[1].fflags = 0x00;
-	for(f = 0; f < nfaces; ++f) {
-		gor = faces[f].d + dot(gpt, faces[f].n);
-		if(gor > 0.0) curnode.gridpt[1].fflags |= (1 << f);
-		curnode.gridpt[1].fdist[f] = gor;
-	}
-	gpt.x = 0.0;
-	curnode.gridpt[2].fflags = 0x00;
-	for(f = 0; f < nfaces; ++f) {
-		gor = faces[f].d + dot(gpt, faces[f].n);
-		if(gor > 0.0) curnode.gridpt[2].fflags |= (1 << f);
-		curnode.gridpt[2].fdist[f] = gor;
-	}
-	gpt.y = 0.0;
-	curnode.gridpt[3].fflags = 0x00;
-	for(f = 0; f < nfaces; ++f) {
-		gor = faces[f].d + dot(gpt, faces[f].n);
-		if(gor > 0.0) curnode.gridpt[3].fflags |= (1 << f);
-		curnode.gridpt[3].fdist[f] = gor;
-	}
+	// rectangles and other simple quads need no clipping
+	if(!(ctx->mode & R2D_NO_ANALYTIC) && r2d_ctx_analytic_quad(ctx, C, faces, ibounds, nx, ny))
+		return ctx->info;
+	ctx->info.nclip++;
 
-	curnode.imin = 0;
-	curnode.jmin = 0;
-	curnode.ioff = nx;
-	curnode.joff = ny;
-
-	ntreestack = 0;
-	treestack[ntreestack++] = curnode;
-	while(ntreestack > 0) {
+	// the tree only pays off for quads spanning many cells
+	if((ctx->mode & R2D_TREE) || (ctx->tree_threshold > 0 && (r2d_long) nx*ny >= ctx->tree_threshold)) {
+		ctx->info.ntree++;
+	
+		// get the initial face orientations for each corner of the node
+		gpt.x = nx*ctx->d.x;
+		gpt.y = 0.0;
+		curnode.gridpt[0].fflags = 0x00;
+		for(f = 0; f < 4; ++f) {
+			gor = faces[f].d + dot(gpt, faces[f].n);
+			if(gor > 0.0) curnode.gridpt[0].fflags |= (1 << f);
+			curnode.gridpt[0].fdist[f] = gor;
+		}
+		gpt.y = ny*ctx->d.y;
+		curnode.gridpt[1].fflags = 0x00;
+		for(f = 0; f < 4; ++f) {
+			gor = faces[f].d + dot(gpt, faces[f].n);
+			if(gor > 0.0) curnode.gridpt[1].fflags |= (1 << f);
+			curnode.gridpt[1].fdist[f] = gor;
+		}
+		gpt.x = 0.0;
+		curnode.gridpt[2].fflags = 0x00;
+		for(f = 0; f < 4; ++f) {
+			gor = faces[f].d + dot(gpt, faces[f].n);
+			if(gor > 0.0) curnode.gridpt[2].fflags |= (1 << f);
+			curnode.gridpt[2].fdist[f] = gor;
+		}
+		gpt.y = 0.0;
+		curnode.gridpt[3].fflags = 0x00;
+		for(f = 0; f < 4; ++f) {
+			gor = faces[f].d + dot(gpt, faces[f].n);
+			if(gor > 0.0) curnode.gridpt[3].fflags |= (1 << f);
+			curnode.gridpt[3].fdist[f] = gor;
+		}
 
-		// pop the top node
-		curnode = treestack[--ntreestack];
+		curnode.imin = 0;
+		curnode.jmin = 0;
+		curnode.ioff = nx;
+		curnode.joff = ny;
 
-		orcmp = 0x00;
-        andcmp = 0x0f;
-		for(f = 0; f < nfaces; ++f) {
-			orcmp |= curnode.gridpt[f].fflags; 
-			andcmp &= curnode.gridpt[f].fflags; 
-		}
+		ntreestack = 0;
+		treestack[ntreestack++] = curnode;
+		while(ntreestack > 0) {
 
-		if(andcmp == 0x0f) { // longer
-			
-			// all cells in this leaf are fully contained
-#ifndef NO_REDUCTION
-#ifndef NO_SHIFTING
-			locvol = r2d_d.x*r2d_d.y;
-#endif // NO_SHIFTING
-			for(i = curnode.imin; i < curnode.imin + curnode.ioff; ++i)
-			for(j = curnode.jmin; j < curnode.jmin + curnode.joff; ++j) {
-#ifdef NO_SHIFTING
-				/*
-				locvol = 0.0;
-				locvol -= (i*r2d_d.x)*(j*r2d_d.y)*(k*r2d_d.z);
-				locvol += ((i+1)*r2d_d.x)*(j*r2d_d.y)*(k*r2d_d.z);
-				locvol -= ((i+1)*r2d_d.x)*((j+1)*r2d_d.y)*(k*r2d_d.z);
-				locvol += (i*r2d_d.x)*((j+1)*r2d_d.y)*(k*r2d_d.z);
-				locvol += (i*r2d_d.x)*(j*r2d_d.y)*((k+1)*r2d_d.z);
-				locvol -= ((i+1)*r2d_d.x)*(j*r2d_d.y)*((k+1)*r2d_d.z);
-				locvol += ((i+1)*r2d_d.x)*((j+1)*r2d_d.y)*((k+1)*r2d_d.z);
-				locvol -= (i*r2d_d.x)*((j+1)*r2d_d.y)*((k+1)*r2d_d.z);
-				*/
-#endif
-				r2d_dest_grid[vind(i, j)] += C*locvol;
+			// pop the top node
+			curnode = treestack[--ntreestack];
 
-				current_info.vtot += locvol;
-				if(locvol < current_info.vox_min) current_info.vox_min = locvol;
-				if(locvol > current_info.vox_max) current_info.vox_max = locvol;
-			
+			orcmp = 0x00;
+	        andcmp = 0x0f;
+			for(v = 0; v < 4; ++v) {
+				orcmp |= curnode.gridpt[v].fflags; 
+				andcmp &= curnode.gridpt[v].fflags; 
 			}
-#endif // NO_REDUCTION
-			continue;
-		}
-		if(orcmp != 0x0f) { // longer
-			// the leaf lies entirely outside the tet
-			// skip it
-			continue;
-		}
-		if(curnode.ioff == 1 && curnode.joff == 1) {
-			// we've reached a single cell that straddles the tet boundary 
-			// Clip and voxelize it.
 
-			// initialize the unit cube connectivity 
-			// copy all flags from tree traversal
+			if(andcmp == 0x0f) {
 			
-			// if cell shifting is off, use the absolute vertex coordinates
-#ifdef NO_SHIFTING
-			rbounds[2] = {
-				{i*r2d_d.x, j*r2d_d.y}, {(i+1)*r2d_d.x, (j+1)*r2d_d.y}
-			};
-#endif // NO_SHIFTING
-			r2du_init_box(vertbuffer, &nverts, rbounds);
-			for(v = 0; v < nverts; ++v) {
-				vertbuffer[v].fflags = curnode.gridpt[v].fflags;
-				for(f = 0; f < nfaces; ++f)
-					vertbuffer[v].fdist[f] = curnode.gridpt[v].fdist[f];
+				// all cells in this leaf are fully contained
+				ctx->info.num_in += curnode.ioff*curnode.joff;
+				if(!(ctx->mode & R2D_NO_REDUCTION))
+				for(i = curnode.imin; i < curnode.imin + curnode.ioff; ++i)
+				for(j = curnode.jmin; j < curnode.jmin + curnode.joff; ++j)
+					r2du_ctx_fill_cell(ctx, C, i + ibounds[0].x, j + ibounds[0].y, vind(i, j));
+				continue;
+			}
+			if(orcmp != 0x0f) {
+				// the leaf lies entirely outside the tet
+				// skip it
+				ctx->info.num_out += curnode.ioff*curnode.joff;
+				continue;
 			}
+			if(curnode.ioff == 1 && curnode.joff == 1) {
+				// we've reached a single cell that straddles the tet boundary 
+				// Clip and voxelize it.
 
-			// Clipping
-#ifndef NO_CLIPPING
-			r2du_clip_quad(vertbuffer, &nverts, andcmp);
-#endif // NO_CLIPPING
+				// initialize the unit cube connectivity 
+				// copy all flags from tree traversal
+			
+				// if cell shifting is off, use the absolute vertex coordinates
+				ctx->info.num_clip++;
+				if(ctx->mode & R2D_NO_SHIFTING) {
+					rbounds[0].x = curnode.imin*ctx->d.x;
+					rbounds[0].y = curnode.jmin*ctx->d.y;
+					rbounds[1].x = (curnode.imin+1)*ctx->d.x;
+					rbounds[1].y = (curnode.jmin+1)*ctx->d.y;
+				}
 
-			// Reducetion
-#ifndef NO_REDUCTION
-			r2du_reduce(vertbuffer, &nverts, C, vind(curnode.imin, curnode.jmin));
-#endif // NO_REDUCTION
-			continue;	
-		}
+				r2du_init_box(vertbuffer, &nverts, rbounds);
+				for(v = 0; v < nverts; ++v) {
+					vertbuffer[v].fflags = curnode.gridpt[v].fflags;
+					for(f = 0; f < 4; ++f)
+						vertbuffer[v].fdist[f] = curnode.gridpt[v].fdist[f];
+				}
 
-		// else, split the node along its longest dimension
-		// and push to the the stack
-		i = curnode.ioff/2;
-		j = curnode.joff/2;
-		if(i >= j) {
-
-			// LEFT NODE
-			treestack[ntreestack].imin = curnode.imin;
-			treestack[ntreestack].ioff = i;
-			treestack[ntreestack].jmin = curnode.jmin;
-			treestack[ntreestack].joff = curnode.joff;
-			treestack[ntreestack].gridpt[2] = curnode.gridpt[2];
-			treestack[ntreestack].gridpt[3] = curnode.gridpt[3];
-
-			// RIGHT NODE
-			treestack[ntreestack+1].imin = curnode.imin + i;
-			treestack[ntreestack+1].ioff = curnode.ioff - i;
-			treestack[ntreestack+1].jmin = curnode.jmin;
-			treestack[ntreestack+1].joff = curnode.joff;
-			treestack[ntreestack+1].gridpt[0] = curnode.gridpt[0];
-			treestack[ntreestack+1].gridpt[1] = curnode.gridpt[1];
-
-			// FILL IN COMMON POINTS
-			gpt.x = r2d_d.x*(curnode.imin + i);
-			gpt.y = r2d_d.y*curnode.jmin;
-			treestack[ntreestack].gridpt[0].fflags = 0x00;
-			treestack[ntreestack+1].gridpt[3].fflags = 0x00;
-			for(f = 0; f < nfaces; ++f) {
-				gor = faces[f].d + dot(gpt, faces[f].n);
-				treestack[ntreestack].gridpt[0].fdist[f] = gor;
-				treestack[ntreestack+1].gridpt[3].fdist[f] = gor;
-				if(gor > 0.0) {
-					treestack[ntreestack].gridpt[0].fflags |= (1 << f);
-					treestack[ntreestack+1].gridpt[3].fflags |= (1 << f);
+				// Clipping
+				if(!(ctx->mode & R2D_NO_CLIPPING))
+					r2du_clip_quad(vertbuffer, &nverts, andcmp);
+
+				// Reducetion
+				if(!(ctx->mode & R2D_NO_REDUCTION)) {
+					if(ctx->mode & R2D_NO_SHIFTING) {
+						origin.x = ibounds[0].x*ctx->d.x;
+						origin.y = ibounds[0].y*ctx->d.y;
+					}
+					else {
+						origin.x = (curnode.imin + ibounds[0].x + 0.5)*ctx->d.x;
+						origin.y = (curnode.jmin + ibounds[0].y + 0.5)*ctx->d.y;
+					}
+					r2du_ctx_reduce(ctx, vertbuffer, &nverts, C, vind(curnode.imin, curnode.jmin), origin);
 				}
+				continue;	
 			}
-			gpt.y = r2d_d.y*(curnode.jmin + curnode.joff);
-			treestack[ntreestack].gridpt[1].fflags = 0x00;
-			treestack[ntreestack+1].gridpt[2].fflags = 0x00;
-			for(f = 0; f < nfaces; ++f) {
-				gor = faces[f].d + dot(gpt, faces[f].n);
-				treestack[ntreestack].gridpt[1].fdist[f] = gor;
-				treestack[ntreestack+1].gridpt[2].fdist[f] = gor;
-				if(gor > 0.0) {
-					treestack[ntreestack].gridpt[1].fflags |= (1 << f);
-					treestack[ntreestack+1].gridpt[2].fflags |= (1 << f);
+
+			// else, split the node along its longest dimension
+			// and push to the the stack
+			i = curnode.ioff/2;
+			j = curnode.joff/2;
+			if(i >= j) {
+
+				// LEFT NODE
+				treestack[ntreestack].imin = curnode.imin;
+				treestack[ntreestack].ioff = i;
+				treestack[ntreestack].jmin = curnode.jmin;
+				treestack[ntreestack].joff = curnode.joff;
+				treestack[ntreestack].gridpt[2] = curnode.gridpt[2];
+				treestack[ntreestack].gridpt[3] = curnode.gridpt[3];
+
+				// RIGHT NODE
+				treestack[ntreestack+1].imin = curnode.imin + i;
+				treestack[ntreestack+1].ioff = curnode.ioff - i;
+				treestack[ntreestack+1].jmin = curnode.jmin;
+				treestack[ntreestack+1].joff = curnode.joff;
+				treestack[ntreestack+1].gridpt[0] = curnode.gridpt[0];
+				treestack[ntreestack+1].gridpt[1] = curnode.gridpt[1];
+
+				// FILL IN COMMON POINTS
+				gpt.x = ctx->d.x*(curnode.imin + i);
+				gpt.y = ctx->d.y*curnode.jmin;
+				treestack[ntreestack].gridpt[0].fflags = 0x00;
+				treestack[ntreestack+1].gridpt[3].fflags = 0x00;
+				for(f = 0; f < 4; ++f) {
+					gor = faces[f].d + dot(gpt, faces[f].n);
+					treestack[ntreestack].gridpt[0].fdist[f] = gor;
+					treestack[ntreestack+1].gridpt[3].fdist[f] = gor;
+					if(gor > 0.0) {
+						treestack[ntreestack].gridpt[0].fflags |= (1 << f);
+						treestack[ntreestack+1].gridpt[3].fflags |= (1 << f);
+					}
 				}
-			}
-			ntreestack += 2;
-			continue;
-		}
-		else { // j > i
-
-			// LEFT NODE
-			treestack[ntreestack].imin = curnode.imin;
-			treestack[ntreestack].ioff = curnode.ioff;
-			treestack[ntreestack].jmin = curnode.jmin;
-			treestack[ntreestack].joff = j;
-			treestack[ntreestack].gridpt[0] = curnode.gridpt[0];
-			treestack[ntreestack].gridpt[3] = curnode.gridpt[3];
-
-			// RIGHT NODE
-			treestack[ntreestack+1].imin = curnode.imin;
-			treestack[ntreestack+1].ioff = curnode.ioff;
-			treestack[ntreestack+1].jmin = curnode.jmin + j;
-			treestack[ntreestack+1].joff = curnode.joff - j;
-			treestack[ntreestack+1].gridpt[1] = curnode.gridpt[1];
-			treestack[ntreestack+1].gridpt[2] = curnode.gridpt[2];
-
-			// FILL IN COMMON POINTS
-			gpt.x = r2d_d.x*curnode.imin;
-			gpt.y = r2d_d.y*(curnode.jmin + j);
-			treestack[ntreestack].gridpt[2].fflags = 0x00;
-			treestack[ntreestack+1].gridpt[3].fflags = 0x00;
-			for(f = 0; f < nfaces; ++f) {
-				gor = faces[f].d + dot(gpt, faces[f].n);
-				treestack[ntreestack].gridpt[2].fdist[f] = gor;
-				treestack[ntreestack+1].gridpt[3].fdist[f] = gor;
-				if(gor > 0.0) {
-					treestack[ntreestack].gridpt[2].fflags |= (1 << f);
-					treestack[ntreestack+1].gridpt[3].fflags |= (1 << f);
+				gpt.y = ctx->d.y*(curnode.jmin + curnode.joff);
+				treestack[ntreestack].gridpt[1].fflags = 0x00;
+				treestack[ntreestack+1].gridpt[2].fflags = 0x00;
+				for(f = 0; f < 4; ++f) {
+					gor = faces[f].d + dot(gpt, faces[f].n);
+					treestack[ntreestack].gridpt[1].fdist[f] = gor;
+					treestack[ntreestack+1].gridpt[2].fdist[f] = gor;
+					if(gor > 0.0) {
+						treestack[ntreestack].gridpt[1].fflags |= (1 << f);
+						treestack[ntreestack+1].gridpt[2].fflags |= (1 << f);
+					}
 				}
+				ntreestack += 2;
+				continue;
 			}
-			gpt.x = r2d_d.x*(curnode.imin + curnode.ioff);
-			treestack[ntreestack].gridpt[1].fflags = 0x00;
-			treestack[ntreestack+1].gridpt[0].fflags = 0x00;
-			for(f = 0; f < nfaces; ++f) {
-				gor = faces[f].d + dot(gpt, faces[f].n);
-				treestack[ntreestack].gridpt[1].fdist[f] = gor;
-				treestack[ntreestack+1].gridpt[0].fdist[f] = gor;
-				if(gor > 0.0) {
-					treestack[ntreestack].gridpt[1].fflags |= (1 << f);
-					treestack[ntreestack+1].gridpt[0].fflags |= (1 << f);
+			else { // j > i
+
+				// LEFT NODE
+				treestack[ntreestack].imin = curnode.imin;
+				treestack[ntreestack].ioff = curnode.ioff;
+				treestack[ntreestack].jmin = curnode.jmin;
+				treestack[ntreestack].joff = j;
+				treestack[ntreestack].gridpt[0] = curnode.gridpt[0];
+				treestack[ntreestack].gridpt[3] = curnode.gridpt[3];
+
+				// RIGHT NODE
+				treestack[ntreestack+1].imin = curnode.imin;
+				treestack[ntreestack+1].ioff = curnode.ioff;
+				treestack[ntreestack+1].jmin = curnode.jmin + j;
+				treestack[ntreestack+1].joff = curnode.joff - j;
+				treestack[ntreestack+1].gridpt[1] = curnode.gridpt[1];
+				treestack[ntreestack+1].gridpt[2] = curnode.gridpt[2];
+
+				// FILL IN COMMON POINTS
+				gpt.x = ctx->d.x*curnode.imin;
+				gpt.y = ctx->d.y*(curnode.jmin + j);
+				treestack[ntreestack].gridpt[2].fflags = 0x00;
+				treestack[ntreestack+1].gridpt[3].fflags = 0x00;
+				for(f = 0; f < 4; ++f) {
+					gor = faces[f].d + dot(gpt, faces[f].n);
+					treestack[ntreestack].gridpt[2].fdist[f] = gor;
+					treestack[ntreestack+1].gridpt[3].fdist[f] = gor;
+					if(gor > 0.0) {
+						treestack[ntreestack].gridpt[2].fflags |= (1 << f);
+						treestack[ntreestack+1].gridpt[3].fflags |= (1 << f);
+					}
+				}
+				gpt.x = ctx->d.x*(curnode.imin + curnode.ioff);
+				treestack[ntreestack].gridpt[1].fflags = 0x00;
+				treestack[ntreestack+1].gridpt[0].fflags = 0x00;
+				for(f = 0; f < 4; ++f) {
+					gor = faces[f].d + dot(gpt, faces[f].n);
+					treestack[ntreestack].gridpt[1].fdist[f] = gor;
+					treestack[ntreestack+1].gridpt[0].fdist[f] = gor;
+					if(gor > 0.0) {
+						treestack[ntreestack].gridpt[1].fflags |= (1 << f);
+						treestack[ntreestack+1].gridpt[0].fflags |= (1 << f);
+					}
 				}
+				ntreestack += 2;
+				continue;
 			}
-			ntreestack += 2;
-			continue;
 		}
+		return ctx->info;
 	}
-
-#else // !USE_TREE
+	ctx->info.nflat++;
 
 	// make sure the grid buffer is large enough
-	if(r2d_gblen < (nx+1)*(ny+1)) {
-		r2d_gblen = (nx+1)*(ny+1)*2; // extra factor of two to minimize reallocations 
-		r2d_gridpoint* ngb = (r2d_gridpoint*) realloc((void*) r2d_gridbuffer, r2d_gblen*sizeof(r2d_gridpoint));
-		if(ngb == r2d_gridbuffer) {
-			current_info.errmsg = "Bad reallocation of grid buffer";
-			current_info.good = 0;
-			return current_info;
+	if(ctx->gblen < (r2d_long) (nx+1)*(ny+1)) {
+		// extra factor of two to minimize reallocations 
+		if(!r2d_ctx_alloc_grid(ctx, (r2d_long) (nx+1)*(ny+1)*2)) {
+			ctx->info.errmsg = "Bad reallocation of grid buffer";
+			ctx->info.good = 0;
+			return ctx->info;
 		}
-		r2d_gridbuffer = ngb;//(r2d_gridpoint*) realloc((void*) r2d_gridbuffer, r2d_gblen*sizeof(r2d_gridpoint));
 	}
 
 	// check all grid vertices in the patch against each tet face
-	for(i = 0; i <= nx; ++i)
-	for(j = 0; j <= ny; ++j) {
-
-		gpt.x = i*r2d_d.x; gpt.y = j*r2d_d.y;
-		vv0 = gind(i, j);
-		r2d_gridbuffer[vv0].fflags = 0x00;
-
-		// flag the vertex for each face it lies inside
-		// also save its distance from each face
-		for(f = 0; f < nfaces; ++f) {
-			gor = faces[f].d + dot(gpt, faces[f].n);
-			if(gor > 0.0) r2d_gridbuffer[vv0].fflags |= (1 << f);
-			r2d_gridbuffer[vv0].fdist[f] = gor;
-		}
-	}
+	((r2d_orient_fn) ctx->orient)(ctx->gbdist, ctx->gbflags, faces, ctx->d, nx, ny);
 
 	// iterate over all voxels in the patch
 	for(i = 0; i < nx; ++i)
@@ -1012,335 +1310,1238 @@ r2d_info r2d_rasterize_n(r2d_real C, r2d_plane* faces, r2d_int nfaces, r2d_dvec2
 	
 		// check inclusion of each voxel within the tet
 		orcmp = 0x00;
-        andcmp = 0x0f; // longer
+        andcmp = 0x0f;
 		for(v = 0; v < 4; ++v) {
-			orcmp |= r2d_gridbuffer[vv[v]].fflags; 
-			andcmp &= r2d_gridbuffer[vv[v]].fflags; 
+			orcmp |= ctx->gbflags[vv[v]]; 
+			andcmp &= ctx->gbflags[vv[v]]; 
 		}
 
-		if(andcmp == 0x0f) { // longer
+		if(andcmp == 0x0f) {
 			// the voxel is entirely inside the quad
-
-#ifndef NO_REDUCTION
-#ifndef NO_SHIFTING
-			locvol = r2d_d.x*r2d_d.y;
-#else
-			/*
-			locvol = 0.0;
-			locvol -= (i*r2d_d.x)*(j*r2d_d.y)*(k*r2d_d.z);
-			locvol += ((i+1)*r2d_d.x)*(j*r2d_d.y)*(k*r2d_d.z);
-			locvol -= ((i+1)*r2d_d.x)*((j+1)*r2d_d.y)*(k*r2d_d.z);
-			locvol += (i*r2d_d.x)*((j+1)*r2d_d.y)*(k*r2d_d.z);
-			locvol += (i*r2d_d.x)*(j*r2d_d.y)*((k+1)*r2d_d.z);
-			locvol -= ((i+1)*r2d_d.x)*(j*r2d_d.y)*((k+1)*r2d_d.z);
-			locvol += ((i+1)*r2d_d.x)*((j+1)*r2d_d.y)*((k+1)*r2d_d.z);
-			locvol -= (i*r2d_d.x)*((j+1)*r2d_d.y)*((k+1)*r2d_d.z);
-			*/
-#endif // NO_SHIFTING
-			r2d_dest_grid[vind(i, j)] += C*locvol;
-
-			current_info.vtot += locvol;
-			if(locvol < current_info.vox_min) current_info.vox_min = locvol;
-			if(locvol > current_info.vox_max) current_info.vox_max = locvol;
-
-#endif // NO_REDUCTION
+			ctx->info.num_in++;
+			if(!(ctx->mode & R2D_NO_REDUCTION))
+				r2du_ctx_fill_cell(ctx, C, i + ibounds[0].x, j + ibounds[0].y, vind(i, j));
 		}	
-		else if(orcmp == 0x0f) { // longer
+		else if(orcmp == 0x0f) {
 			// the voxel crosses the boundary of the tet
 			// need to process further
 			
 			// initialize the unit cube connectivity 
 			// if shifting is turned off, use absolute coordinates
-#ifdef NO_SHIFTING
-			rbounds = {
-				{i*r2d_d.x, j*r2d_d.y}, {(i+1)*r2d_d.x, (j+1)*r2d_d.y}
-			};
-#endif // NO_SHIFTING
+			ctx->info.num_clip++;
+			if(ctx->mode & R2D_NO_SHIFTING) {
+				rbounds[0].x = i*ctx->d.x;
+				rbounds[0].y = j*ctx->d.y;
+				rbounds[1].x = (i+1)*ctx->d.x;
+				rbounds[1].y = (j+1)*ctx->d.y;
+			}
+
 			r2du_init_box(vertbuffer, &nverts, rbounds);
 			for(v = 0; v < nverts; ++v) {
-				vertbuffer[v].fflags = r2d_gridbuffer[vv[v]].fflags;
+				vertbuffer[v].fflags = ctx->gbflags[vv[v]];
 				for(f = 0; f < 4; ++f)
-					vertbuffer[v].fdist[f] = r2d_gridbuffer[vv[v]].fdist[f];
+					vertbuffer[v].fdist[f] = ctx->gbdist[f][vv[v]];
 			}
 
 			// Clipping
-#ifndef NO_CLIPPING
-		/*r2du_clip_quad(vertbuffer, &nverts, andcmp);*/
-		r2du_clip_n(vertbuffer, &nverts, faces, 4);
-#endif // NO_CLIPPING
-
-#ifndef NO_REDUCTION
-		r2du_reduce(vertbuffer, &nverts, C, vind(i, j));
-#endif // NO_REDUCTION
+		if(!(ctx->mode & R2D_NO_CLIPPING))
+			r2du_clip_quad(vertbuffer, &nverts, andcmp);
+		/*r2du_clip_n(vertbuffer, &nverts, faces, 4);*/
+
+		if(!(ctx->mode & R2D_NO_REDUCTION)) {
+			if(ctx->mode & R2D_NO_SHIFTING) {
+				origin.x = ibounds[0].x*ctx->d.x;
+				origin.y = ibounds[0].y*ctx->d.y;
+			}
+			else {
+				origin.x = (i + ibounds[0].x + 0.5)*ctx->d.x;
+				origin.y = (j + ibounds[0].y + 0.5)*ctx->d.y;
+			}
+			r2du_ctx_reduce(ctx, vertbuffer, &nverts, C, vind(i, j), origin);
+		}
 		}
+		else ctx->info.num_out++;
 	}
-#endif // USE_TREE
 
-	return current_info;
+	return ctx->info;
 }
 
+// flags of the faces that the point (x, y) of the patch lies inside
+static inline r2d_ulong r2du_flags_n(r2d_plane* faces, r2d_int nfaces, r2d_real x, r2d_real y) {
+	r2d_int f;
+	r2d_rvec2 gpt = {x, y};
+	r2d_ulong fflags = 0;
+	for(f = 0; f < nfaces; ++f)
+		if(faces[f].d + dot(gpt, faces[f].n) > 0.0) fflags |= ((r2d_ulong) 1 << f);
+	return fflags;
+}
 
+// Clips cell (i, j) of the patch against the faces of a polygon that its
+// corners, with face flags fflags in r2du_init_box order, are not all
+// inside of, and adds its moments. The distances to those faces are
+// only worked out here.
+static void r2d_ctx_clip_cell_n(r2d_context* ctx, r2d_real C, r2d_plane* faces, r2d_int nfaces,
+		r2d_ulong* fflags, r2d_ulong andcmp, r2d_int i, r2d_int j, r2d_dvec2 ibounds[2]) {
 
+	static const r2d_int corner[4][2] = {{1, 0}, {1, 1}, {0, 1}, {0, 0}};
+	r2d_int v, f, nverts;
+	r2d_rvec2 gpt, origin;
+	r2d_rvec2 rbounds[2] = {
+		{-0.5*ctx->d.x, -0.5*ctx->d.y}, {0.5*ctx->d.x, 0.5*ctx->d.y}
+	};
+	r2d_vertex64 vertbuffer[4 + 2*R2D_MAX_FACES];
+
+	ctx->info.num_clip++;
+	if(ctx->mode & R2D_NO_SHIFTING) {
+		rbounds[0].x = i*ctx->d.x;
+		rbounds[0].y = j*ctx->d.y;
+		rbounds[1].x = (i+1)*ctx->d.x;
+		rbounds[1].y = (j+1)*ctx->d.y;
+	}
 
-inline void r2du_clip_n_andcmp(r2d_vertex64* vertbuffer, r2d_int* nverts, r2d_ulong andcmp, r2d_int nfaces) {
+	// the cell, connected as in r2du_init_box
+	nverts = 4;
+	for(v = 0; v < 4; ++v) {
+		vertbuffer[v].pnbrs[0] = (v+3)%4;
+		vertbuffer[v].pnbrs[1] = (v+1)%4;
+		vertbuffer[v].pos.x = rbounds[corner[v][0]].x;
+		vertbuffer[v].pos.y = rbounds[corner[v][1]].y;
+		vertbuffer[v].fflags = fflags[v];
+		vertbuffer[v].clipped = 0;
+		gpt.x = (i + corner[v][0])*ctx->d.x;
+		gpt.y = (j + corner[v][1])*ctx->d.y;
+		for(f = 0; f < nfaces; ++f)
+			if(!(andcmp & ((r2d_ulong) 1 << f)))
+				vertbuffer[v].fdist[f] = faces[f].d + dot(gpt, faces[f].n);
+	}
 
-	r2d_int v, f, ff;
-	r2d_int vstart, vnext, vcur, searching;
-	r2d_ulong fmask, ffmask;
+	if(!(ctx->mode & R2D_NO_CLIPPING))
+		r2du_clip_n(vertbuffer, &nverts, andcmp, nfaces);
 
-	// loop over faces
+	if(!(ctx->mode & R2D_NO_REDUCTION)) {
+		if(ctx->mode & R2D_NO_SHIFTING) {
+			origin.x = ibounds[0].x*ctx->d.x;
+			origin.y = ibounds[0].y*ctx->d.y;
+		}
+		else {
+			origin.x = (i + ibounds[0].x + 0.5)*ctx->d.x;
+			origin.y = (j + ibounds[0].y + 0.5)*ctx->d.y;
+		}
+		r2du_ctx_reduce_n(ctx, vertbuffer, &nverts, C, vind(i, j), origin);
+	}
+}
+
+///// WARNING! MODIFIES THE INPUT FACES! ///////
+r2d_info r2d_ctx_rasterize_n(r2d_context* ctx, r2d_real C, r2d_plane* faces, r2d_int nfaces, r2d_dvec2 ibounds[2]) {
+
+	// variables used in this function
+	r2d_int i, j, f, v, nx, ny;
+	r2d_ulong all, orcmp, andcmp;
+	r2d_ulong fl[4];
+	r2d_ulong* gflags;
+
+	// stack for the tree
+	r2d_treenode64 treestack[256];
+	r2d_int ntreestack;
+	r2d_treenode64 curnode;
+
+	// start keeping track for this polygon
+	ctx->info.good = 1;
+	ctx->info.vtot = 0.0;
+	ctx->info.vox_min = 1.0e99;
+	ctx->info.vox_max = -1.0e99;
+	ctx->info.nrect = 0;
+	ctx->info.nedge = 0;
+	ctx->info.nclip = 0;
+	ctx->info.num_in = 0;
+	ctx->info.num_clip = 0;
+	ctx->info.num_out = 0;
+	ctx->info.ntree = 0;
+	ctx->info.nflat = 0;
+
+	if(nfaces < 1 || nfaces > R2D_MAX_FACES) {
+		ctx->info.errmsg = "Polygons need 1 to 64 faces";
+		ctx->info.good = 0;
+		return ctx->info;
+	}
+	all = (nfaces < 64) ? ((r2d_ulong) 1 << nfaces) - 1 : ~((r2d_ulong) 0);
+
+	// shift the faces to align with
+	// the working range of indices
+	// THIS CHANGES THE INPUT FACES
 	for(f = 0; f < nfaces; ++f) {
+		faces[f].d += ibounds[0].x*ctx->d.x*faces[f].n.x
+							+ ibounds[0].y*ctx->d.y*faces[f].n.y;
+	}
+	nx = ibounds[1].x - ibounds[0].x; 
+	ny = ibounds[1].y - ibounds[0].y; 
+	ctx->info.nclip++;
+
+	// the same search as for quads, on the face flags alone
+	if((ctx->mode & R2D_TREE) || (ctx->tree_threshold > 0 && (r2d_long) nx*ny >= ctx->tree_threshold)) {
+		ctx->info.ntree++;
+
+		curnode.fflags[0] = r2du_flags_n(faces, nfaces, nx*ctx->d.x, 0.0);
+		curnode.fflags[1] = r2du_flags_n(faces, nfaces, nx*ctx->d.x, ny*ctx->d.y);
+		curnode.fflags[2] = r2du_flags_n(faces, nfaces, 0.0, ny*ctx->d.y);
+		curnode.fflags[3] = r2du_flags_n(faces, nfaces, 0.0, 0.0);
+		curnode.imin = 0;
+		curnode.jmin = 0;
+		curnode.ioff = nx;
+		curnode.joff = ny;
+
+		ntreestack = 0;
+		treestack[ntreestack++] = curnode;
+		while(ntreestack > 0) {
+
+			// pop the top node
+			curnode = treestack[--ntreestack];
+
+			orcmp = 0;
+			andcmp = all;
+			for(v = 0; v < 4; ++v) {
+				orcmp |= curnode.fflags[v]; 
+				andcmp &= curnode.fflags[v]; 
+			}
 
-		fmask = (1 << f);
-		if(andcmp & fmask) continue;
+			if(andcmp == all) {
+				// all cells in this leaf are fully contained
+				ctx->info.num_in += curnode.ioff*curnode.joff;
+				if(!(ctx->mode & R2D_NO_REDUCTION))
+				for(i = curnode.imin; i < curnode.imin + curnode.ioff; ++i)
+				for(j = curnode.jmin; j < curnode.jmin + curnode.joff; ++j)
+					r2du_ctx_fill_cell(ctx, C, i + ibounds[0].x, j + ibounds[0].y, vind(i, j));
+				continue;
+			}
+			if(orcmp != all) {
+				// the leaf lies entirely outside the polygon
+				ctx->info.num_out += curnode.ioff*curnode.joff;
+				continue;
+			}
+			if(curnode.ioff == 1 && curnode.joff == 1) {
+				// a single cell straddling the boundary
+				r2d_ctx_clip_cell_n(ctx, C, faces, nfaces, curnode.fflags, andcmp,
+						curnode.imin, curnode.jmin, ibounds);
+				continue;	
+			}
 
-		// find the first vertex lying outside of the face
-		// only need to find one (taking advantage of convexity)
-		// TODO: add a smarter graph traversal here!
-		vcur = 41663;
-		for(v = 0; vcur >= 41663 && v < *nverts; ++v) 
-			if(!(vertbuffer[v].fflags & (CLIP_MASK_64 | fmask))) vcur = v;
-		if(vcur >= 41663) continue;
-				
-/*
-		// traverse to the vertex lying oustide of the clip plane
-		while(r2d_vertbuffer[vcur].fflags & fmask) {
-			if(r2d_vertbuffer[vcur].fdist)
-			if(r2d_vertbuffer[r2d_vertbuffer[vcur].pnbrs[0]].fdist[f] < r2d_vertbuffer[r2d_vertbuffer[vcur].pnbrs[1]].fdist[f]) {
-				vcur = r2d_vertbuffer[vcur].pnbrs[0];
+			// else, split the node along its longest dimension
+			// and push to the the stack
+			i = curnode.ioff/2;
+			j = curnode.joff/2;
+			if(i >= j) {
+				treestack[ntreestack].imin = curnode.imin;
+				treestack[ntreestack].ioff = i;
+				treestack[ntreestack].jmin = curnode.jmin;
+				treestack[ntreestack].joff = curnode.joff;
+				treestack[ntreestack].fflags[2] = curnode.fflags[2];
+				treestack[ntreestack].fflags[3] = curnode.fflags[3];
+				treestack[ntreestack+1].imin = curnode.imin + i;
+				treestack[ntreestack+1].ioff = curnode.ioff - i;
+				treestack[ntreestack+1].jmin = curnode.jmin;
+				treestack[ntreestack+1].joff = curnode.joff;
+				treestack[ntreestack+1].fflags[0] = curnode.fflags[0];
+				treestack[ntreestack+1].fflags[1] = curnode.fflags[1];
+
+				// common points
+				treestack[ntreestack].fflags[0] = treestack[ntreestack+1].fflags[3]
+					= r2du_flags_n(faces, nfaces, ctx->d.x*(curnode.imin + i), ctx->d.y*curnode.jmin);
+				treestack[ntreestack].fflags[1] = treestack[ntreestack+1].fflags[2]
+					= r2du_flags_n(faces, nfaces, ctx->d.x*(curnode.imin + i), ctx->d.y*(curnode.jmin + curnode.joff));
 			}
 			else {
-				vcur = r2d_vertbuffer[vcur].pnbrs[1];
+				treestack[ntreestack].imin = curnode.imin;
+				treestack[ntreestack].ioff = curnode.ioff;
+				treestack[ntreestack].jmin = curnode.jmin;
+				treestack[ntreestack].joff = j;
+				treestack[ntreestack].fflags[0] = curnode.fflags[0];
+				treestack[ntreestack].fflags[3] = curnode.fflags[3];
+				treestack[ntreestack+1].imin = curnode.imin;
+				treestack[ntreestack+1].ioff = curnode.ioff;
+				treestack[ntreestack+1].jmin = curnode.jmin + j;
+				treestack[ntreestack+1].joff = curnode.joff - j;
+				treestack[ntreestack+1].fflags[1] = curnode.fflags[1];
+				treestack[ntreestack+1].fflags[2] = curnode.fflags[2];
+
+				// common points
+				treestack[ntreestack].fflags[2] = treestack[ntreestack+1].fflags[3]
+					= r2du_flags_n(faces, nfaces, ctx->d.x*curnode.imin, ctx->d.y*(curnode.jmin + j));
+				treestack[ntreestack].fflags[1] = treestack[ntreestack+1].fflags[0]
+					= r2du_flags_n(faces, nfaces, ctx->d.x*(curnode.imin + curnode.ioff), ctx->d.y*(curnode.jmin + j));
 			}
+			ntreestack += 2;
+		}
+		return ctx->info;
+	}
+	ctx->info.nflat++;
+
+	// the face flags of the grid vertices go in the grid buffer,
+	// which has room for them wherever it could hold the quad distances
+	if(ctx->gblen < (r2d_long) (nx+1)*(ny+1)) {
+		if(!r2d_ctx_alloc_grid(ctx, (r2d_long) (nx+1)*(ny+1)*2)) {
+			ctx->info.errmsg = "Bad reallocation of grid buffer";
+			ctx->info.good = 0;
+			return ctx->info;
+		}
+	}
+	gflags = (r2d_ulong*) ctx->gbdist[0];
+	for(i = 0; i <= nx; ++i)
+	for(j = 0; j <= ny; ++j)
+		gflags[gind(i, j)] = r2du_flags_n(faces, nfaces, i*ctx->d.x, j*ctx->d.y);
 
+	// iterate over all cells in the patch
+	for(i = 0; i < nx; ++i)
+	for(j = 0; j < ny; ++j) {
+
+		fl[0] = gflags[gind(i+1, j)];
+		fl[1] = gflags[gind(i+1, j+1)];
+		fl[2] = gflags[gind(i, j+1)];
+		fl[3] = gflags[gind(i, j)];
+		orcmp = fl[0] | fl[1] | fl[2] | fl[3];
+		andcmp = fl[0] & fl[1] & fl[2] & fl[3];
+
+		if(andcmp == all) {
+			ctx->info.num_in++;
+			if(!(ctx->mode & R2D_NO_REDUCTION))
+				r2du_ctx_fill_cell(ctx, C, i + ibounds[0].x, j + ibounds[0].y, vind(i, j));
 		}
-*/
+		else if(orcmp == all)
+			r2d_ctx_clip_cell_n(ctx, C, faces, nfaces, fl, andcmp, i, j, ibounds);
+		else ctx->info.num_out++;
+	}
 
-		// traverse to the right
-		vstart = vcur;
-		searching = 1;
-		while(searching) { 
-			vnext = vertbuffer[vcur].pnbrs[1];
-			if(fmask & vertbuffer[vnext].fflags) {
-				// vnext is inside the face
+	return ctx->info;
+}
 
-				// compute the intersection point using a weighted
-				// average of perpendicular distances to the plane
-				wav(vertbuffer[vcur].pos, vertbuffer[vnext].fdist[f],
-					vertbuffer[vnext].pos, -vertbuffer[vcur].fdist[f],
-					vertbuffer[*nverts].pos);
-				
-				vertbuffer[*nverts].pnbrs[1] = vnext;
+//////////////////////////////////////////
+/// r2d mesh /////////////////////////////
+//////////////////////////////////////////
 
-				// reciprocal connetivity
-				vertbuffer[vnext].pnbrs[0] = *nverts;
+// macros for mesh and image access
+#define mind(i, j) (2*((mesh_dims.y+1)*(i) + (j)))
+#define pind(i, j) (pdims.y*(i) + (j))
+
+// Computes the overlap of one mesh quad, or any convex polygon of nverts
+// corners, with the unit pixels of an image of size img_dims. The overlaps
+// are written to the patch buffer (grown as needed), which covers pixels
+// porig through porig + pdims. With polyorder > 0 the patch holds one plane
+// per moment, measured from the patch corner. Returns 0 if the polygon lies
+// entirely outside of the image, -1 on a bad allocation.
+static r2d_int r2d_overlap_poly(r2d_context* ctx, r2d_rvec2* verts, r2d_int nverts, r2d_dvec2 img_dims,
+		r2d_int polyorder, r2d_real** patch, r2d_long* plen, r2d_dvec2* porig, r2d_dvec2* pdims) {
+
+	r2d_int v, m;
+	r2d_long npix, need;
+	r2d_real* planes[6];
+	r2d_real xmin, ymin, xmax, ymax;
+	r2d_dvec2 pend;
+	r2d_rvec2 lverts[R2D_MAX_FACES], window;
+	r2d_plane faces[R2D_MAX_FACES];
+	r2d_dvec2 ibounds[2];
+
+	// bounding box of the polygon
+	xmin = xmax = verts[0].x;
+	ymin = ymax = verts[0].y;
+	for(v = 1; v < nverts; ++v) {
+		if(verts[v].x < xmin) xmin = verts[v].x;
+		if(verts[v].x > xmax) xmax = verts[v].x;
+		if(verts[v].y < ymin) ymin = verts[v].y;
+		if(verts[v].y > ymax) ymax = verts[v].y;
+	}
 
-				// do face intersections and flags
-				vertbuffer[*nverts].fflags = 0x00;
-				for(ff = f + 1; ff < nfaces; ++ff) {
+	// pixel index range, clamped to the image
+	porig->x = floor(xmin);
+	porig->y = floor(ymin);
+	pend.x = floor(xmax) + 1;
+	pend.y = floor(ymax) + 1;
+	if(porig->x < 0) porig->x = 0;
+	if(porig->y < 0) porig->y = 0;
+	if(pend.x > img_dims.x) pend.x = img_dims.x;
+	if(pend.y > img_dims.y) pend.y = img_dims.y;
+	pdims->x = pend.x - porig->x;
+	pdims->y = pend.y - porig->y;
+	if(pdims->x <= 0 || pdims->y <= 0) return 0;
+
+	// make sure the patch buffer is large enough
+	npix = (r2d_long) pdims->x*pdims->y;
+	need = npix*r2d_num_moments[polyorder];
+	if(need > *plen) {
+		r2d_real* npatch = (r2d_real*) realloc((void*) *patch, 2*need*sizeof(r2d_real));
+		if(!npatch) return -1;
+		*patch = npatch;
+		*plen = 2*need;
+	}
 
-					// skip if all initial verts are inside ff
-					ffmask = (1 << ff); 
-					if(andcmp & ffmask) continue;
+	// work relative to the patch corner to keep precision
+	for(v = 0; v < nverts; ++v) {
+		lverts[v].x = verts[v].x - porig->x;
+		lverts[v].y = verts[v].y - porig->y;
+	}
+	r2du_faces_from_verts(lverts, nverts, faces);
+
+	memset((void*) *patch, 0, need*sizeof(r2d_real));
+	window.x = pdims->x;
+	window.y = pdims->y;
+	for(m = 0; m < r2d_num_moments[polyorder]; ++m)
+		planes[m] = *patch + m*npix;
+	r2d_ctx_set_dest_moments(ctx, planes, polyorder, *pdims, window);
+	ibounds[0].x = 0;
+	ibounds[0].y = 0;
+	ibounds[1] = *pdims;
+	if(nverts == 4) r2d_ctx_rasterize_quad(ctx, 1.0, faces, ibounds);
+	else r2d_ctx_rasterize_n(ctx, 1.0, faces, nverts, ibounds);
+
+	return 1;
+}
 
-					// weighted average keeps us in a relative coordinate system
-					
-					vertbuffer[*nverts].fdist[ff] = (vertbuffer[vcur].fdist[ff]*vertbuffer[vnext].fdist[f] 
-							- vertbuffer[vnext].fdist[ff]*vertbuffer[vcur].fdist[f])
-							/(vertbuffer[vnext].fdist[f] - vertbuffer[vcur].fdist[f]);
-					if(vertbuffer[*nverts].fdist[ff] > 0.0) vertbuffer[*nverts].fflags |= ffmask;
-				}
-				++(*nverts);
-				searching = 0;
-			}
-			vertbuffer[vcur].fflags |= CLIP_MASK_64;
-			vcur = vnext;
-		}
+// Gathers the four corners of quad (i, j) of the mesh, CCW
+static void r2d_mesh_quad(r2d_real* verts, r2d_dvec2 mesh_dims,
+		r2d_int i, r2d_int j, r2d_rvec2 quad[4]) {
+	quad[0].x = verts[mind(i, j)];
+	quad[0].y = verts[mind(i, j) + 1];
+	quad[1].x = verts[mind(i+1, j)];
+	quad[1].y = verts[mind(i+1, j) + 1];
+	quad[2].x = verts[mind(i+1, j+1)];
+	quad[2].y = verts[mind(i+1, j+1) + 1];
+	quad[3].x = verts[mind(i, j+1)];
+	quad[3].y = verts[mind(i, j+1) + 1];
+}
 
-		// traverse to the left
-		vcur = vstart;
-		searching = 1;
-		while(searching) { 
-			vnext = vertbuffer[vcur].pnbrs[0];
-			if(fmask & vertbuffer[vnext].fflags) {
-				// vnext is inside the face
+// Line integrals of a piecewise-constant image along the edge a -> b,
+// parameterized as (1-t)*a + t*b: I0 gets the integral of s dt and I1 that
+// of s*t dt. Pixels outside of the image count as 0. An edge running along
+// a pixel boundary sees the average of the pixels on either side.
+static void r2du_edge_integrals(r2d_rvec2 a, r2d_rvec2 b, r2d_real* img, r2d_dvec2 dims,
+		r2d_real* I0, r2d_real* I1) {
+
+	r2d_int px, py, axis;
+	r2d_real t0, t1, tm, s;
+	r2d_real dx = b.x - a.x;
+	r2d_real dy = b.y - a.y;
+	r2d_real tx = 2.0, ty = 2.0, dtx = 0.0, dty = 0.0;
+
+// image value at pixel (i, j), zero outside of the image
+#define r2du_img_at(i, j) (((i) >= 0 && (i) < dims.x && (j) >= 0 && (j) < dims.y) ? \
+		img[(r2d_long) dims.y*(i) + (j)] : 0.0)
+
+	*I0 = 0.0;
+	*I1 = 0.0;
+
+	// an edge lying on a grid line has no unique pixel, so take both
+	axis = (dx == 0.0 && a.x == floor(a.x)) | 2*(dy == 0.0 && a.y == floor(a.y));
+	if(axis == 3) return;
+
+	// parameters of the next crossings of integer x and y
+	if(dx > 0.0) { tx = (floor(a.x) + 1.0 - a.x)/dx; dtx = 1.0/dx; }
+	if(dx < 0.0) { tx = (ceil(a.x) - 1.0 - a.x)/dx; dtx = -1.0/dx; }
+	if(dy > 0.0) { ty = (floor(a.y) + 1.0 - a.y)/dy; dty = 1.0/dy; }
+	if(dy < 0.0) { ty = (ceil(a.y) - 1.0 - a.y)/dy; dty = -1.0/dy; }
+
+	for(t0 = 0.0; t0 < 1.0; t0 = t1) {
+		t1 = 1.0;
+		if(tx < t1) t1 = tx;
+		if(ty < t1) t1 = ty;
+		if(t1 == tx) tx += dtx;
+		if(t1 == ty) ty += dty;
+
+		// the pixel under the middle of the segment
+		tm = 0.5*(t0 + t1);
+		px = floor(a.x + tm*dx);
+		py = floor(a.y + tm*dy);
+		if(axis == 1) s = 0.5*(r2du_img_at(px - 1, py) + r2du_img_at(px, py));
+		else if(axis == 2) s = 0.5*(r2du_img_at(px, py - 1) + r2du_img_at(px, py));
+		else s = r2du_img_at(px, py);
+		*I0 += s*(t1 - t0);
+		*I1 += 0.5*s*(t1*t1 - t0*t0);
+	}
+#undef r2du_img_at
+}
 
-				// compute the intersection point using a weighted
-				// average of perpendicular distances to the plane
-				wav(vertbuffer[vcur].pos, vertbuffer[vnext].fdist[f],
-					vertbuffer[vnext].pos, -vertbuffer[vcur].fdist[f],
-					vertbuffer[*nverts].pos);
-				
-				vertbuffer[*nverts].pnbrs[0] = vnext;
+// Derivatives of the integral of a piecewise-constant image over a CCW
+// quad with respect to its corners, in grad[2*v] and grad[2*v+1]. Moving
+// a corner sweeps the two edges that meet there, so each derivative is the
+// image integrated along those edges against the hat function of the corner,
+// times the outward edge normal.
+static void r2d_quad_grad(r2d_rvec2 quad[4], r2d_real* img, r2d_dvec2 dims, r2d_real* grad) {
+	r2d_int v, w;
+	r2d_real I0, I1, nx, ny;
+	memset(grad, 0, 8*sizeof(r2d_real));
+	for(v = 0; v < 4; ++v) {
+		w = (v + 1)%4;
+		r2du_edge_integrals(quad[v], quad[w], img, dims, &I0, &I1);
+		nx = quad[w].y - quad[v].y;
+		ny = quad[v].x - quad[w].x;
+		grad[2*v] += (I0 - I1)*nx;
+		grad[2*v + 1] += (I0 - I1)*ny;
+		grad[2*w] += I1*nx;
+		grad[2*w + 1] += I1*ny;
+	}
+}
 
-				// reciprocal connetivity
-				vertbuffer[vnext].pnbrs[1] = *nverts;
+// accumulates the per-quad stats into the mesh-wide info
+static void r2d_mesh_info(r2d_info* minfo, r2d_info qinfo) {
+	if(!qinfo.good) {
+		minfo->good = 0;
+		minfo->errmsg = qinfo.errmsg;
+	}
+	minfo->vtot += qinfo.vtot;
+	if(qinfo.vox_min < minfo->vox_min) minfo->vox_min = qinfo.vox_min;
+	if(qinfo.vox_max > minfo->vox_max) minfo->vox_max = qinfo.vox_max;
+	minfo->nrect += qinfo.nrect;
+	minfo->nedge += qinfo.nedge;
+	minfo->nclip += qinfo.nclip;
+	minfo->num_in += qinfo.num_in;
+	minfo->num_clip += qinfo.num_clip;
+	minfo->num_out += qinfo.num_out;
+	minfo->ntree += qinfo.ntree;
+	minfo->nflat += qinfo.nflat;
+}
 
-				// do face intersections and flags
-				vertbuffer[*nverts].fflags = 0x00;
-				for(ff = f + 1; ff < nfaces; ++ff) {
+// per-thread scratch space and stats for the mesh functions
+typedef struct {
+	r2d_context ctx;
+	r2d_real* patch;
+	r2d_long plen;
+	r2d_info info;
+} r2d_mesh_worker;
+
+// a contiguous block of mesh rows handled by one thread. img is the
+// source image (or its polynomial coefficients) when depositing, or the
+// (partial) destination when skimming, in which case it holds image rows
+// xoff through xoff + nx. When building an overlap matrix, each job keeps
+// its own nonzeros in cols and vals, and the row counts go into indptr.
+// Deposits may carry nimg images at once, interleaved pixel by pixel.
+// For a list of polygons, offsets says where each one's vertices start,
+// and the polygons ibegin through iend belong to the job.
+typedef struct {
+	r2d_real* verts;
+	r2d_long* offsets;
+	r2d_dvec2 mesh_dims;
+	r2d_real* img;
+	r2d_dvec2 img_dims;
+	r2d_real* fluxes;
+	r2d_real* grad;
+	r2d_int polyorder;
+	r2d_int nimg;
+	r2d_int ibegin, iend;
+	r2d_int xoff, nx;
+	r2d_int rbegin, rend;
+	r2d_int njobs;
+	void* jobs;
+	r2d_long* indptr;
+	r2d_long* cols;
+	r2d_real* vals;
+	r2d_long nnz, cap;
+	r2d_mesh_worker w;
+	// for r2d_flat_step, where the jobs split the vertex rows: the fluxes
+	// to fit, the fit parameters, copies of the old vertex rows just
+	// before and after the job's rows, and the job's share of the sums
+	r2d_real* target;
+	r2d_real lum, step;
+	r2d_real* halo;
+	r2d_real sums[4];
+} r2d_mesh_job;
+
+static r2d_info r2d_mesh_worker_init(r2d_mesh_worker* w) {
+	w->plen = 64;
+	w->patch = (r2d_real*) malloc(w->plen*sizeof(r2d_real));
+	w->info = r2d_ctx_init(&w->ctx, w->plen);
+	w->info.vtot = 0.0;
+	w->info.vox_min = 1.0e99;
+	w->info.vox_max = -1.0e99;
+	if(!w->info.good || !w->patch) {
+		w->info.good = 0;
+		w->info.errmsg = "Bad allocation of patch buffer";
+	}
+	return w->info;
+}
 
-					// skip if all verts are inside ff
-					ffmask = (1 << ff); 
-					if(andcmp & ffmask) continue;
+static void r2d_mesh_worker_finalize(r2d_mesh_worker* w) {
+	if(w->patch) free(w->patch);
+	w->patch = NULL;
+	r2d_ctx_finalize(&w->ctx);
+}
 
-					// weighted average keeps us in a relative coordinate system
-					vertbuffer[*nverts].fdist[ff] = (vertbuffer[vcur].fdist[ff]*vertbuffer[vnext].fdist[f] 
-							- vertbuffer[vnext].fdist[ff]*vertbuffer[vcur].fdist[f])
-							/(vertbuffer[vnext].fdist[f] - vertbuffer[vcur].fdist[f]);
-					if(vertbuffer[*nverts].fdist[ff] > 0.0) vertbuffer[*nverts].fflags |= ffmask;
+// number of threads to use for a mesh with nrows rows of quads
+static r2d_int r2d_mesh_nthreads(r2d_int nthreads, r2d_int nrows) {
+	if(nthreads <= 0) nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if(nthreads > nrows) nthreads = nrows;
+	if(nthreads < 1) nthreads = 1;
+	return nthreads;
+}
 
-				}
-				++(*nverts);
-				searching = 0;
-			}
-			vertbuffer[vcur].fflags |= CLIP_MASK_64;
-			vcur = vnext;
+// runs fn over all jobs, one thread each, the first on the calling thread.
+// Falls back to running a job in place if its thread can't be started.
+static void r2d_mesh_run(void* (*fn)(void*), r2d_mesh_job* jobs, r2d_int njobs) {
+	r2d_int t;
+	unsigned char* started = (unsigned char*) calloc(njobs, 1);
+	pthread_t* threads = (pthread_t*) malloc(njobs*sizeof(pthread_t));
+	for(t = 1; t < njobs; ++t)
+		if(started && threads)
+			started[t] = !pthread_create(&threads[t], NULL, fn, (void*) &jobs[t]);
+	fn((void*) &jobs[0]);
+	for(t = 1; t < njobs; ++t) {
+		if(started && started[t]) pthread_join(threads[t], NULL);
+		else fn((void*) &jobs[t]);
+	}
+	if(started) free(started);
+	if(threads) free(threads);
+}
+
+// adds the source pixels under the overlaps in the worker's patch to
+// flux, for every image in the stack at once
+static void r2d_patch_flux(r2d_mesh_job* job, r2d_dvec2 porig, r2d_dvec2 pdims, r2d_real* flux) {
+
+	r2d_int a, b, k, m;
+	r2d_int nimg = job->nimg;
+	r2d_int nmom = r2d_num_moments[job->polyorder];
+	r2d_long npix;
+	r2d_real wt, cx, cy;
+	r2d_real mom[6];
+	r2d_real* coeffs;
+	r2d_real* patch = job->w.patch;
+
+	if(!job->polyorder) {
+		for(a = 0; a < pdims.x; ++a)
+		for(b = 0; b < pdims.y; ++b) {
+			wt = patch[pind(a, b)];
+			coeffs = &job->img[nimg*((r2d_long) job->img_dims.y*(porig.x + a) + (porig.y + b))];
+			for(k = 0; k < nimg; ++k)
+				flux[k] += wt*coeffs[k];
 		}
-		vertbuffer[*nverts-2].pnbrs[0] = *nverts-1; 
-		vertbuffer[*nverts-1].pnbrs[1] = *nverts-2;
+		return;
+	}
+
+	// polynomial source: take the moments about each pixel center
+	// and contract them with that pixel's coefficients
+	npix = (r2d_long) pdims.x*pdims.y;
+	for(a = 0; a < pdims.x; ++a)
+	for(b = 0; b < pdims.y; ++b) {
+		for(m = 0; m < nmom; ++m)
+			mom[m] = patch[m*npix + pind(a, b)];
+		cx = a + 0.5;
+		cy = b + 0.5;
+		if(job->polyorder >= 2) {
+			mom[3] += -2.0*cx*mom[1] + cx*cx*mom[0];
+			mom[4] += -2.0*cy*mom[2] + cy*cy*mom[0];
+			mom[5] += -cx*mom[2] - cy*mom[1] + cx*cy*mom[0];
+		}
+		mom[1] -= cx*mom[0];
+		mom[2] -= cy*mom[0];
+		coeffs = &job->img[nimg*nmom*((r2d_long) job->img_dims.y*(porig.x + a) + (porig.y + b))];
+		for(k = 0; k < nimg; ++k)
+		for(m = 0; m < nmom; ++m)
+			flux[k] += coeffs[nmom*k + m]*mom[m];
 	}
 }
 
+static void* r2d_deposit_rows(void* arg) {
+
+	r2d_mesh_job* job = (r2d_mesh_job*) arg;
+	r2d_mesh_worker* w = &job->w;
+	r2d_dvec2 mesh_dims = job->mesh_dims;
+	r2d_int i, j, k, r;
+	r2d_int nimg = job->nimg;
+	r2d_real* flux;
+	r2d_rvec2 quad[4];
+	r2d_dvec2 porig, pdims;
+
+	if(!r2d_mesh_worker_init(w).good) return NULL;
+
+	for(i = job->ibegin; i < job->iend; ++i)
+	for(j = 0; j < mesh_dims.y; ++j) {
+
+		r2d_mesh_quad(job->verts, mesh_dims, i, j, quad);
+		if(job->grad)
+			r2d_quad_grad(quad, job->img, job->img_dims, &job->grad[8*((r2d_long) mesh_dims.y*i + j)]);
+		flux = &job->fluxes[nimg*((r2d_long) mesh_dims.y*i + j)];
+		for(k = 0; k < nimg; ++k) flux[k] = 0.0;
+		r = r2d_overlap_poly(&w->ctx, quad, 4, job->img_dims, job->polyorder,
+				&w->patch, &w->plen, &porig, &pdims);
+		if(r < 0) {
+			w->info.good = 0;
+			w->info.errmsg = "Bad reallocation of patch buffer";
+			continue;
+		}
+		if(!r) continue;
+		r2d_mesh_info(&w->info, w->ctx.info);
+		r2d_patch_flux(job, porig, pdims, flux);
+	}
+	return NULL;
+}
 
-inline void r2du_clip_n(r2d_vertex* vertbuffer, r2d_int* nverts,
-							r2d_plane* faces, r2d_int nfaces) {
+static void* r2d_deposit_polys(void* arg) {
 
-	unsigned char v, f;
-	unsigned char vstart, vnext, vcur, searching;
-	unsigned char sdir, skipface;
-	r2d_real fcur, ftmp, fmin;
+	r2d_mesh_job* job = (r2d_mesh_job*) arg;
+	r2d_mesh_worker* w = &job->w;
+	r2d_int p, v, nverts, r;
+	r2d_real* pverts;
+	r2d_rvec2 poly[R2D_MAX_FACES];
+	r2d_dvec2 porig, pdims;
 
-	// start at the first unclipped vertex
-	vcur = 127;
-	for(v = 0; vcur >= 127 && v < *nverts; ++v) 
-		if(!(vertbuffer[v].fflags & CLIP_MASK)) vcur = v;
-	
-	// exit if no unclipped vertex exists
-	if(vcur >= 127) return;
+	if(!r2d_mesh_worker_init(w).good) return NULL;
 
-	// loop over faces
-	for(f = 0; f < nfaces; ++f) {
-		
-		// if the vertex is inside the clip plane,	
-		// traverse to a vertex lying outside of the clip plane
-		fcur = faces[f].d + dot(vertbuffer[vcur].pos, faces[f].n);
-		skipface = 0;
-		if(fcur > 0.0) {
-
-			fmin = fcur;
-			sdir = 127;
-
-			// search in the direction of steepest descent
-			ftmp = faces[f].d + dot(vertbuffer[vertbuffer[vcur].pnbrs[0]].pos, faces[f].n);
-			if(ftmp < fmin) {
-				sdir = 0;
-				fmin = ftmp;
-			}
-			ftmp = faces[f].d + dot(vertbuffer[vertbuffer[vcur].pnbrs[1]].pos, faces[f].n);
-			if(ftmp < fmin) {
-				sdir = 1;
-				fmin = ftmp;
-			}
-			
-			if(sdir >= 127) {
-				// skip the face, all verts lie inside
-				continue;
-			}
+	for(p = job->ibegin; p < job->iend; ++p) {
 
-			fcur = fmin;
-			vcur = vertbuffer[vcur].pnbrs[sdir];
-	
-			while(fcur > 0.0) {
-	
-				// check neighbor
-				fmin = faces[f].d + dot(vertbuffer[vertbuffer[vcur].pnbrs[sdir]].pos, faces[f].n);
-				if(fmin < fcur) {
-					fcur = fmin;
-					vcur = vertbuffer[vcur].pnbrs[sdir];
-				}
-				else {
-					// vcur is the closest to the face, but still not inside
-					// skip the face
-					skipface = 1;
-					break;
-				}
-			}
+		job->fluxes[p] = 0.0;
+		nverts = job->offsets[p+1] - job->offsets[p];
+		if(nverts < 3 || nverts > R2D_MAX_FACES) {
+			w->info.good = 0;
+			w->info.errmsg = "Polygons need 3 to 64 vertices";
+			continue;
+		}
+		pverts = &job->verts[2*job->offsets[p]];
+		for(v = 0; v < nverts; ++v) {
+			poly[v].x = pverts[2*v];
+			poly[v].y = pverts[2*v + 1];
 		}
-		// continue if no verts lie outside of the face
-		if(skipface) continue;
+		r = r2d_overlap_poly(&w->ctx, poly, nverts, job->img_dims, 0,
+				&w->patch, &w->plen, &porig, &pdims);
+		if(r < 0) {
+			w->info.good = 0;
+			w->info.errmsg = "Bad reallocation of patch buffer";
+			continue;
+		}
+		if(!r) continue;
+		r2d_mesh_info(&w->info, w->ctx.info);
+		r2d_patch_flux(job, porig, pdims, &job->fluxes[p]);
+	}
+	return NULL;
+}
 
-		// vcur is now guaranteed to lie outside of the clip plane
-		//
-		// TODO: what if all verts need to be clipped?? Check left == right?
+static void* r2d_skim_rows(void* arg) {
+
+	r2d_mesh_job* job = (r2d_mesh_job*) arg;
+	r2d_mesh_worker* w = &job->w;
+	r2d_dvec2 mesh_dims = job->mesh_dims;
+	r2d_int i, j, a, b, r;
+	r2d_real area, C, x, xmin, xmax;
+	r2d_rvec2 quad[4];
+	r2d_dvec2 porig, pdims;
+
+	if(!r2d_mesh_worker_init(w).good) return NULL;
+
+	// without an image of its own, a job gets a partial image
+	// spanning just the image rows its quads can touch
+	if(!job->img) {
+		xmin = 1.0e99;
+		xmax = -1.0e99;
+		for(i = job->ibegin; i <= job->iend; ++i)
+		for(j = 0; j <= mesh_dims.y; ++j) {
+			x = job->verts[mind(i, j)];
+			if(x < xmin) xmin = x;
+			if(x > xmax) xmax = x;
+		}
+		job->xoff = floor(xmin);
+		job->nx = floor(xmax) + 1;
+		if(job->xoff < 0) job->xoff = 0;
+		if(job->nx > job->img_dims.x) job->nx = job->img_dims.x;
+		job->nx -= job->xoff;
+		if(job->nx <= 0) return NULL;
+		job->img = (r2d_real*) calloc((r2d_long) job->nx*job->img_dims.y, sizeof(r2d_real));
+		if(!job->img) {
+			w->info.good = 0;
+			w->info.errmsg = "Bad allocation of partial image";
+			return NULL;
+		}
+	}
 
-		// traverse to the right
-		vstart = vcur;
-		searching = 1;
-		while(vcur != vstart && searching) { 
-			vnext = vertbuffer[vcur].pnbrs[1];
-			if(faces[f].d + dot(vertbuffer[vnext].pos, faces[f].n) > 0.0) {
-				// vnext is inside the face
+	for(i = job->ibegin; i < job->iend; ++i)
+	for(j = 0; j < mesh_dims.y; ++j) {
 
-				// compute the intersection point using a weighted
-				// average of perpendicular distances to the plane
-				wav(vertbuffer[vcur].pos, vertbuffer[vnext].fdist[f],
-					vertbuffer[vnext].pos, -vertbuffer[vcur].fdist[f],
-					vertbuffer[*nverts].pos);
-				
-				vertbuffer[*nverts].pnbrs[1] = vnext;
+		r2d_mesh_quad(job->verts, mesh_dims, i, j, quad);
 
-				// reciprocal connetivity
-				vertbuffer[vnext].pnbrs[0] = *nverts;
+		// unsigned area of the irregular pixel
+		area = 0.5*fabs((quad[0].x - quad[2].x)*(quad[3].y - quad[1].y)
+				- (quad[3].x - quad[1].x)*(quad[0].y - quad[2].y));
+		if(area <= 0.0) continue;
+		C = job->fluxes[mesh_dims.y*i + j]/area;
 
-				// add flags in case this vert is clipped later on
-				vertbuffer[*nverts].fflags = 0x00;
+		r = r2d_overlap_poly(&w->ctx, quad, 4, job->img_dims, 0, &w->patch, &w->plen, &porig, &pdims);
+		if(r < 0) {
+			w->info.good = 0;
+			w->info.errmsg = "Bad reallocation of patch buffer";
+			continue;
+		}
+		if(!r) continue;
+		r2d_mesh_info(&w->info, w->ctx.info);
 
-				++(*nverts);
-				searching = 0;
+		// scatter the quad's flux onto the regular pixels
+		for(a = 0; a < pdims.x; ++a)
+		for(b = 0; b < pdims.y; ++b)
+			job->img[job->img_dims.y*(porig.x - job->xoff + a) + (porig.y + b)] += C*w->patch[pind(a, b)];
+	}
+	return NULL;
+}
+
+// adds the partial images onto dest rows rbegin through rend,
+// always in job order so that the result does not depend on timing
+static void* r2d_skim_reduce(void* arg) {
+
+	r2d_mesh_job* job = (r2d_mesh_job*) arg;
+	r2d_mesh_job* jobs = (r2d_mesh_job*) job->jobs;
+	r2d_int t, x, y, xlo, xhi;
+	r2d_long ny = job->img_dims.y;
+
+	for(t = 0; t < job->njobs; ++t) {
+		if(!jobs[t].img) continue;
+		xlo = jobs[t].xoff;
+		xhi = jobs[t].xoff + jobs[t].nx;
+		if(xlo < job->rbegin) xlo = job->rbegin;
+		if(xhi > job->rend) xhi = job->rend;
+		for(x = xlo; x < xhi; ++x)
+		for(y = 0; y < ny; ++y)
+			job->img[ny*x + y] += jobs[t].img[ny*(x - jobs[t].xoff) + y];
+	}
+	return NULL;
+}
+
+// splits the mesh rows evenly among nthreads jobs
+static r2d_mesh_job* r2d_mesh_jobs(r2d_real* verts, r2d_dvec2 mesh_dims,
+		r2d_real* img, r2d_dvec2 img_dims, r2d_real* fluxes, r2d_int polyorder, r2d_int nthreads) {
+	r2d_int t;
+	r2d_mesh_job* jobs = (r2d_mesh_job*) calloc(nthreads, sizeof(r2d_mesh_job));
+	if(!jobs) return NULL;
+	for(t = 0; t < nthreads; ++t) {
+		jobs[t].verts = verts;
+		jobs[t].mesh_dims = mesh_dims;
+		jobs[t].img = img;
+		jobs[t].img_dims = img_dims;
+		jobs[t].fluxes = fluxes;
+		jobs[t].polyorder = polyorder;
+		jobs[t].nimg = 1;
+		jobs[t].ibegin = ((r2d_long) mesh_dims.x*t)/nthreads;
+		jobs[t].iend = ((r2d_long) mesh_dims.x*(t + 1))/nthreads;
+		jobs[t].rbegin = ((r2d_long) img_dims.x*t)/nthreads;
+		jobs[t].rend = ((r2d_long) img_dims.x*(t + 1))/nthreads;
+		jobs[t].njobs = nthreads;
+		jobs[t].jobs = (void*) jobs;
+	}
+	return jobs;
+}
+
+// collects the per-job stats, in job order
+static r2d_info r2d_mesh_collect(r2d_mesh_job* jobs, r2d_int njobs) {
+	r2d_int t;
+	r2d_info minfo;
+	memset(&minfo, 0, sizeof(r2d_info));
+	minfo.good = 1;
+	minfo.vox_min = 1.0e99;
+	minfo.vox_max = -1.0e99;
+	for(t = 0; t < njobs; ++t) {
+		r2d_mesh_info(&minfo, jobs[t].w.info);
+		r2d_mesh_worker_finalize(&jobs[t].w);
+	}
+	return minfo;
+}
+
+r2d_info r2d_deposit_mesh(r2d_real* verts, r2d_dvec2 mesh_dims,
+		r2d_real* source, r2d_dvec2 source_dims, r2d_real* fluxes, r2d_int nthreads) {
+	return r2d_deposit_mesh_poly(verts, mesh_dims, source, 0, source_dims, fluxes, nthreads);
+}
+
+r2d_info r2d_deposit_mesh_poly(r2d_real* verts, r2d_dvec2 mesh_dims, r2d_real* coeffs,
+		r2d_int polyorder, r2d_dvec2 source_dims, r2d_real* fluxes, r2d_int nthreads) {
+	return r2d_deposit_mesh_multi(verts, mesh_dims, coeffs, 1, polyorder, source_dims, fluxes, nthreads);
+}
+
+r2d_info r2d_deposit_mesh_multi(r2d_real* verts, r2d_dvec2 mesh_dims, r2d_real* coeffs, r2d_int nimg,
+		r2d_int polyorder, r2d_dvec2 source_dims, r2d_real* fluxes, r2d_int nthreads) {
+
+	r2d_info minfo;
+	r2d_mesh_job* jobs;
+	r2d_int t;
+
+	if(polyorder < 0 || polyorder > 2) {
+		memset(&minfo, 0, sizeof(r2d_info));
+		minfo.errmsg = "Polynomial order must be 0, 1, or 2";
+		return minfo;
+	}
+	if(nimg < 1) {
+		memset(&minfo, 0, sizeof(r2d_info));
+		minfo.errmsg = "Need at least one source image";
+		return minfo;
+	}
+
+	// quads only read the source, and each row of fluxes
+	// belongs to exactly one job, so there is nothing to protect
+	nthreads = r2d_mesh_nthreads(nthreads, mesh_dims.x);
+	jobs = r2d_mesh_jobs(verts, mesh_dims, coeffs, source_dims, fluxes, polyorder, nthreads);
+	if(!jobs) {
+		memset(&minfo, 0, sizeof(r2d_info));
+		minfo.errmsg = "Bad allocation of mesh jobs";
+		return minfo;
+	}
+	for(t = 0; t < nthreads; ++t) jobs[t].nimg = nimg;
+	r2d_mesh_run(r2d_deposit_rows, jobs, nthreads);
+	minfo = r2d_mesh_collect(jobs, nthreads);
+	free(jobs);
+	return minfo;
+}
+
+r2d_info r2d_deposit_polygons(r2d_real* verts, r2d_long* offsets, r2d_int npolys,
+		r2d_real* source, r2d_dvec2 source_dims, r2d_real* fluxes, r2d_int nthreads) {
+
+	r2d_info minfo;
+	r2d_mesh_job* jobs;
+	r2d_dvec2 list_dims;
+	r2d_int t;
+
+	// the polygons are split among the jobs as if each were a mesh row
+	list_dims.x = npolys;
+	list_dims.y = 1;
+	nthreads = r2d_mesh_nthreads(nthreads, npolys);
+	jobs = r2d_mesh_jobs(verts, list_dims, source, source_dims, fluxes, 0, nthreads);
+	if(!jobs) {
+		memset(&minfo, 0, sizeof(r2d_info));
+		minfo.errmsg = "Bad allocation of mesh jobs";
+		return minfo;
+	}
+	for(t = 0; t < nthreads; ++t) jobs[t].offsets = offsets;
+	r2d_mesh_run(r2d_deposit_polys, jobs, nthreads);
+	minfo = r2d_mesh_collect(jobs, nthreads);
+	free(jobs);
+	return minfo;
+}
+
+r2d_info r2d_deposit_mesh_grad(r2d_real* verts, r2d_dvec2 mesh_dims, r2d_real* source,
+		r2d_dvec2 source_dims, r2d_real* fluxes, r2d_real* grad, r2d_int nthreads) {
+
+	r2d_info minfo;
+	r2d_mesh_job* jobs;
+	r2d_int t;
+
+	// the gradient goes along with the forward pass, quad by quad
+	nthreads = r2d_mesh_nthreads(nthreads, mesh_dims.x);
+	jobs = r2d_mesh_jobs(verts, mesh_dims, source, source_dims, fluxes, 0, nthreads);
+	if(!jobs) {
+		memset(&minfo, 0, sizeof(r2d_info));
+		minfo.errmsg = "Bad allocation of mesh jobs";
+		return minfo;
+	}
+	for(t = 0; t < nthreads; ++t) jobs[t].grad = grad;
+	r2d_mesh_run(r2d_deposit_rows, jobs, nthreads);
+	minfo = r2d_mesh_collect(jobs, nthreads);
+	free(jobs);
+	return minfo;
+}
+
+r2d_info r2d_skim_mesh(r2d_real* verts, r2d_dvec2 mesh_dims,
+		r2d_real* fluxes, r2d_real* dest, r2d_dvec2 dest_dims, r2d_int nthreads) {
+
+	r2d_int t;
+	r2d_info minfo;
+	r2d_mesh_job* jobs;
+	r2d_mesh_job* reds;
+
+	// neighbouring quads scatter onto the same pixels, so with more than one
+	// thread each job skims into a partial image of its own. These are then
+	// summed onto dest in parallel, over disjoint blocks of dest rows.
+	nthreads = r2d_mesh_nthreads(nthreads, mesh_dims.x);
+	jobs = r2d_mesh_jobs(verts, mesh_dims, nthreads > 1 ? NULL : dest,
+			dest_dims, fluxes, 0, nthreads);
+	reds = r2d_mesh_jobs(verts, mesh_dims, dest, dest_dims, fluxes, 0, nthreads);
+	if(!jobs || !reds) {
+		if(jobs) free(jobs);
+		if(reds) free(reds);
+		memset(&minfo, 0, sizeof(r2d_info));
+		minfo.errmsg = "Bad allocation of mesh jobs";
+		return minfo;
+	}
+	r2d_mesh_run(r2d_skim_rows, jobs, nthreads);
+	if(nthreads > 1) {
+		for(t = 0; t < nthreads; ++t)
+			reds[t].jobs = (void*) jobs;
+		r2d_mesh_run(r2d_skim_reduce, reds, nthreads);
+		for(t = 0; t < nthreads; ++t)
+			if(jobs[t].img) free(jobs[t].img);
+	}
+	minfo = r2d_mesh_collect(jobs, nthreads);
+	free(jobs);
+	free(reds);
+	return minfo;
+}
+
+static void* r2d_overlap_rows(void* arg) {
+
+	r2d_mesh_job* job = (r2d_mesh_job*) arg;
+	r2d_mesh_worker* w = &job->w;
+	r2d_dvec2 mesh_dims = job->mesh_dims;
+	r2d_int i, j, a, b, r;
+	r2d_long need, q;
+	r2d_real ov;
+	r2d_rvec2 quad[4];
+	r2d_dvec2 porig, pdims;
+
+	if(!r2d_mesh_worker_init(w).good) return NULL;
+
+	for(i = job->ibegin; i < job->iend; ++i)
+	for(j = 0; j < mesh_dims.y; ++j) {
+
+		q = (r2d_long) mesh_dims.y*i + j;
+		job->indptr[q+1] = 0;
+		r2d_mesh_quad(job->verts, mesh_dims, i, j, quad);
+		r = r2d_overlap_poly(&w->ctx, quad, 4, job->img_dims, 0, &w->patch, &w->plen, &porig, &pdims);
+		if(r < 0) {
+			w->info.good = 0;
+			w->info.errmsg = "Bad reallocation of patch buffer";
+			continue;
+		}
+		if(!r) continue;
+		r2d_mesh_info(&w->info, w->ctx.info);
+
+		// make room for the whole patch
+		need = job->nnz + (r2d_long) pdims.x*pdims.y;
+		if(need > job->cap) {
+			r2d_long ncap = 2*need;
+			r2d_long* ncols = (r2d_long*) realloc((void*) job->cols, ncap*sizeof(r2d_long));
+			if(ncols) job->cols = ncols;
+			r2d_real* nvals = (r2d_real*) realloc((void*) job->vals, ncap*sizeof(r2d_real));
+			if(nvals) job->vals = nvals;
+			if(!ncols || !nvals) {
+				w->info.good = 0;
+				w->info.errmsg = "Bad reallocation of overlap buffer";
+				return NULL;
 			}
-			vertbuffer[vcur].fflags |= CLIP_MASK;
-			vcur = vnext;
+			job->cap = ncap;
 		}
-		if(vcur == vstart) {
-			// All verts are behind the clip plane!
-			for(v = 0; vcur >= 127 && v < *nverts; ++v) 
-				vertbuffer[v].fflags |= CLIP_MASK;
-			return;
+
+		// keep the nonzero overlaps, in column order
+		for(a = 0; a < pdims.x; ++a)
+		for(b = 0; b < pdims.y; ++b) {
+			ov = w->patch[pind(a, b)];
+			if(ov == 0.0) continue;
+			job->cols[job->nnz] = (r2d_long) job->img_dims.y*(porig.x + a) + (porig.y + b);
+			job->vals[job->nnz] = ov;
+			++job->nnz;
+			++job->indptr[q+1];
 		}
+	}
+	return NULL;
+}
 
-		// traverse to the left
-		vcur = vstart;
-		searching = 1;
-		while(searching) { 
-			vnext = vertbuffer[vcur].pnbrs[0];
-			if(faces[f].d + dot(vertbuffer[vnext].pos, faces[f].n) > 0.0) {
-				// vnext is inside the face
+r2d_info r2d_overlap_mesh(r2d_real* verts, r2d_dvec2 mesh_dims, r2d_dvec2 img_dims,
+		r2d_long* indptr, r2d_long* indices, r2d_real* data, r2d_long capacity, r2d_int nthreads) {
+
+	r2d_int t;
+	r2d_long q, nquads, nnz;
+	r2d_info minfo;
+	r2d_mesh_job* jobs;
+
+	// each job collects its own rows, which are then stitched together in
+	// row order, so the matrix does not depend on the number of threads
+	nthreads = r2d_mesh_nthreads(nthreads, mesh_dims.x);
+	jobs = r2d_mesh_jobs(verts, mesh_dims, NULL, img_dims, NULL, 0, nthreads);
+	if(!jobs) {
+		memset(&minfo, 0, sizeof(r2d_info));
+		minfo.errmsg = "Bad allocation of mesh jobs";
+		return minfo;
+	}
+	nquads = (r2d_long) mesh_dims.x*mesh_dims.y;
+	indptr[0] = 0;
+	for(q = 0; q < nquads; ++q)
+		indptr[q+1] = 0;
+	for(t = 0; t < nthreads; ++t)
+		jobs[t].indptr = indptr;
+	r2d_mesh_run(r2d_overlap_rows, jobs, nthreads);
+
+	// row pointers, and copy out if there is room
+	for(q = 0; q < nquads; ++q)
+		indptr[q+1] += indptr[q];
+	nnz = 0;
+	for(t = 0; t < nthreads; ++t) {
+		if(nnz + jobs[t].nnz <= capacity) {
+			memcpy((void*) &indices[nnz], (void*) jobs[t].cols, jobs[t].nnz*sizeof(r2d_long));
+			memcpy((void*) &data[nnz], (void*) jobs[t].vals, jobs[t].nnz*sizeof(r2d_real));
+		}
+		nnz += jobs[t].nnz;
+		if(jobs[t].cols) free(jobs[t].cols);
+		if(jobs[t].vals) free(jobs[t].vals);
+	}
 
-				// compute the intersection point using a weighted
-				// average of perpendicular distances to the plane
-				wav(vertbuffer[vcur].pos, vertbuffer[vnext].fdist[f],
-					vertbuffer[vnext].pos, -vertbuffer[vcur].fdist[f],
-					vertbuffer[*nverts].pos);
-				
-				vertbuffer[*nverts].pnbrs[0] = vnext;
+	minfo = r2d_mesh_collect(jobs, nthreads);
+	if(nnz > capacity) {
+		minfo.good = 0;
+		minfo.errmsg = "Not enough capacity for the overlap matrix, see indptr[nquads]";
+	}
+	free(jobs);
+	return minfo;
+}
 
-				// reciprocal connetivity
-				vertbuffer[vnext].pnbrs[1] = *nverts;
+// flat fitting, as in weak_sauce.fit_flat.FlatMover. The vertex (i, j) of
+// a row of vertices is at row[2*j], and a row of quads between the vertex
+// rows lo and hi has the signed areas below
+static inline r2d_real r2d_flat_area(const r2d_real* lo, const r2d_real* hi, r2d_int j) {
+	return ((lo[2*j] - hi[2*j+2])*(lo[2*j+3] - hi[2*j+1])
+			- (lo[2*j+2] - hi[2*j])*(lo[2*j+1] - hi[2*j+3]))*0.5;
+}
 
-				// do face intersections and flags
-				vertbuffer[*nverts].fflags = 0x00;
+// the derivatives of the fit's log-likelihood through each quad of a row,
+// with respect to the corners, reduce to four numbers per quad. These go in
+// coef[4*(j+1)] through coef[4*(j+1)+3] for quad j, leaving the zeros of
+// the missing quads j = -1 and j = ny
+static void r2d_flat_coefs(const r2d_real* lo, const r2d_real* hi, const r2d_real* target,
+		r2d_int ny, r2d_real lum, r2d_real* coef) {
+	r2d_int j;
+	r2d_real area, w;
+	for(j = 0; j < ny; ++j) {
+		area = r2d_flat_area(lo, hi, j);
+		w = (target[j] - lum*fabs(area))*(r2d_real)((area > 0) - (area < 0))*lum;
+		coef[4*j+4] = (lo[2*j+3] - hi[2*j+1])*0.5*w;
+		coef[4*j+5] = (lo[2*j+1] - hi[2*j+3])*0.5*w;
+		coef[4*j+6] = (lo[2*j+2] - hi[2*j])*0.5*w;
+		coef[4*j+7] = (lo[2*j] - hi[2*j+2])*0.5*w;
+	}
+}
 
-				++(*nverts);
-				searching = 0;
-			}
-			vertbuffer[vcur].fflags |= CLIP_MASK;
-			vcur = vnext;
-		}
-		vertbuffer[*nverts-2].pnbrs[0] = *nverts-1; 
-		vertbuffer[*nverts-1].pnbrs[1] = *nverts-2;
+// steps a row of vertices in place along the gradient gathered from the
+// rows of quads before (prev) and after (cur) it, each vertex adding up
+// its quads in the same order as FlatMover.derivatives, and adds the
+// squared relative changes in x and y to sums[1] and sums[2]
+static void r2d_flat_update(r2d_real* row, const r2d_real* prev, const r2d_real* cur,
+		r2d_int ny, r2d_real step, r2d_real* sums) {
+	r2d_int j;
+	r2d_real gx, gy, old, rel;
+	for(j = 0; j <= ny; ++j) {
+		gx = 0.0 + cur[4*j+4];
+		gx -= prev[4*j];
+		gx -= cur[4*j+1];
+		gx += prev[4*j+5];
+		gy = 0.0 - cur[4*j+6];
+		gy += prev[4*j+2];
+		gy += cur[4*j+3];
+		gy -= prev[4*j+7];
+		old = row[2*j];
+		row[2*j] += step*gx;
+		rel = (row[2*j] - old)/row[2*j];
+		sums[1] += rel*rel;
+		old = row[2*j+1];
+		row[2*j+1] += step*gy;
+		rel = (row[2*j+1] - old)/row[2*j+1];
+		sums[2] += rel*rel;
 	}
 }
-#endif
 
+// the new fluxes of a row of quads between the stepped vertex rows lo and hi,
+// adding the squared residuals to sums[0] and the squared relative changes
+// to sums[3]
+static void r2d_flat_fluxes(const r2d_real* lo, const r2d_real* hi, const r2d_real* target,
+		r2d_real* fluxes, r2d_int ny, r2d_real lum, r2d_real* sums) {
+	r2d_int j;
+	r2d_real old, res, rel;
+	for(j = 0; j < ny; ++j) {
+		old = fluxes[j];
+		fluxes[j] += lum*fabs(r2d_flat_area(lo, hi, j)) - old;
+		res = fluxes[j] - target[j];
+		sums[0] += res*res;
+		rel = (fluxes[j] - old)/fluxes[j];
+		sums[3] += rel*rel;
+	}
+}
+
+// copies the old vertex rows on either side of the job's rows, before any
+// job starts moving its own
+static void* r2d_flat_halo(void* arg) {
+	r2d_mesh_job* job = (r2d_mesh_job*) arg;
+	r2d_long nv = 2*(job->mesh_dims.y + 1);
+	if(job->ibegin > 0)
+		memcpy(job->halo, job->verts + nv*(job->ibegin - 1), nv*sizeof(r2d_real));
+	if(job->iend <= job->mesh_dims.x)
+		memcpy(job->halo + nv, job->verts + nv*job->iend, nv*sizeof(r2d_real));
+	return NULL;
+}
+
+// one sweep down the job's vertex rows, keeping the gradient coefficients
+// of the two rows of quads around the current vertex row. Each row of
+// vertices is stepped once both of its rows of quads are known, and each
+// row of quads gets its new flux once both of its vertex rows have moved,
+// except for the one above the job's first row, which needs the previous
+// job's last row
+static void* r2d_flat_rows(void* arg) {
+	r2d_mesh_job* job = (r2d_mesh_job*) arg;
+	r2d_int i, nx = job->mesh_dims.x, ny = job->mesh_dims.y;
+	r2d_long nv = 2*(ny + 1), nc = 4*(ny + 2);
+	r2d_real* prev = job->halo + 2*nv;
+	r2d_real* cur = prev + nc;
+	r2d_real* tmp;
+	r2d_real* row;
+	memset(prev, 0, 2*nc*sizeof(r2d_real));
+	if(job->ibegin > 0)
+		r2d_flat_coefs(job->halo, job->verts + nv*job->ibegin,
+				job->target + (r2d_long) ny*(job->ibegin - 1), ny, fabs(job->lum), prev);
+	for(i = job->ibegin; i < job->iend; ++i) {
+		row = job->verts + nv*i;
+		if(i < nx)
+			r2d_flat_coefs(row, i + 1 < job->iend ? row + nv : job->halo + nv,
+					job->target + (r2d_long) ny*i, ny, fabs(job->lum), cur);
+		else
+			memset(cur, 0, nc*sizeof(r2d_real));
+		r2d_flat_update(row, prev, cur, ny, job->step, job->sums);
+		if(i > job->ibegin)
+			r2d_flat_fluxes(row - nv, row, job->target + (r2d_long) ny*(i - 1),
+					job->fluxes + (r2d_long) ny*(i - 1), ny, job->lum, job->sums);
+		tmp = prev;
+		prev = cur;
+		cur = tmp;
+	}
+	return NULL;
+}
+
+r2d_info r2d_flat_step(r2d_real* verts, r2d_dvec2 mesh_dims, r2d_real* target,
+		r2d_real* fluxes, r2d_real luminosity, r2d_real step, r2d_real* sums, r2d_int nthreads) {
+
+	r2d_int t, k;
+	r2d_long nv = 2*(mesh_dims.y + 1), nc = 4*(mesh_dims.y + 2);
+	r2d_dvec2 vert_dims;
+	r2d_info minfo;
+	r2d_mesh_job* jobs;
+
+	// the jobs split the rows of vertices, which they move in place. With
+	// more than one, each first saves the rows just outside its own, which
+	// its neighbours move, and the rows of quads between two jobs are left
+	// for the end
+	memset(&minfo, 0, sizeof(r2d_info));
+	vert_dims.x = mesh_dims.x + 1;
+	vert_dims.y = mesh_dims.y;
+	nthreads = r2d_mesh_nthreads(nthreads, vert_dims.x);
+	jobs = r2d_mesh_jobs(verts, vert_dims, NULL, vert_dims, fluxes, 0, nthreads);
+	if(!jobs) {
+		minfo.errmsg = "Bad allocation of mesh jobs";
+		return minfo;
+	}
+	minfo.good = 1;
+	for(t = 0; t < nthreads; ++t) {
+		jobs[t].mesh_dims = mesh_dims;
+		jobs[t].target = target;
+		jobs[t].lum = luminosity;
+		jobs[t].step = step;
+		jobs[t].halo = (r2d_real*) malloc((2*nv + 2*nc)*sizeof(r2d_real));
+		if(!jobs[t].halo) {
+			minfo.good = 0;
+			minfo.errmsg = "Bad allocation of flat fit buffers";
+		}
+	}
+	if(minfo.good) {
+		if(nthreads > 1)
+			r2d_mesh_run(r2d_flat_halo, jobs, nthreads);
+		r2d_mesh_run(r2d_flat_rows, jobs, nthreads);
+		for(k = 0; k < 4; ++k)
+			sums[k] = 0.0;
+		for(t = 0; t < nthreads; ++t) {
+			if(t > 0)
+				r2d_flat_fluxes(verts + nv*(jobs[t].ibegin - 1), verts + nv*jobs[t].ibegin,
+						target + (r2d_long) mesh_dims.y*(jobs[t].ibegin - 1),
+						fluxes + (r2d_long) mesh_dims.y*(jobs[t].ibegin - 1),
+						mesh_dims.y, luminosity, jobs[t].sums);
+			for(k = 0; k < 4; ++k)
+				sums[k] += jobs[t].sums[k];
+		}
+	}
+	for(t = 0; t < nthreads; ++t)
+		if(jobs[t].halo) free(jobs[t].halo);
+	free(jobs);
+	return minfo;
+}
 
+#undef mind
+#undef pind
@@ -78,6 +78,22 @@ typedef struct {
 	unsigned char fflags;
 } r2d_vertex;
 
+/*
+ * Polygons rasterized by r2d_rasterize_n may have up to R2D_MAX_FACES
+ * faces, one bit each in the 64-bit face flags of r2d_vertex64. Since
+ * all of those bits may be taken, clipped vertices are marked apart.
+ */
+typedef uint64_t r2d_ulong;
+#define R2D_MAX_FACES 64
+
+typedef struct {
+	r2d_rvec2 pos;
+	r2d_int pnbrs[2];
+	r2d_real fdist[R2D_MAX_FACES];
+	r2d_ulong fflags;
+	unsigned char clipped;
+} r2d_vertex64;
+
 /*
  * return type for voxelization functions
  * can be easily modified for debugging purposes
@@ -89,8 +105,77 @@ typedef struct {
 	r2d_real vtot;
 	r2d_real vox_min;
 	r2d_real vox_max;
+	// number of quads rasterized as axis-aligned rectangles, by
+	// integrating along their edges, and by clipping cells
+	r2d_long nrect;
+	r2d_long nedge;
+	r2d_long nclip;
+	// number of cells found fully inside, straddling the boundary
+	// (and so clipped), and outside of the clipped quads
+	r2d_long num_in;
+	r2d_long num_clip;
+	r2d_long num_out;
+	// number of clipped quads whose cells were searched with the
+	// quadtree, and by scanning their whole index box
+	r2d_long ntree;
+	r2d_long nflat;
 } r2d_info;
 
+/*
+ * Per-gridpoint signed distances to the faces of the current primitive
+ */
+typedef struct {
+	r2d_real fdist[4];
+	unsigned char fflags;
+} r2d_gridpoint;
+
+/*
+ * Number of moments needed for a given polynomial order. Moments are
+ * ordered 1, x, y, x*x, y*y, x*y, as in r3d.
+ */
+static const r2d_int r2d_num_moments[3] = {1, 3, 6};
+
+/*
+ * Bit flags selecting the rasterization algorithm, mostly for timing and
+ * precision checks. R2D_TREE searches each quad's cells with a quadtree
+ * instead of checking them all, and the others turn off cell shifting,
+ * clipping, the moment computation, and the closed-form paths for simple
+ * quads. Building with -DUSE_TREE, -DNO_SHIFTING, etc. sets the default.
+ */
+#define R2D_TREE 0x01
+#define R2D_NO_SHIFTING 0x02
+#define R2D_NO_CLIPPING 0x04
+#define R2D_NO_REDUCTION 0x08
+#define R2D_NO_ANALYTIC 0x10
+
+/*
+ * Without R2D_TREE, a quad is still searched with the quadtree if its
+ * index box holds at least this many cells, where the tree starts to win
+ * over a flat scan. Changed at runtime with r2d_set_tree_threshold.
+ */
+#define R2D_TREE_THRESHOLD 4096
+
+/*
+ * Voxelization state: destination moment grids, gridpoint buffer and the
+ * info accumulated while rasterizing. One context per thread.
+ * The gridpoint buffer is stored as structure-of-arrays (one array of
+ * distances per face, plus the face flags) and is filled by the
+ * orientation kernel picked for this CPU when the context is initialized.
+ */
+typedef struct {
+	r2d_real* moments[6];
+	r2d_int polyorder;
+	r2d_dvec2 dest_dims;
+	r2d_rvec2 d;
+	r2d_real* gbdist[4];
+	unsigned char* gbflags;
+	r2d_long gblen;
+	void* orient;
+	r2d_int mode;
+	r2d_long tree_threshold;
+	r2d_info info;
+} r2d_context;
+
 /*
  * r2d
  *
@@ -103,6 +188,127 @@ r2d_info r2d_set_dest_grid(r2d_real *dest, r2d_dvec2 dest_dims, r2d_rvec2 dest_w
 void r2d_finalize();
 r2d_info r2d_rasterize_quad(r2d_real C, r2d_plane faces[4], r2d_dvec2 ibounds[2]);
 
+/*
+ * Reentrant versions of the above. The global API is a thin shim
+ * over a single static context.
+ *
+ * r2d_set_default_mode sets the mode (see R2D_TREE) of contexts initialized
+ * after it, including those used internally by the mesh functions. It is
+ * not meant to be changed while other threads are rasterizing.
+ * r2d_set_tree_threshold does the same for the number of cells in a quad's
+ * index box above which it is searched with the tree (0 for never).
+ *
+ * r2d_ctx_set_dest_moments also voxelizes the first and second moments
+ * (x, y, x*x, y*y, x*y, in grid window coordinates) into the grids
+ * dest[1] through dest[r2d_num_moments[polyorder]-1].
+ */
+
+r2d_info r2d_ctx_init(r2d_context* ctx, r2d_int bufsz);
+r2d_info r2d_ctx_set_dest_grid(r2d_context* ctx, r2d_real *dest, r2d_dvec2 dest_dims, r2d_rvec2 dest_window);
+r2d_info r2d_ctx_set_dest_moments(r2d_context* ctx, r2d_real **dest, r2d_int polyorder, r2d_dvec2 dest_dims, r2d_rvec2 dest_window);
+void r2d_ctx_finalize(r2d_context* ctx);
+void r2d_set_default_mode(r2d_int mode);
+r2d_int r2d_get_default_mode();
+void r2d_set_tree_threshold(r2d_long ncells);
+r2d_long r2d_get_tree_threshold();
+r2d_info r2d_ctx_rasterize_quad(r2d_context* ctx, r2d_real C, r2d_plane faces[4], r2d_dvec2 ibounds[2]);
+
+/*
+ * Rasterization of a convex polygon with nfaces (up to R2D_MAX_FACES)
+ * faces, as from r2du_faces_from_verts, in the same way as a quad. There
+ * is no closed-form path, so every polygon is clipped, but a block of
+ * merged pixels or an object footprint goes through in one call.
+ * Modifies the input faces, like r2d_rasterize_quad.
+ */
+
+r2d_info r2d_rasterize_n(r2d_real C, r2d_plane* faces, r2d_int nfaces, r2d_dvec2 ibounds[2]);
+r2d_info r2d_ctx_rasterize_n(r2d_context* ctx, r2d_real C, r2d_plane* faces, r2d_int nfaces, r2d_dvec2 ibounds[2]);
+
+/*
+ * One-shot rasterization of a quad, given by its four corners verts
+ * (x0, y0, ..., x3, y3, counterclockwise), onto the whole of dest. It
+ * sets up and tears down its own context, so it is reentrant as well.
+ */
+
+r2d_info r2d_rasterize_quad_verts(r2d_real C, r2d_real* verts, r2d_real* dest,
+		r2d_dvec2 dest_dims, r2d_rvec2 dest_window);
+
+/*
+ * r2d mesh
+ *
+ * Whole-mesh deposit and skim in a single call. verts is a row-major
+ * (mesh_dims.x+1) x (mesh_dims.y+1) x 2 array of vertex positions in units
+ * of pixels of the regular image, so that quad (i, j) has corners
+ * (i, j), (i+1, j), (i+1, j+1), (i, j+1). Images are row-major as well.
+ *
+ * - r2d_deposit_mesh fills fluxes (mesh_dims.x x mesh_dims.y) with the
+ *   integral of the piecewise-constant source image over each quad.
+ * - r2d_skim_mesh adds each quad's flux, spread uniformly over its area,
+ *   onto the regular dest image (existing dest values are kept).
+ *
+ * - r2d_deposit_mesh_poly does the same for a source that is a polynomial
+ *   of order polyorder within each pixel. coeffs is a row-major
+ *   source_dims.x x source_dims.y x r2d_num_moments[polyorder] array of
+ *   coefficients of 1, x, y, x*x, y*y, x*y, with x and y measured in
+ *   pixels from the pixel center. The integral is exact.
+ *
+ * - r2d_deposit_mesh_multi deposits a stack of nimg sources through one
+ *   traversal of the mesh, so each quad is clipped only once. The sources
+ *   are interleaved: coeffs is source_dims.x x source_dims.y x nimg x
+ *   r2d_num_moments[polyorder], and fluxes is mesh_dims.x x mesh_dims.y x nimg.
+ *
+ * - r2d_deposit_mesh_grad does what r2d_deposit_mesh does, and also fills
+ *   grad (mesh_dims.x x mesh_dims.y x 4 x 2) with the derivatives of each
+ *   flux with respect to the x and y of the quad's four corners, in the
+ *   order above. These are exact wherever the flux is differentiable; an
+ *   edge lying along a pixel boundary gets the average of both sides.
+ *
+ * - r2d_overlap_mesh stores the overlaps themselves as a sparse matrix in
+ *   CSR form, with one row per quad (row-major in the mesh) and one column
+ *   per pixel of the regular image. indptr has mesh_dims.x*mesh_dims.y+1
+ *   entries, while indices and data hold up to capacity nonzeros. If more
+ *   are needed, good is 0 and indptr[mesh_dims.x*mesh_dims.y] says how many.
+ *
+ * - r2d_deposit_polygons fills fluxes (npolys) with the integral of the
+ *   source image over each of a list of convex polygons. Polygon p has
+ *   the CCW vertices offsets[p] through offsets[p+1]-1 of verts (x0, y0,
+ *   x1, y1, ...), between 3 and R2D_MAX_FACES of them, with no repeats.
+ *   Its threads split the list of polygons instead of mesh rows.
+ *
+ * Pixels outside of the regular image contribute nothing. The mesh rows
+ * are split among nthreads threads (all online cores if nthreads <= 0).
+ * Results do not depend on thread timing, but skim sums may differ in the
+ * last bits between different thread counts.
+ *
+ * - r2d_flat_step takes one gradient step of a flat fit (FlatMover in
+ *   weak_sauce.fit_flat), whose model fluxes are luminosity times the
+ *   areas of the quads. It moves verts by step times the gradient of
+ *   -0.5*sum((target - |luminosity|*|area|)^2), then sets fluxes to the
+ *   new model, in one sweep down the mesh, and fills sums with the sum of
+ *   the squared residuals fluxes - target, of the squared relative changes
+ *   (new - old)/new of the vertex x and y, and of the squared relative
+ *   changes of the fluxes. The vertices and fluxes are the same as from
+ *   FlatMover, while the sums depend on the number of threads in the
+ *   last bits.
+ */
+
+r2d_info r2d_deposit_mesh(r2d_real* verts, r2d_dvec2 mesh_dims,
+		r2d_real* source, r2d_dvec2 source_dims, r2d_real* fluxes, r2d_int nthreads);
+r2d_info r2d_deposit_mesh_poly(r2d_real* verts, r2d_dvec2 mesh_dims, r2d_real* coeffs,
+		r2d_int polyorder, r2d_dvec2 source_dims, r2d_real* fluxes, r2d_int nthreads);
+r2d_info r2d_deposit_mesh_multi(r2d_real* verts, r2d_dvec2 mesh_dims, r2d_real* coeffs, r2d_int nimg,
+		r2d_int polyorder, r2d_dvec2 source_dims, r2d_real* fluxes, r2d_int nthreads);
+r2d_info r2d_deposit_mesh_grad(r2d_real* verts, r2d_dvec2 mesh_dims, r2d_real* source,
+		r2d_dvec2 source_dims, r2d_real* fluxes, r2d_real* grad, r2d_int nthreads);
+r2d_info r2d_skim_mesh(r2d_real* verts, r2d_dvec2 mesh_dims,
+		r2d_real* fluxes, r2d_real* dest, r2d_dvec2 dest_dims, r2d_int nthreads);
+r2d_info r2d_overlap_mesh(r2d_real* verts, r2d_dvec2 mesh_dims, r2d_dvec2 img_dims,
+		r2d_long* indptr, r2d_long* indices, r2d_real* data, r2d_long capacity, r2d_int nthreads);
+r2d_info r2d_deposit_polygons(r2d_real* verts, r2d_long* offsets, r2d_int npolys,
+		r2d_real* source, r2d_dvec2 source_dims, r2d_real* fluxes, r2d_int nthreads);
+r2d_info r2d_flat_step(r2d_real* verts, r2d_dvec2 mesh_dims, r2d_real* target,
+		r2d_real* fluxes, r2d_real luminosity, r2d_real step, r2d_real* sums, r2d_int nthreads);
+
 /*
  * r2du
  *
@@ -112,28 +318,20 @@ r2d_info r2d_rasterize_quad(r2d_real C, r2d_plane faces[4], r2d_dvec2 ibounds[2]
 
 void r2du_clip_quad(r2d_vertex* vertbuffer, r2d_int* nverts, unsigned char andcmp);
 void r2du_reduce(r2d_vertex* vertbuffer, r2d_int* nverts, r2d_real C, r2d_long flatind);
+void r2du_ctx_reduce(r2d_context* ctx, r2d_vertex* vertbuffer, r2d_int* nverts, r2d_real C, r2d_long flatind, r2d_rvec2 origin);
+void r2du_clip_n(r2d_vertex64* vertbuffer, r2d_int* nverts, r2d_ulong andcmp, r2d_int nfaces);
+void r2du_ctx_reduce_n(r2d_context* ctx, r2d_vertex64* vertbuffer, r2d_int* nverts, r2d_real C, r2d_long flatind, r2d_rvec2 origin);
 
 void r2du_init_box(r2d_vertex* vertbuffer, r2d_int* nverts, r2d_rvec2 rbounds[2]);
 void r2du_faces_from_verts(r2d_rvec2* verts, r2d_int nverts, r2d_plane* faces);
 void r2du_get_box_index_bounds(r2d_dvec2* ibounds,
 				r2d_real xmin, r2d_real ymin,
 				r2d_real xmax, r2d_real ymax);
+void r2du_ctx_get_box_index_bounds(r2d_context* ctx, r2d_dvec2* ibounds,
+				r2d_real xmin, r2d_real ymin,
+				r2d_real xmax, r2d_real ymax);
 
 
-// TO BE IMPLEMENTED
-// typedef struct {
-// 	r2d_rvec2 pos;
-// 	r2d_int pnbrs[2];
-// 	r2d_real fdist[64];
-// 	r2d_ulong fflags;
-// } r2d_vertex64;
-//
-// typedef uint64_t r2d_ulong;
-//
-// r2d_info r2d_rasterize_tri(r2d_real C, r2d_plane faces[4], r2d_dvec2 ibounds[2]);
-// void r2du_clip_tri(r2d_vertex* vertbuffer, r2d_int* nverts, unsigned char andcmp);
-// void r2du_clip_n(r2d_vertex* vertbuffer, r2d_int* nverts, r2d_plane* faces, r2d_int nfaces);
-
 double
 TestWoot(double x);
 
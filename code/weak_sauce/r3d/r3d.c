@@ -12,6 +12,9 @@
  */
 
 #include "r3d.h"
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
 
 #define ONE_THIRD 0.333333333333333333333333333333333333333333333333333333
 #define ONE_SIXTH 0.16666666666666666666666666666666666666666666666666666667
@@ -39,194 +42,257 @@
 //////////////////////////////////////////////////////////////////
 
 
-#ifdef USE_TREE
 // tree node for recursive splitting
 typedef struct {
 	r3d_int imin, jmin, kmin;
 	r3d_int ioff, joff, koff;
-	r3d_gridpoint gridpt[8];
+	r3d_orientation gridpt[8];
 #ifdef PRINT_POVRAY_TREE
 	int lvl;
 #endif
 } r3d_treenode;
-#endif // USE_TREE 
 
-void r3d_voxelize_tet(r3d_plane faces[4], r3d_dest_grid grid) {
+// algorithm flags that are always on, from the compile-time options
+static const r3d_int r3d_forced_mode = 0
+#ifdef USE_TREE
+	| R3D_TREE
+#endif
+#ifdef NO_SHIFTING
+	| R3D_NO_SHIFTING
+#endif
+#ifdef NO_CLIPPING
+	| R3D_NO_CLIPPING
+#endif
+#ifdef NO_REDUCTION
+	| R3D_NO_REDUCTION
+#endif
+	;
+
+// moments of cell (i, j, k), which lies entirely inside the tet
+static void r3d_fill_cell(r3d_real* moments, r3d_dest_grid* grid, r3d_int i, r3d_int j, r3d_int k) {
+	r3d_real locvol = grid->d.x*grid->d.y*grid->d.z;
+	moments[0] = locvol; // 1
+	if(grid->polyorder >= 1) {
+		moments[1] = locvol*grid->d.x*(i + 0.5); // x
+		moments[2] = locvol*grid->d.y*(j + 0.5); // y
+		moments[3] = locvol*grid->d.z*(k + 0.5); // z
+	}
+	if(grid->polyorder >= 2) {
+		moments[4] = locvol*ONE_THIRD*grid->d.x*grid->d.x*(1 + 3*i + 3*i*i); // x*x
+		moments[5] = locvol*ONE_THIRD*grid->d.y*grid->d.y*(1 + 3*j + 3*j*j); // y*y
+		moments[6] = locvol*ONE_THIRD*grid->d.z*grid->d.z*(1 + 3*k + 3*k*k); // z*z
+		moments[7] = locvol*0.25*grid->d.x*grid->d.y*(1 + 2*i)*(1 + 2*j); // x*y
+		moments[8] = locvol*0.25*grid->d.y*grid->d.z*(1 + 2*j)*(1 + 2*k); // y*z
+		moments[9] = locvol*0.25*grid->d.x*grid->d.z*(1 + 2*i)*(1 + 2*k); // z*x
+	}
+}
 
-	r3d_real moments[10];
-	r3d_real locvol, gor;
-	r3d_real xmin, ymin, zmin;
+// flags the gridpoints of i-slab i for each tet face they lie inside,
+// and saves their distances from each face
+static void r3d_orient_slab(r3d_dest_grid* grid, r3d_plane faces[4], r3d_int i, r3d_orientation* slab) {
+	r3d_int j, k, f;
+	r3d_real gor;
 	r3d_rvec3 gpt;
-	r3d_int i, j, k, m, mmax;
-	unsigned char v, f;
-	unsigned char orcmp, andcmp;
+	r3d_orientation* gp;
+	gpt.x = i*grid->d.x;
+	for(j = 0; j <= grid->n.j; ++j)
+	for(k = 0; k <= grid->n.k; ++k) {
+		gpt.y = j*grid->d.y; gpt.z = k*grid->d.z;
+		gp = &slab[(grid->n.k+1)*j + k];
+		gp->fflags = 0x00;
+		for(f = 0; f < 4; ++f) {
+			gor = faces[f].d + dot(gpt, faces[f].n);
+			if(gor > 0.0) gp->fflags |= (1 << f);
+			gp->fdist[f] = gor;
+		}
+	}
+}
 
-// macros for grid access
-#define gind(ii, jj, kk) ((grid.n.j+1)*(grid.n.k+1)*(ii) + (grid.n.k+1)*(jj) + (kk))
-#define vind(ii, jj, kk) (grid.n.j*grid.n.k*(ii) + grid.n.k*(jj) + (kk))
+// moves the origin of a set of moments to -off,
+// so that x becomes x + off.x and so on
+static void r3d_shift_moments(r3d_real* moments, r3d_int polyorder, r3d_rvec3 off) {
+	if(polyorder >= 2) {
+		moments[4] += 2.0*off.x*moments[1] + off.x*off.x*moments[0];
+		moments[5] += 2.0*off.y*moments[2] + off.y*off.y*moments[0];
+		moments[6] += 2.0*off.z*moments[3] + off.z*off.z*moments[0];
+		moments[7] += off.x*moments[2] + off.y*moments[1] + off.x*off.y*moments[0];
+		moments[8] += off.y*moments[3] + off.z*moments[2] + off.y*off.z*moments[0];
+		moments[9] += off.x*moments[3] + off.z*moments[1] + off.x*off.z*moments[0];
+	}
+	if(polyorder >= 1) {
+		moments[1] += off.x*moments[0];
+		moments[2] += off.y*moments[0];
+		moments[3] += off.z*moments[0];
+	}
+}
 
-// tree/storage buffers, as needed
-#ifdef USE_TREE
-	r3d_treenode treestack[256];
-	r3d_int ntreestack;
-	r3d_treenode curnode;
-#else
-	r3d_long vv0;
-	r3d_long vv[8];
-#endif
+// clips cell (i, j, k), whose corners have orientations corners[8],
+// against the tet and finds the moments of what is left
+static void r3d_clip_cell(r3d_real* moments, r3d_dest_grid* grid, r3d_int mode,
+		r3d_int i, r3d_int j, r3d_int k, r3d_orientation* corners, unsigned char andcmp) {
 
-	// get the high moment index 
-	mmax = r3d_num_moments[grid.polyorder];
+	unsigned char v;
+	r3d_int nverts;
+	r3d_vertex vertbuffer[128];
+	r3d_rvec3 off;
 
 	// voxel bounds in shifted coordinates
 	r3d_rvec3 rbounds[2] = {
-		{-0.5*grid.d.x, -0.5*grid.d.y, -0.5*grid.d.z}, 
-		{0.5*grid.d.x, 0.5*grid.d.y, 0.5*grid.d.z} 
+		{-0.5*grid->d.x, -0.5*grid->d.y, -0.5*grid->d.z}, 
+		{0.5*grid->d.x, 0.5*grid->d.y, 0.5*grid->d.z} 
 	};
+	if(mode & R3D_NO_SHIFTING) {
+		// voxel bounds in absolute coordinates
+		rbounds[0].x = i*grid->d.x;
+		rbounds[0].y = j*grid->d.y;
+		rbounds[0].z = k*grid->d.z;
+		rbounds[1].x = (i+1)*grid->d.x;
+		rbounds[1].y = (j+1)*grid->d.y;
+		rbounds[1].z = (k+1)*grid->d.z;
+	}
 
-	// vertex buffer
-	r3d_int nverts;
-	r3d_vertex vertbuffer[128];
+#ifdef PRINT_CLIP_VOXELS
+	printf("%d %d %d %.20e ", i, j, k, sqrt(grid->d.x*grid->d.x+grid->d.y*grid->d.y+grid->d.z*grid->d.z)/sqrt(rbounds[1].x*rbounds[1].x + rbounds[1].y*rbounds[1].y + rbounds[1].z*rbounds[1].z));
+#endif
 
-#ifndef USE_TREE // !USE_TREE
-
-	// check all grid vertices in the patch against each tet face
-	for(i = 0; i <= grid.n.i; ++i)
-	for(j = 0; j <= grid.n.j; ++j)
-	for(k = 0; k <= grid.n.k; ++k) {
-		// flag the vertex for each face it lies inside
-		// also save its distance from each face
-		gpt.x = i*grid.d.x; gpt.y = j*grid.d.y; gpt.z = k*grid.d.z;
-		vv0 = gind(i, j, k);
-		grid.orient[vv0].fflags = 0x00;
-		for(f = 0; f < 4; ++f) {
-			gor = faces[f].d + dot(gpt, faces[f].n);
-			if(gor > 0.0) grid.orient[vv0].fflags |= (1 << f);
-			grid.orient[vv0].fdist[f] = gor;
-		}
-	}
+	// initialize the unit cube connectivity 
+	r3du_init_box(vertbuffer, &nverts, rbounds);
+	for(v = 0; v < nverts; ++v)
+		vertbuffer[v].orient = corners[v];
 
-	// iterate over all voxels in the patch
-	for(i = 0; i < grid.n.i; ++i)
-	for(j = 0; j < grid.n.j; ++j)
-	for(k = 0; k < grid.n.k; ++k) {
-
-		// precompute flattened grid indices
-		vv[0] = gind(i, j, k);
-		vv[1] = gind(i+1, j, k);
-		vv[2] = gind(i+1, j+1, k);
-		vv[3] = gind(i, j+1, k);
-		vv[4] = gind(i, j, k+1);
-		vv[5] = gind(i+1, j, k+1);
-		vv[6] = gind(i+1, j+1, k+1);
-		vv[7] = gind(i, j+1, k+1);
-	
-		// check inclusion of each voxel within the tet
-		orcmp = 0x00;
-        andcmp = 0x0f;
-		for(v = 0; v < 8; ++v) {
-			orcmp |= grid.orient[vv[v]].fflags; 
-			andcmp &= grid.orient[vv[v]].fflags; 
-		}
+	// Clipping
+	if(!(mode & R3D_NO_CLIPPING))
+		r3d_clip_tet(vertbuffer, &nverts, andcmp);
 
-		if(andcmp == 0x0f) {
+	// Reduce
+	r3d_reduce(vertbuffer, &nverts, &moments[0], grid->polyorder);
+	if(mode & R3D_NO_SHIFTING) return;
+
+	// the cross-terms arising from using an offset box
+	// must be taken into account in the absolute moment integrals
+	off.x = (i + 0.5)*grid->d.x;
+	off.y = (j + 0.5)*grid->d.y;
+	off.z = (k + 0.5)*grid->d.z;
+	r3d_shift_moments(moments, grid->polyorder, off);
 
-			// the voxel is entirely inside the tet
+#ifdef PRINT_CLIP_VOXELS
+	printf("%.20e\n", (float) moments[0]);
+#endif
+}
 
-#ifndef NO_REDUCTION
+r3d_info r3d_voxelize_tet(r3d_plane faces[4], r3d_dest_grid grid) {
 
-			// calculate moments
-			locvol = grid.d.x*grid.d.y*grid.d.z;
-			moments[0] = locvol; // 1
-			if(grid.polyorder >= 1) {
-				moments[1] = locvol*grid.d.x*(i + 0.5); // x
-				moments[2] = locvol*grid.d.y*(j + 0.5); // y
-				moments[3] = locvol*grid.d.z*(k + 0.5); // z
-			}
-			if(grid.polyorder >= 2) {
-				moments[4] = locvol*ONE_THIRD*grid.d.x*grid.d.x*(1 + 3*i + 3*i*i); // x*x
-				moments[5] = locvol*ONE_THIRD*grid.d.y*grid.d.y*(1 + 3*j + 3*j*j); // y*y
-				moments[6] = locvol*ONE_THIRD*grid.d.z*grid.d.z*(1 + 3*k + 3*k*k); // z*z
-				moments[7] = locvol*0.25*grid.d.x*grid.d.y*(1 + 2*i)*(1 + 2*j); // x*y
-				moments[8] = locvol*0.25*grid.d.y*grid.d.z*(1 + 2*j)*(1 + 2*k); // y*z
-				moments[9] = locvol*0.25*grid.d.x*grid.d.z*(1 + 2*i)*(1 + 2*k); // z*x
-			}
+	r3d_real moments[10];
+	r3d_real gor;
+	r3d_rvec3 gpt;
+	r3d_int i, j, k, m, mmax, mode;
+	unsigned char v, f;
+	unsigned char orcmp, andcmp;
+	r3d_info info;
+	r3d_orientation corners[8];
 
-			//reduce to main grid
-			for(m = 0; m < mmax; ++m) 
-				grid.moments[m][vind(i, j, k)] = moments[m]; 
+// macros for grid access. With R3D_STREAM only two i-slabs
+// of gridpoint orientations are kept, alternating
+#define gind(ii, jj, kk) (slabsz*((mode & R3D_STREAM) ? ((ii) & 1) : (ii)) + (grid.n.k+1)*(jj) + (kk))
+#define vind(ii, jj, kk) (grid.n.j*grid.n.k*(ii) + grid.n.k*(jj) + (kk))
 
-#endif // NO_REDUCTION
+// stores the moments of a cell and keeps track of its volume
+#define r3d_store_cell(ii, jj, kk) {							\
+	for(m = 0; m < mmax; ++m) 									\
+		grid.moments[m][vind(ii, jj, kk)] = moments[m];		\
+	info.vtot += moments[0];									\
+	if(moments[0] < info.vox_min) info.vox_min = moments[0];	\
+	if(moments[0] > info.vox_max) info.vox_max = moments[0];	\
+}
 
-			continue;
-		}	
-		else if(orcmp == 0x0f) {
+	// tree/storage buffers, as needed
+	r3d_treenode treestack[256];
+	r3d_int ntreestack;
+	r3d_treenode curnode;
+	r3d_long slabsz, tree_threshold;
+	r3d_long vv[8];
 
-			// the voxel crosses the boundary of the tet
-			// need to process further
+	// get the high moment index 
+	mmax = r3d_num_moments[grid.polyorder];
+	mode = grid.mode | r3d_forced_mode;
 
-#ifdef NO_SHIFTING
-			// voxel bounds in absolute coordinates
-			rbounds[2] = {
-				{i*grid.d.x, j*grid.d.y, k*grid.d.z}, 
-				{(i+1)*grid.d.x, (j+1)*grid.d.y, (k+1)*grid.d.z} 
-			};
-#endif // NO_SHIFTING
-
-			// initialize the unit cube connectivity 
-			r3du_init_box(vertbuffer, &nverts, rbounds);
-			for(v = 0; v < nverts; ++v)
-				vertbuffer[v].orient = grid.orient[vv[v]];
-
-			// Clipping
-#ifndef NO_CLIPPING
-			r3d_clip_tet(vertbuffer, &nverts, andcmp);
-#endif // NO_CLIPPING
-
-			// Reduce
-#ifndef NO_REDUCTION
-			r3d_reduce(vertbuffer, &nverts, &moments[0], grid.polyorder);
-
-			// the cross-terms arising from using an offset box
-			// must be taken into account in the absolute moment integrals
-			if(grid.polyorder >= 1) {
-				xmin = (i + 0.5)*grid.d.x;
-				ymin = (j + 0.5)*grid.d.y;
-				zmin = (k + 0.5)*grid.d.z;
-			}
-			if(grid.polyorder >= 2) {
-				moments[4] += 2.0*xmin*moments[1] + xmin*xmin*moments[0];
-				moments[5] += 2.0*ymin*moments[2] + ymin*ymin*moments[0];
-				moments[6] += 2.0*zmin*moments[3] + zmin*zmin*moments[0];
-				moments[7] += xmin*moments[2] + ymin*moments[1] + xmin*ymin*moments[0];
-				moments[8] += ymin*moments[3] + zmin*moments[2] + ymin*zmin*moments[0];
-				moments[9] += xmin*moments[3] + zmin*moments[1] + xmin*zmin*moments[0];
-			}
-			if(grid.polyorder >= 1) {
-				moments[1] += xmin*moments[0];
-				moments[2] += ymin*moments[0];
-				moments[3] += zmin*moments[0];
-			}
+	// the tree only pays off for large patches
+	tree_threshold = grid.tree_threshold ? grid.tree_threshold : R3D_TREE_THRESHOLD;
+	if(tree_threshold > 0 && (r3d_long) grid.n.i*grid.n.j*grid.n.k >= tree_threshold)
+		mode |= R3D_TREE;
 
-			// reduce to main grid
-			for(m = 0; m < mmax; ++m) 
-				grid.moments[m][vind(i, j, k)] = moments[m];
+	memset(&info, 0, sizeof(r3d_info));
+	info.good = 1;
+	info.vox_min = 1.0e99;
+	info.vox_max = -1.0e99;
+	if(mode & R3D_TREE) info.ntree = 1;
+	else info.nflat = 1;
 
-#endif // NO_REDUCTION
+	if(!(mode & R3D_TREE)) {
 
-			continue;	
+		if(!grid.orient) {
+			info.good = 0;
+			return info;
 		}
-		else {
-			// voxel is entirely outside of the tet
-			// zero the moments 
-			for(m = 0; m < mmax; ++m) 
-				grid.moments[m][vind(i, j, k)] = 0.0;
-			continue;
+
+		// check the grid vertices in the patch against each tet face,
+		// one i-slab at a time, just before the voxels that need them
+		slabsz = (r3d_long)(grid.n.j+1)*(grid.n.k+1);
+		r3d_orient_slab(&grid, faces, 0, &grid.orient[gind(0, 0, 0)]);
+
+		// iterate over all voxels in the patch
+		for(i = 0; i < grid.n.i; ++i) {
+			r3d_orient_slab(&grid, faces, i+1, &grid.orient[gind(i+1, 0, 0)]);
+			for(j = 0; j < grid.n.j; ++j)
+			for(k = 0; k < grid.n.k; ++k) {
+
+				// precompute flattened grid indices
+				vv[0] = gind(i, j, k);
+				vv[1] = gind(i+1, j, k);
+				vv[2] = gind(i+1, j+1, k);
+				vv[3] = gind(i, j+1, k);
+				vv[4] = gind(i, j, k+1);
+				vv[5] = gind(i+1, j, k+1);
+				vv[6] = gind(i+1, j+1, k+1);
+				vv[7] = gind(i, j+1, k+1);
+			
+				// check inclusion of each voxel within the tet
+				orcmp = 0x00;
+				andcmp = 0x0f;
+				for(v = 0; v < 8; ++v) {
+					orcmp |= grid.orient[vv[v]].fflags; 
+					andcmp &= grid.orient[vv[v]].fflags; 
+				}
+
+				if(andcmp == 0x0f) {
+					// the voxel is entirely inside the tet
+					++info.num_in;
+					if(mode & R3D_NO_REDUCTION) continue;
+					r3d_fill_cell(moments, &grid, i, j, k);
+					r3d_store_cell(i, j, k);
+				}	
+				else if(orcmp == 0x0f) {
+					// the voxel crosses the boundary of the tet
+					// need to process further
+					++info.num_clip;
+					if(mode & R3D_NO_REDUCTION) continue;
+					for(v = 0; v < 8; ++v)
+						corners[v] = grid.orient[vv[v]];
+					r3d_clip_cell(moments, &grid, mode, i, j, k, corners, andcmp);
+					r3d_store_cell(i, j, k);
+				}
+				else {
+					// voxel is entirely outside of the tet
+					// zero the moments 
+					++info.num_out;
+					for(m = 0; m < mmax; ++m) 
+						grid.moments[m][vind(i, j, k)] = 0.0;
+				}
+			}
 		}
+		return info;
 	}
 
-#else // USE_TREE
-	
 	// get the initial face orientations for each corner of the node
 	gpt.x = 0.0;
 	gpt.y = 0.0;
@@ -237,14 +303,14 @@ void r3d_voxelize_tet(r3d_plane faces[4], r3d_dest_grid grid) {
 		if(gor > 0.0) curnode.gridpt[0].fflags |= (1 << f);
 		curnode.gridpt[0].fdist[f] = gor;
 	}
-	gpt.x = nx*grid.d.x;
+	gpt.x = grid.n.i*grid.d.x;
 	curnode.gridpt[1].fflags = 0x00;
 	for(f = 0; f < 4; ++f) {
 		gor = faces[f].d + dot(gpt, faces[f].n);
 		if(gor > 0.0) curnode.gridpt[1].fflags |= (1 << f);
 		curnode.gridpt[1].fdist[f] = gor;
 	}
-	gpt.y = ny*grid.d.y;
+	gpt.y = grid.n.j*grid.d.y;
 	curnode.gridpt[2].fflags = 0x00;
 	for(f = 0; f < 4; ++f) {
 		gor = faces[f].d + dot(gpt, faces[f].n);
@@ -259,21 +325,21 @@ void r3d_voxelize_tet(r3d_plane faces[4], r3d_dest_grid grid) {
 		curnode.gridpt[3].fdist[f] = gor;
 	}
 	gpt.y = 0.0;
-	gpt.z = nz*grid.d.z;
+	gpt.z = grid.n.k*grid.d.z;
 	curnode.gridpt[4].fflags = 0x00;
 	for(f = 0; f < 4; ++f) {
 		gor = faces[f].d + dot(gpt, faces[f].n);
 		if(gor > 0.0) curnode.gridpt[4].fflags |= (1 << f);
 		curnode.gridpt[4].fdist[f] = gor;
 	}
-	gpt.x = nx*grid.d.x;
+	gpt.x = grid.n.i*grid.d.x;
 	curnode.gridpt[5].fflags = 0x00;
 	for(f = 0; f < 4; ++f) {
 		gor = faces[f].d + dot(gpt, faces[f].n);
 		if(gor > 0.0) curnode.gridpt[5].fflags |= (1 << f);
 		curnode.gridpt[5].fdist[f] = gor;
 	}
-	gpt.y = ny*grid.d.y;
+	gpt.y = grid.n.j*grid.d.y;
 	curnode.gridpt[6].fflags = 0x00;
 	for(f = 0; f < 4; ++f) {
 		gor = faces[f].d + dot(gpt, faces[f].n);
@@ -290,9 +356,9 @@ void r3d_voxelize_tet(r3d_plane faces[4], r3d_dest_grid grid) {
 	curnode.imin = 0;
 	curnode.jmin = 0;
 	curnode.kmin = 0;
-	curnode.ioff = nx;
-	curnode.joff = ny;
-	curnode.koff = nz;
+	curnode.ioff = grid.n.i;
+	curnode.joff = grid.n.j;
+	curnode.koff = grid.n.k;
 
 #ifdef PRINT_POVRAY_TREE
 #define TREELVL 18
@@ -309,7 +375,7 @@ void r3d_voxelize_tet(r3d_plane faces[4], r3d_dest_grid grid) {
 		curnode = treestack[--ntreestack];
 
 		orcmp = 0x00;
-        andcmp = 0x0f;
+		andcmp = 0x0f;
 		for(v = 0; v < 8; ++v) {
 			orcmp |= curnode.gridpt[v].fflags; 
 			andcmp &= curnode.gridpt[v].fflags; 
@@ -327,47 +393,14 @@ void r3d_voxelize_tet(r3d_plane faces[4], r3d_dest_grid grid) {
 			}
 #endif
 			// all cells in this leaf are fully contained
-#ifndef NO_REDUCTION
-
-			locvol = grid.d.x*grid.d.y*grid.d.z;
+			info.num_in += curnode.ioff*curnode.joff*curnode.koff;
+			if(mode & R3D_NO_REDUCTION) continue;
 			for(i = curnode.imin; i < curnode.imin + curnode.ioff; ++i)
 			for(j = curnode.jmin; j < curnode.jmin + curnode.joff; ++j)
 			for(k = curnode.kmin; k < curnode.kmin + curnode.koff; ++k) {
-				
-				// zero the moments
-				for(m = 0; m < 10; ++m)
-					moments[m] = 0.0;
-	
-				// constant field by default
-				moments[0] = locvol; // 1
-				if(polyorder >= 1) {
-					moments[1] = locvol*grid.d.x*(i+ibounds[0].x+0.5); // x
-					moments[2] = locvol*grid.d.y*(j+ibounds[0].y+0.5); // y
-					moments[3] = locvol*grid.d.z*(k+ibounds[0].z+0.5); // z
-				}
-				if(polyorder >= 2) {
-					moments[4] = locvol*ONE_THIRD*grid.d.x*grid.d.x*(1 + 3*i + 3*i*i + 3*ibounds[0].x + 6*i*ibounds[0].x + 3*ibounds[0].x*ibounds[0].x);
-					moments[5] = locvol*ONE_THIRD*grid.d.y*grid.d.y*(1 + 3*j + 3*j*j + 3*ibounds[0].y + 6*j*ibounds[0].y + 3*ibounds[0].y*ibounds[0].y);
-					moments[6] = locvol*ONE_THIRD*grid.d.z*grid.d.z*(1 + 3*k + 3*k*k + 3*ibounds[0].z + 6*k*ibounds[0].z + 3*ibounds[0].z*ibounds[0].z);
-					moments[7] = locvol*0.25*grid.d.x*grid.d.y*(1+2*(i+ibounds[0].x))*(1+2*(j+ibounds[0].y)); // x*y
-					moments[8] = locvol*0.25*grid.d.x*grid.d.z*(1+2*(i+ibounds[0].x))*(1+2*(k+ibounds[0].z)); // x*z
-					moments[9] = locvol*0.25*grid.d.y*grid.d.z*(1+2*(j+ibounds[0].y))*(1+2*(k+ibounds[0].z)); // y*z
-				}
-	
-				//reduce to main grid
-				for(m = 0; m < 10; ++m) {
-					r3d_dest_grid[vind(i, j, k)] += moments[m]*coeffs[m];
-					current_info.momtot[m] += moments[m];
-				}	
-				current_info.vtot += moments[0];
-				if(moments[0] < current_info.vox_min) current_info.vox_min = moments[0];
-				if(moments[0] > current_info.vox_max) current_info.vox_max = moments[0];
-			
+				r3d_fill_cell(moments, &grid, i, j, k);
+				r3d_store_cell(i, j, k);
 			}
-#endif // NO_REDUCTION
-
-			current_info.num_in += curnode.ioff*curnode.joff*curnode.koff;
-
 			continue;
 		}
 		if(orcmp != 0x0f) {
@@ -385,10 +418,14 @@ void r3d_voxelize_tet(r3d_plane faces[4], r3d_dest_grid grid) {
 			}
 #endif
 
-			current_info.num_out += curnode.ioff*curnode.joff*curnode.koff;
-			
 			// the leaf lies entirely outside the tet
-			// skip it
+			// zero its moments
+			info.num_out += curnode.ioff*curnode.joff*curnode.koff;
+			for(i = curnode.imin; i < curnode.imin + curnode.ioff; ++i)
+			for(j = curnode.jmin; j < curnode.jmin + curnode.joff; ++j)
+			for(k = curnode.kmin; k < curnode.kmin + curnode.koff; ++k)
+			for(m = 0; m < mmax; ++m) 
+				grid.moments[m][vind(i, j, k)] = 0.0;
 			continue;
 		}
 		if(curnode.ioff == 1 && curnode.joff == 1 && curnode.koff == 1) {
@@ -411,81 +448,282 @@ void r3d_voxelize_tet(r3d_plane faces[4], r3d_dest_grid grid) {
 			}
 #endif
 
-#ifdef NO_SHIFTING
-			// voxel bounds in shifted coordinates
-			rbounds[0].x = i*grid.d.x;
-			rbounds[0].y = j*grid.d.y;
-			rbounds[0].z = k*grid.d.z;
-			rbounds[1].x = (i+1)*grid.d.x;
-			rbounds[1].y = (j+1)*grid.d.y;
-			rbounds[1].z = (k+1)*grid.d.z;
-#endif // NO_SHIFTING
-
+			++info.num_clip;
+			if(mode & R3D_NO_REDUCTION) continue;
+			r3d_clip_cell(moments, &grid, mode, i, j, k, curnode.gridpt, andcmp);
+			r3d_store_cell(i, j, k);
+			continue;	
+		}
 
-#ifdef PRINT_CLIP_VOXELS
-	printf("%d %d %d %.20e ", i, j, k, sqrt(grid.d.x*grid.d.x+grid.d.y*grid.d.y+grid.d.z*grid.d.z)/sqrt(rbounds[1].x*rbounds[1].x + rbounds[1].y*rbounds[1].y + rbounds[1].z*rbounds[1].z));
-#endif
+#ifdef PRINT_POVRAY_TREE
+			if(curnode.lvl == TREELVL) {
 
+				printf("	box {\n");
+				printf("		<%f+sw,%f+sw,%f+sw>, <%f-sw,%f-sw,%f-sw>\n", grid.d.x*(curnode.imin), grid.d.y*(curnode.jmin), grid.d.z*(curnode.kmin), grid.d.x*(curnode.imin + curnode.ioff), grid.d.y*(curnode.jmin + curnode.joff), grid.d.z*(curnode.kmin + curnode.koff));
+				printf("		texture {\n");
+				printf("			pigment{ scolor }\n");
+				printf("		}\n");
+				printf("	}\n");
 
-			// initialize the unit cube connectivity 
-			r3du_init_box(vertbuffer, &nverts, rbounds);
-			for(v = 0; v < nverts; ++v) {
-				vertbuffer[v].fflags = curnode.gridpt[v].fflags;
-				for(f = 0; f < 4; ++f)
-					vertbuffer[v].fdist[f] = curnode.gridpt[v].fdist[f];
 			}
+#endif
 
-			// Clipping
-#ifndef NO_CLIPPING
-			r3du_clip_tet(vertbuffer, &nverts, andcmp);
-#endif // NO_CLIPPING
-
-			// Reduce
-#ifndef NO_REDUCTION
-			r3du_reduce(vertbuffer, &nverts, &moments[0], polyorder);
+			// else, split the node along its longest dimension
+			// and push to the the stack
+			i = curnode.ioff/2;
+			j = curnode.joff/2;
+			k = curnode.koff/2;
+			if(i >= j && i >= k) {
+#ifdef PRINT_POVRAY_TREE
+				treestack[ntreestack].lvl = curnode.lvl + 1;
+				treestack[ntreestack+1].lvl = curnode.lvl + 1;
+#endif
 
-			// the cross-terms arising from using an offset box
-			// must be taken into account in the absolute moment integrals
-			if(polyorder >= 1) {
-				xmin = (ibounds[0].x + i + 0.5)*grid.d.x;
-				ymin = (ibounds[0].y + j + 0.5)*grid.d.y;
-				zmin = (ibounds[0].z + k + 0.5)*grid.d.z;
-			}
-			if(polyorder >= 2) {
-				moments[4] += 2.0*xmin*moments[1] + xmin*xmin*moments[0];
-				moments[5] += 2.0*ymin*moments[2] + ymin*ymin*moments[0];
-				moments[6] += 2.0*zmin*moments[3] + zmin*zmin*moments[0];
-				moments[7] += xmin*moments[2] + ymin*moments[1] + xmin*ymin*moments[0];
-				moments[8] += xmin*moments[3] + zmin*moments[1] + xmin*zmin*moments[0];
-				moments[9] += ymin*moments[3] + zmin*moments[2] + ymin*zmin*moments[0];
+				// LEFT NODE
+				treestack[ntreestack].imin = curnode.imin;
+				treestack[ntreestack].ioff = i;
+				treestack[ntreestack].jmin = curnode.jmin;
+				treestack[ntreestack].joff = curnode.joff;
+				treestack[ntreestack].kmin = curnode.kmin;
+				treestack[ntreestack].koff = curnode.koff;
+				treestack[ntreestack].gridpt[0] = curnode.gridpt[0];
+				treestack[ntreestack].gridpt[3] = curnode.gridpt[3];
+				treestack[ntreestack].gridpt[4] = curnode.gridpt[4];
+				treestack[ntreestack].gridpt[7] = curnode.gridpt[7];
+
+				// RIGHT NODE
+				treestack[ntreestack+1].imin = curnode.imin + i;
+				treestack[ntreestack+1].ioff = curnode.ioff - i;
+				treestack[ntreestack+1].jmin = curnode.jmin;
+				treestack[ntreestack+1].joff = curnode.joff;
+				treestack[ntreestack+1].kmin = curnode.kmin;
+				treestack[ntreestack+1].koff = curnode.koff;
+				treestack[ntreestack+1].gridpt[1] = curnode.gridpt[1];
+				treestack[ntreestack+1].gridpt[2] = curnode.gridpt[2];
+				treestack[ntreestack+1].gridpt[5] = curnode.gridpt[5];
+				treestack[ntreestack+1].gridpt[6] = curnode.gridpt[6];
+
+				// FILL IN COMMON POINTS
+				gpt.x = grid.d.x*(curnode.imin + i);
+				gpt.y = grid.d.y*curnode.jmin;
+				gpt.z = grid.d.z*curnode.kmin;
+				treestack[ntreestack].gridpt[1].fflags = 0x00;
+				treestack[ntreestack+1].gridpt[0].fflags = 0x00;
+				for(f = 0; f < 4; ++f) {
+					gor = faces[f].d + dot(gpt, faces[f].n);
+					treestack[ntreestack].gridpt[1].fdist[f] = gor;
+					treestack[ntreestack+1].gridpt[0].fdist[f] = gor;
+					if(gor > 0.0) {
+						treestack[ntreestack].gridpt[1].fflags |= (1 << f);
+						treestack[ntreestack+1].gridpt[0].fflags |= (1 << f);
+					}
+				}
+				gpt.y = grid.d.y*(curnode.jmin + curnode.joff);
+				treestack[ntreestack].gridpt[2].fflags = 0x00;
+				treestack[ntreestack+1].gridpt[3].fflags = 0x00;
+				for(f = 0; f < 4; ++f) {
+					gor = faces[f].d + dot(gpt, faces[f].n);
+					treestack[ntreestack].gridpt[2].fdist[f] = gor;
+					treestack[ntreestack+1].gridpt[3].fdist[f] = gor;
+					if(gor > 0.0) {
+						treestack[ntreestack].gridpt[2].fflags |= (1 << f);
+						treestack[ntreestack+1].gridpt[3].fflags |= (1 << f);
+					}
+				}
+				gpt.z = grid.d.z*(curnode.kmin + curnode.koff);
+				treestack[ntreestack].gridpt[6].fflags = 0x00;
+				treestack[ntreestack+1].gridpt[7].fflags = 0x00;
+				for(f = 0; f < 4; ++f) {
+					gor = faces[f].d + dot(gpt, faces[f].n);
+					treestack[ntreestack].gridpt[6].fdist[f] = gor;
+					treestack[ntreestack+1].gridpt[7].fdist[f] = gor;
+					if(gor > 0.0) {
+						treestack[ntreestack].gridpt[6].fflags |= (1 << f);
+						treestack[ntreestack+1].gridpt[7].fflags |= (1 << f);
+					}
+				}
+				gpt.y = grid.d.y*curnode.jmin;
+				treestack[ntreestack].gridpt[5].fflags = 0x00;
+				treestack[ntreestack+1].gridpt[4].fflags = 0x00;
+				for(f = 0; f < 4; ++f) {
+					gor = faces[f].d + dot(gpt, faces[f].n);
+					treestack[ntreestack].gridpt[5].fdist[f] = gor;
+					treestack[ntreestack+1].gridpt[4].fdist[f] = gor;
+					if(gor > 0.0) {
+						treestack[ntreestack].gridpt[5].fflags |= (1 << f);
+						treestack[ntreestack+1].gridpt[4].fflags |= (1 << f);
+					}
+				}
+				ntreestack += 2;
+				continue;
 			}
-			if(polyorder >= 1) {
-				moments[1] += xmin*moments[0];
-				moments[2] += ymin*moments[0];
-				moments[3] += zmin*moments[0];
+			if(j >= i && j >= k) {
+#ifdef PRINT_POVRAY_TREE
+				treestack[ntreestack].lvl = curnode.lvl + 1;
+				treestack[ntreestack+1].lvl = curnode.lvl + 1;
+#endif
+				// LEFT NODE
+				treestack[ntreestack].imin = curnode.imin;
+				treestack[ntreestack].ioff = curnode.ioff;
+				treestack[ntreestack].jmin = curnode.jmin;
+				treestack[ntreestack].joff = j;
+				treestack[ntreestack].kmin = curnode.kmin;
+				treestack[ntreestack].koff = curnode.koff;
+				treestack[ntreestack].gridpt[0] = curnode.gridpt[0];
+				treestack[ntreestack].gridpt[1] = curnode.gridpt[1];
+				treestack[ntreestack].gridpt[4] = curnode.gridpt[4];
+				treestack[ntreestack].gridpt[5] = curnode.gridpt[5];
+
+				// RIGHT NODE
+				treestack[ntreestack+1].imin = curnode.imin;
+				treestack[ntreestack+1].ioff = curnode.ioff;
+				treestack[ntreestack+1].jmin = curnode.jmin + j;
+				treestack[ntreestack+1].joff = curnode.joff - j;
+				treestack[ntreestack+1].kmin = curnode.kmin;
+				treestack[ntreestack+1].koff = curnode.koff;
+				treestack[ntreestack+1].gridpt[2] = curnode.gridpt[2];
+				treestack[ntreestack+1].gridpt[3] = curnode.gridpt[3];
+				treestack[ntreestack+1].gridpt[6] = curnode.gridpt[6];
+				treestack[ntreestack+1].gridpt[7] = curnode.gridpt[7];
+
+				// FILL IN COMMON POINTS
+				gpt.x = grid.d.x*curnode.imin;
+				gpt.y = grid.d.y*(curnode.jmin + j);
+				gpt.z = grid.d.z*curnode.kmin;
+				treestack[ntreestack].gridpt[3].fflags = 0x00;
+				treestack[ntreestack+1].gridpt[0].fflags = 0x00;
+				for(f = 0; f < 4; ++f) {
+					gor = faces[f].d + dot(gpt, faces[f].n);
+					treestack[ntreestack].gridpt[3].fdist[f] = gor;
+					treestack[ntreestack+1].gridpt[0].fdist[f] = gor;
+					if(gor > 0.0) {
+						treestack[ntreestack].gridpt[3].fflags |= (1 << f);
+						treestack[ntreestack+1].gridpt[0].fflags |= (1 << f);
+					}
+				}
+				gpt.x = grid.d.x*(curnode.imin + curnode.ioff);
+				treestack[ntreestack].gridpt[2].fflags = 0x00;
+				treestack[ntreestack+1].gridpt[1].fflags = 0x00;
+				for(f = 0; f < 4; ++f) {
+					gor = faces[f].d + dot(gpt, faces[f].n);
+					treestack[ntreestack].gridpt[2].fdist[f] = gor;
+					treestack[ntreestack+1].gridpt[1].fdist[f] = gor;
+					if(gor > 0.0) {
+						treestack[ntreestack].gridpt[2].fflags |= (1 << f);
+						treestack[ntreestack+1].gridpt[1].fflags |= (1 << f);
+					}
+				}
+				gpt.z = grid.d.z*(curnode.kmin + curnode.koff);
+				treestack[ntreestack].gridpt[6].fflags = 0x00;
+				treestack[ntreestack+1].gridpt[5].fflags = 0x00;
+				for(f = 0; f < 4; ++f) {
+					gor = faces[f].d + dot(gpt, faces[f].n);
+					treestack[ntreestack].gridpt[6].fdist[f] = gor;
+					treestack[ntreestack+1].gridpt[5].fdist[f] = gor;
+					if(gor > 0.0) {
+						treestack[ntreestack].gridpt[6].fflags |= (1 << f);
+						treestack[ntreestack+1].gridpt[5].fflags |= (1 << f);
+					}
+				}
+				gpt.x = grid.d.x*curnode.imin;
+				treestack[ntreestack].gridpt[7].fflags = 0x00;
+				treestack[ntreestack+1].gridpt[4].fflags = 0x00;
+				for(f = 0; f < 4; ++f) {
+					gor = faces[f].d + dot(gpt, faces[f].n);
+					treestack[ntreestack].gridpt[7].fdist[f] = gor;
+					treestack[ntreestack+1].gridpt[4].fdist[f] = gor;
+					if(gor > 0.0) {
+						treestack[ntreestack].gridpt[7].fflags |= (1 << f);
+						treestack[ntreestack+1].gridpt[4].fflags |= (1 << f);
+					}
+				}
+				ntreestack += 2;
+				continue;
 			}
-
-			// reduce to main grid
-			for(m = 0; m < 10; ++m) {
-				r3d_dest_grid[vind(i, j, k)] += moments[m]*coeffs[m];
-				current_info.momtot[m] += moments[m];
-			}	
-
-
-#ifdef PRINT_CLIP_VOXELS
-	printf("%.20e\n", (float) moments[0]);
+			if(k >= i && k >= j) {
+#ifdef PRINT_POVRAY_TREE
+				treestack[ntreestack].lvl = curnode.lvl + 1;
+				treestack[ntreestack+1].lvl = curnode.lvl + 1;
 #endif
 
-			current_info.vtot += moments[0];
-			if(moments[0] < current_info.vox_min) current_info.vox_min = moments[0];
-			if(moments[0] > current_info.vox_max) current_info.vox_max = moments[0];
-#endif // NO_REDUCTION
-
-			++current_info.num_clip;
-
-			continue;	
-		}
-
+				// LEFT NODE
+				treestack[ntreestack].imin = curnode.imin;
+				treestack[ntreestack].ioff = curnode.ioff;
+				treestack[ntreestack].jmin = curnode.jmin;
+				treestack[ntreestack].joff = curnode.joff;
+				treestack[ntreestack].kmin = curnode.kmin;
+				treestack[ntreestack].koff = k;
+				treestack[ntreestack].gridpt[0] = curnode.gridpt[0];
+				treestack[ntreestack].gridpt[1] = curnode.gridpt[1];
+				treestack[ntreestack].gridpt[2] = curnode.gridpt[2];
+				treestack[ntreestack].gridpt[3] = curnode.gridpt[3];
+
+				// RIGHT NODE
+				treestack[ntreestack+1].imin = curnode.imin;
+				treestack[ntreestack+1].ioff = curnode.ioff;
+				treestack[ntreestack+1].jmin = curnode.jmin;
+				treestack[ntreestack+1].joff = curnode.joff;
+				treestack[ntreestack+1].kmin = curnode.kmin + k;
+				treestack[ntreestack+1].koff = curnode.koff - k;
+				treestack[ntreestack+1].gridpt[4] = curnode.gridpt[4];
+				treestack[ntreestack+1].gridpt[5] = curnode.gridpt[5];
+				treestack[ntreestack+1].gridpt[6] = curnode.gridpt[6];
+				treestack[ntreestack+1].gridpt[7] = curnode.gridpt[7];
+
+				// FILL IN COMMON POINTS
+				gpt.x = grid.d.x*curnode.imin;
+				gpt.y = grid.d.y*curnode.jmin;
+				gpt.z = grid.d.z*(curnode.kmin + k);
+				treestack[ntreestack].gridpt[4].fflags = 0x00;
+				treestack[ntreestack+1].gridpt[0].fflags = 0x00;
+				for(f = 0; f < 4; ++f) {
+					gor = faces[f].d + dot(gpt, faces[f].n);
+					treestack[ntreestack].gridpt[4].fdist[f] = gor;
+					treestack[ntreestack+1].gridpt[0].fdist[f] = gor;
+					if(gor > 0.0) {
+						treestack[ntreestack].gridpt[4].fflags |= (1 << f);
+						treestack[ntreestack+1].gridpt[0].fflags |= (1 << f);
+					}
+				}
+				gpt.x = grid.d.x*(curnode.imin + curnode.ioff);
+				treestack[ntreestack].gridpt[5].fflags = 0x00;
+				treestack[ntreestack+1].gridpt[1].fflags = 0x00;
+				for(f = 0; f < 4; ++f) {
+					gor = faces[f].d + dot(gpt, faces[f].n);
+					treestack[ntreestack].gridpt[5].fdist[f] = gor;
+					treestack[ntreestack+1].gridpt[1].fdist[f] = gor;
+					if(gor > 0.0) {
+						treestack[ntreestack].gridpt[5].fflags |= (1 << f);
+						treestack[ntreestack+1].gridpt[1].fflags |= (1 << f);
+					}
+				}
+				gpt.y = grid.d.y*(curnode.jmin + curnode.joff);
+				treestack[ntreestack].gridpt[6].fflags = 0x00;
+				treestack[ntreestack+1].gridpt[2].fflags = 0x00;
+				for(f = 0; f < 4; ++f) {
+					gor = faces[f].d + dot(gpt, faces[f].n);
+					treestack[ntreestack].gridpt[6].fdist[f] = gor;
+					treestack[ntreestack+1].gridpt[2].fdist[f] = gor;
+					if(gor > 0.0) {
+						treestack[ntreestack].gridpt[6].fflags |= (1 << f);
+						treestack[ntreestack+1].gridpt[2].fflags |= (1 << f);
+					}
+				}
+				gpt.x = grid.d.x*curnode.imin;
+				treestack[ntreestack].gridpt[7].fflags = 0x00;
+				treestack[ntreestack+1].gridpt[3].fflags = 0x00;
+				for(f = 0; f < 4; ++f) {
+					gor = faces[f].d + dot(gpt, faces[f].n);
+					treestack[ntreestack].gridpt[7].fdist[f] = gor;
+					treestack[ntreestack+1].gridpt[3].fdist[f] = gor;
+					if(gor > 0.0) {
+						treestack[ntreestack].gridpt[7].fflags |= (1 << f);
+						treestack[ntreestack+1].gridpt[3].fflags |= (1 << f);
+					}
+				}
+				ntreestack += 2;
+				continue;
+			}
 #ifdef PRINT_POVRAY_TREE
 		if(curnode.lvl == TREELVL) {
 
@@ -760,8 +998,8 @@ void r3d_voxelize_tet(r3d_plane faces[4], r3d_dest_grid grid) {
 	printf("}\n");
 #endif
 
-#endif // USE_TREE
-
+	return info;
+#undef r3d_store_cell
 }
 
 #ifndef PRINT_POVRAY_TRAVERSAL
@@ -1013,6 +1251,308 @@ inline void r3d_reduce(r3d_vertex* vertbuffer, r3d_int* nverts, r3d_real* moment
 
 }
 
+//////////////////////////////////////////////////////////////////
+//////////////// r3d mesh ////////////////////////////////////////
+//////////////////////////////////////////////////////////////////
+
+// One thread's share of a mesh: tets tbegin through tend, added into
+// moment grids img that cover dest slabs ioff through ioff + ni. When
+// reducing, a job instead sums every job's img onto dest slabs rbegin
+// through rend.
+typedef struct {
+	r3d_real* verts;
+	r3d_long* tets;
+	r3d_long tbegin, tend;
+	r3d_real* img[10];
+	r3d_int ioff, ni;
+	r3d_int rbegin, rend;
+	r3d_dest_grid grid;
+	r3d_int njobs;
+	void* jobs;
+	r3d_info info;
+} r3d_mesh_job;
+
+// accumulates the per-tet stats into the mesh-wide info
+static void r3d_mesh_info(r3d_info* minfo, r3d_info tinfo) {
+	if(!tinfo.good) minfo->good = 0;
+	minfo->vtot += tinfo.vtot;
+	if(tinfo.vox_min < minfo->vox_min) minfo->vox_min = tinfo.vox_min;
+	if(tinfo.vox_max > minfo->vox_max) minfo->vox_max = tinfo.vox_max;
+	minfo->num_in += tinfo.num_in;
+	minfo->num_clip += tinfo.num_clip;
+	minfo->num_out += tinfo.num_out;
+	minfo->ntree += tinfo.ntree;
+	minfo->nflat += tinfo.nflat;
+	minfo->ntets += tinfo.ntets;
+}
+
+// cell index range covered by a tet, clipped to the grid
+static void r3d_mesh_bounds(r3d_rvec3 tet[4], r3d_dest_grid* grid, r3d_dvec3* lo, r3d_dvec3* hi) {
+	r3d_int v;
+	r3d_rvec3 rmin = tet[0], rmax = tet[0];
+	for(v = 1; v < 4; ++v) {
+		if(tet[v].x < rmin.x) rmin.x = tet[v].x;
+		if(tet[v].y < rmin.y) rmin.y = tet[v].y;
+		if(tet[v].z < rmin.z) rmin.z = tet[v].z;
+		if(tet[v].x > rmax.x) rmax.x = tet[v].x;
+		if(tet[v].y > rmax.y) rmax.y = tet[v].y;
+		if(tet[v].z > rmax.z) rmax.z = tet[v].z;
+	}
+	lo->i = floor(rmin.x/grid->d.x);
+	lo->j = floor(rmin.y/grid->d.y);
+	lo->k = floor(rmin.z/grid->d.z);
+	hi->i = ceil(rmax.x/grid->d.x);
+	hi->j = ceil(rmax.y/grid->d.y);
+	hi->k = ceil(rmax.z/grid->d.z);
+	if(lo->i < 0) lo->i = 0;
+	if(lo->j < 0) lo->j = 0;
+	if(lo->k < 0) lo->k = 0;
+	if(hi->i > grid->n.i) hi->i = grid->n.i;
+	if(hi->j > grid->n.j) hi->j = grid->n.j;
+	if(hi->k > grid->n.k) hi->k = grid->n.k;
+}
+
+// gathers tet t of the mesh, flipped if needed to be positively oriented
+static void r3d_mesh_tet(r3d_real* verts, r3d_long* tets, r3d_long t, r3d_rvec3 tet[4]) {
+	r3d_int v;
+	r3d_rvec3 tmp;
+	for(v = 0; v < 4; ++v) {
+		tet[v].x = verts[3*tets[4*t + v]];
+		tet[v].y = verts[3*tets[4*t + v] + 1];
+		tet[v].z = verts[3*tets[4*t + v] + 2];
+	}
+	if(r3du_orient(tet[0], tet[1], tet[2], tet[3]) < 0.0) {
+		tmp = tet[2];
+		tet[2] = tet[3];
+		tet[3] = tmp;
+	}
+}
+
+static void* r3d_voxelize_tets(void* arg) {
+
+	r3d_mesh_job* job = (r3d_mesh_job*) arg;
+	r3d_dest_grid* grid = &job->grid;
+	r3d_int v, m, mmax, a, b, c;
+	r3d_long t, plen = 0, olen = 0, need, pind, gind;
+	r3d_real xmin, xmax;
+	r3d_real moments[10];
+	r3d_real* pbuf = NULL;
+	r3d_dvec3 lo, hi;
+	r3d_rvec3 tet[4], off;
+	r3d_plane faces[4];
+	r3d_dest_grid patch;
+	r3d_info tinfo;
+
+	mmax = r3d_num_moments[grid->polyorder];
+
+	// without grids of its own, a job gets partial ones
+	// spanning just the slabs its tets can touch
+	if(!job->img[0]) {
+		xmin = 1.0e99;
+		xmax = -1.0e99;
+		for(t = job->tbegin; t < job->tend; ++t)
+		for(v = 0; v < 4; ++v) {
+			if(job->verts[3*job->tets[4*t + v]] < xmin) xmin = job->verts[3*job->tets[4*t + v]];
+			if(job->verts[3*job->tets[4*t + v]] > xmax) xmax = job->verts[3*job->tets[4*t + v]];
+		}
+		job->ioff = floor(xmin/grid->d.x);
+		job->ni = ceil(xmax/grid->d.x);
+		if(job->ioff < 0) job->ioff = 0;
+		if(job->ni > grid->n.i) job->ni = grid->n.i;
+		job->ni -= job->ioff;
+		if(job->ni <= 0) return NULL;
+		for(m = 0; m < mmax; ++m) {
+			job->img[m] = (r3d_real*) calloc((r3d_long) job->ni*grid->n.j*grid->n.k, sizeof(r3d_real));
+			if(!job->img[m]) {
+				job->info.good = 0;
+				return NULL;
+			}
+		}
+	}
+
+	// each tet is voxelized onto the patch of the grid under its bounding
+	// box, which only needs two slabs of orientations
+	patch = *grid;
+	patch.mode |= R3D_STREAM;
+	patch.orient = NULL;
+	for(t = job->tbegin; t < job->tend; ++t) {
+
+		r3d_mesh_tet(job->verts, job->tets, t, tet);
+		r3d_mesh_bounds(tet, grid, &lo, &hi);
+		patch.n.i = hi.i - lo.i;
+		patch.n.j = hi.j - lo.j;
+		patch.n.k = hi.k - lo.k;
+		if(patch.n.i <= 0 || patch.n.j <= 0 || patch.n.k <= 0) continue;
+
+		// grow the patch buffers as needed
+		need = (r3d_long) patch.n.i*patch.n.j*patch.n.k;
+		if(need > plen) {
+			if(pbuf) free(pbuf);
+			plen = 2*need;
+			pbuf = (r3d_real*) malloc(mmax*plen*sizeof(r3d_real));
+		}
+		need = 2*(r3d_long)(patch.n.j+1)*(patch.n.k+1);
+		if(need > olen) {
+			if(patch.orient) free(patch.orient);
+			olen = 2*need;
+			patch.orient = (r3d_orientation*) malloc(olen*sizeof(r3d_orientation));
+		}
+		if(!pbuf || !patch.orient) {
+			job->info.good = 0;
+			break;
+		}
+		for(m = 0; m < mmax; ++m)
+			patch.moments[m] = pbuf + m*plen;
+
+		// shift the tet onto the patch
+		for(v = 0; v < 4; ++v) {
+			tet[v].x -= lo.i*grid->d.x;
+			tet[v].y -= lo.j*grid->d.y;
+			tet[v].z -= lo.k*grid->d.z;
+		}
+		r3du_tet_faces_from_verts(tet, faces);
+		tinfo = r3d_voxelize_tet(faces, patch);
+		tinfo.ntets = 1;
+		r3d_mesh_info(&job->info, tinfo);
+
+		// without reduction the patch cells inside the tet are never
+		// written, so there is nothing to add
+		if((patch.mode | r3d_forced_mode) & R3D_NO_REDUCTION) continue;
+
+		// add the patch onto the grid, moving the origin of
+		// the moments back from the patch corner
+		off.x = lo.i*grid->d.x;
+		off.y = lo.j*grid->d.y;
+		off.z = lo.k*grid->d.z;
+		for(a = 0; a < patch.n.i; ++a)
+		for(b = 0; b < patch.n.j; ++b)
+		for(c = 0; c < patch.n.k; ++c) {
+			pind = ((r3d_long) a*patch.n.j + b)*patch.n.k + c;
+			gind = ((r3d_long)(lo.i - job->ioff + a)*grid->n.j + lo.j + b)*grid->n.k + lo.k + c;
+			for(m = 0; m < mmax; ++m)
+				moments[m] = patch.moments[m][pind];
+			r3d_shift_moments(moments, grid->polyorder, off);
+			for(m = 0; m < mmax; ++m)
+				job->img[m][gind] += moments[m];
+		}
+	}
+	if(pbuf) free(pbuf);
+	if(patch.orient) free(patch.orient);
+	return NULL;
+}
+
+// adds the partial grids onto dest slabs rbegin through rend,
+// always in job order so that the result does not depend on timing
+static void* r3d_mesh_reduce(void* arg) {
+
+	r3d_mesh_job* job = (r3d_mesh_job*) arg;
+	r3d_mesh_job* jobs = (r3d_mesh_job*) job->jobs;
+	r3d_int t, m, i, ilo, ihi;
+	r3d_long c, slab = (r3d_long) job->grid.n.j*job->grid.n.k;
+
+	for(t = 0; t < job->njobs; ++t) {
+		if(!jobs[t].img[0]) continue;
+		ilo = jobs[t].ioff;
+		ihi = jobs[t].ioff + jobs[t].ni;
+		if(ilo < job->rbegin) ilo = job->rbegin;
+		if(ihi > job->rend) ihi = job->rend;
+		for(m = 0; m < r3d_num_moments[job->grid.polyorder]; ++m)
+		for(i = ilo; i < ihi; ++i)
+		for(c = 0; c < slab; ++c)
+			job->img[m][slab*i + c] += jobs[t].img[m][slab*(i - jobs[t].ioff) + c];
+	}
+	return NULL;
+}
+
+// runs fn over all jobs, one thread each, the first on the calling thread.
+// Falls back to running a job in place if its thread can't be started.
+static void r3d_mesh_run(void* (*fn)(void*), r3d_mesh_job* jobs, r3d_int njobs) {
+	r3d_int t;
+	unsigned char* started = (unsigned char*) calloc(njobs, 1);
+	pthread_t* threads = (pthread_t*) malloc(njobs*sizeof(pthread_t));
+	for(t = 1; t < njobs; ++t)
+		if(started && threads)
+			started[t] = !pthread_create(&threads[t], NULL, fn, (void*) &jobs[t]);
+	fn((void*) &jobs[0]);
+	for(t = 1; t < njobs; ++t) {
+		if(started && started[t]) pthread_join(threads[t], NULL);
+		else fn((void*) &jobs[t]);
+	}
+	if(started) free(started);
+	if(threads) free(threads);
+}
+
+r3d_info r3d_voxelize_mesh(r3d_real* verts, r3d_long* tets, r3d_long ntets, r3d_dest_grid grid,
+		r3d_int nthreads) {
+
+	r3d_int t, m, mmax;
+	r3d_info minfo;
+	r3d_mesh_job* jobs;
+	r3d_mesh_job* reds;
+	struct timespec t0, t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	memset(&minfo, 0, sizeof(r3d_info));
+	minfo.good = 1;
+	minfo.vox_min = 1.0e99;
+	minfo.vox_max = -1.0e99;
+	if(grid.polyorder < 0 || grid.polyorder > 2 || grid.n.i <= 0 || grid.n.j <= 0 || grid.n.k <= 0) {
+		minfo.good = 0;
+		return minfo;
+	}
+	mmax = r3d_num_moments[grid.polyorder];
+
+	if(nthreads <= 0) nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if(nthreads > ntets) nthreads = ntets;
+	if(nthreads > grid.n.i) nthreads = grid.n.i;
+	if(nthreads < 1) nthreads = 1;
+
+	// neighbouring tets add onto the same cells, so with more than one
+	// thread each job voxelizes into partial grids of its own. These are
+	// then summed onto the destination in parallel, over disjoint slabs.
+	jobs = (r3d_mesh_job*) calloc(nthreads, sizeof(r3d_mesh_job));
+	reds = (r3d_mesh_job*) calloc(nthreads, sizeof(r3d_mesh_job));
+	if(!jobs || !reds) {
+		if(jobs) free(jobs);
+		if(reds) free(reds);
+		minfo.good = 0;
+		return minfo;
+	}
+	for(t = 0; t < nthreads; ++t) {
+		jobs[t].verts = verts;
+		jobs[t].tets = tets;
+		jobs[t].tbegin = (ntets*t)/nthreads;
+		jobs[t].tend = (ntets*(t + 1))/nthreads;
+		jobs[t].grid = grid;
+		jobs[t].info = minfo;
+		if(nthreads == 1)
+			for(m = 0; m < mmax; ++m) jobs[t].img[m] = grid.moments[m];
+		reds[t].grid = grid;
+		for(m = 0; m < mmax; ++m) reds[t].img[m] = grid.moments[m];
+		reds[t].rbegin = ((r3d_long) grid.n.i*t)/nthreads;
+		reds[t].rend = ((r3d_long) grid.n.i*(t + 1))/nthreads;
+		reds[t].njobs = nthreads;
+		reds[t].jobs = (void*) jobs;
+	}
+	r3d_mesh_run(r3d_voxelize_tets, jobs, nthreads);
+	if(nthreads > 1) {
+		r3d_mesh_run(r3d_mesh_reduce, reds, nthreads);
+		for(t = 0; t < nthreads; ++t)
+		for(m = 0; m < mmax; ++m)
+			if(jobs[t].img[m]) free(jobs[t].img[m]);
+	}
+
+	// collect the per-job stats, in job order
+	for(t = 0; t < nthreads; ++t)
+		r3d_mesh_info(&minfo, jobs[t].info);
+	free(jobs);
+	free(reds);
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	minfo.seconds = (t1.tv_sec - t0.tv_sec) + 1.0e-9*(t1.tv_nsec - t0.tv_nsec);
+	return minfo;
+}
+
 //////////////////////////////////////////////////////////////////
 //////////////// r3du: utility functions for r3d /////////////////
 //////////////////////////////////////////////////////////////////
@@ -108,6 +108,46 @@ typedef struct {
 			k; /*!< \f$z\f$-index. */
 } r3d_dvec3;
 
+/**
+ * \brief Flags selecting the voxelization algorithm, mostly for timing and precision checks.
+ *
+ * R3D_TREE searches the cells of each tet with an octree instead of checking them all,
+ * and the others turn off cell shifting, clipping, and the computation of moments.
+ * Compiling with `-DUSE_TREE`, `-DNO_SHIFTING`, etc. turns the matching flag on for good.
+ * R3D_STREAM keeps only two i-slabs of gridpoint orientations, so that the orient
+ * buffer needs 2*(n.y+1)*(n.z+1) entries rather than (n.x+1)*(n.y+1)*(n.z+1).
+ * The moments are the same either way.
+ */
+#define R3D_TREE 0x01
+#define R3D_NO_SHIFTING 0x02
+#define R3D_NO_CLIPPING 0x04
+#define R3D_NO_REDUCTION 0x08
+#define R3D_STREAM 0x10
+
+/**
+ * \brief Default number of cells in a patch above which the octree is used even without R3D_TREE.
+ *
+ * Below this, a flat scan of the patch is faster. See r3d_dest_grid.tree_threshold.
+ */
+#define R3D_TREE_THRESHOLD 32768
+
+/** \struct r3d_info
+ *  \brief Statistics returned by r3d_voxelize_tet().
+ */
+typedef struct {
+	r3d_int good; /*!< 0 if the grid was unusable (no orientation buffer without R3D_TREE). */
+	r3d_real vtot; /*!< Total volume voxelized. */
+	r3d_real vox_min; /*!< Smallest volume in a cell that was not skipped. */
+	r3d_real vox_max; /*!< Largest volume in a cell. */
+	r3d_long num_in; /*!< Number of cells fully inside the tet. */
+	r3d_long num_clip; /*!< Number of cells straddling its boundary, which were clipped. */
+	r3d_long num_out; /*!< Number of cells fully outside of it. */
+	r3d_long ntree; /*!< Number of tets whose cells were searched with the octree. */
+	r3d_long nflat; /*!< Number of tets whose whole patch was scanned. */
+	r3d_long ntets; /*!< Number of tets voxelized by r3d_voxelize_mesh(), skipping those off the grid. */
+	r3d_real seconds; /*!< Wall-clock time taken by r3d_voxelize_mesh(), for tets per second. */
+} r3d_info;
+
 /** \struct r3d_dest_grid
  *  \brief Destination grid information.
  */
@@ -116,17 +156,21 @@ typedef struct {
 							   Must be at least n.x*n.y*n.z in size. */ 
 	r3d_int polyorder; /*!< Polynomial order (0 for constant, 1 for linear, 2 for quadratic) to be voxelized. */
 	r3d_orientation* orient; /*!< Buffer for gridpoint orientation checks.
-							   Must be at least (n.x+1)*(n.y+1)*(n.z+1) in size.
-							   Unused if compiled with -DUSE_TREE.*/ 
+							   Must be at least (n.x+1)*(n.y+1)*(n.z+1) in size,
+							   or 2*(n.y+1)*(n.z+1) with R3D_STREAM.
+							   Unused with R3D_TREE.*/ 
 	r3d_long bufsz; /*!< Allocated size of moments and orient buffers. */
 	r3d_dvec3 n; /*!< Grid dimensions (cells per coordinate). */
 	r3d_rvec3 d; /*!< Grid cell size. */
+	r3d_int mode; /*!< Algorithm flags (see R3D_TREE), 0 for the default. */
+	r3d_long tree_threshold; /*!< Number of cells from which to use the octree without R3D_TREE.
+							   0 for R3D_TREE_THRESHOLD, negative for never. */
 } r3d_dest_grid;
 
 /**
  * \brief Tabulated number of moments needed for a given polynomial order.
  */
-const static r3d_int r3d_num_moments[3] = {1, 4, 10};
+static const r3d_int r3d_num_moments[3] = {1, 4, 10};
 
 /**
  * \brief Voxelize a tetrahedron to the destination grid
@@ -136,8 +180,50 @@ const static r3d_int r3d_num_moments[3] = {1, 4, 10};
  * \param [in] faces
  * The four faces of the tetrahedron to be voxelized.
  *
+ * \param [in] grid
+ * The destination grid. Every cell of it is overwritten, except with R3D_NO_REDUCTION,
+ * which only zeroes the cells outside the tet and leaves the others as they were.
+ *
+ * \return r3d_info with the voxelized volume and how many cells were inside, clipped, or outside
+ *
+ */
+r3d_info r3d_voxelize_tet(r3d_plane faces[4], r3d_dest_grid grid);
+
+/**
+ * \brief Voxelize a whole tetrahedral mesh to the destination grid
+ *
+ * Adds the moments of every tet in a mesh onto the destination grid, whose existing
+ * values are kept. Grid cell (i, j, k) spans i*d.x through (i+1)*d.x, and so on, and the
+ * parts of tets outside of the grid are dropped. Tets may have either orientation.
+ *
+ * The tets are split evenly among nthreads threads (all online cores if nthreads <= 0),
+ * each voxelizing onto small patches with its own buffers. With more than one thread, each
+ * also needs partial moment grids spanning the x-range of its tets. These are summed onto
+ * the destination in thread order, so the result does not depend on thread timing, though
+ * it may differ in the last bits between different thread counts.
+ *
+ * \param [in] verts
+ * Vertex positions, nverts x 3 in row-major order.
+ *
+ * \param [in] tets
+ * Vertex indices of each tet, ntets x 4 in row-major order.
+ *
+ * \param [in] ntets
+ * Number of tets in the mesh.
+ *
+ * \param [in] grid
+ * The destination grid, with its moments, polyorder, n, d, and mode. Its orient buffer is
+ * not used.
+ *
+ * \param [in] nthreads
+ * Number of threads to use.
+ *
+ * \return r3d_info summed over the mesh, with the number of tets voxelized and the
+ * time taken
+ *
  */
-void r3d_voxelize_tet(r3d_plane faces[4], r3d_dest_grid grid);
+r3d_info r3d_voxelize_mesh(r3d_real* verts, r3d_long* tets, r3d_long ntets, r3d_dest_grid grid,
+		r3d_int nthreads);
 
 
 void r3d_clip_tet(r3d_vertex* vertbuffer, r3d_int* nverts, unsigned char andcmp);
@@ -9,6 +9,8 @@ TODO: Add method for adding sources
 TODO: If there are greater than some number of vertex columns or rows, make sure you don't plot the vertex lines by default (except for plot_vertices, of course)
 """
 
+import inspect
+
 import numpy as np
 import matplotlib.pyplot as plt
 
@@ -63,6 +65,15 @@ def init_grid(
     centroids = vertex_centroids(vertices)
 
     # create fluxes
+    fluxes = evaluate_flux_func(flux_func, centroids, **kwargs)
+
+    return vertices, centroids, fluxes
+
+
+def evaluate_flux_func(flux_func, centroids, **kwargs):
+    """
+    f[i, j] = flux_func(centroids[i, j])
+    """
     # check if input flux_func is a function without needing galsim
     if type(flux_func) == type(np.sum):
         fluxes = flux_func(centroids, **kwargs)
@@ -89,7 +100,36 @@ def init_grid(
                 "youve got galsim installed, but your flux_func still wasnt a function or a galsim GSObject"
             )
 
-    return vertices, centroids, fluxes
+    return fluxes
+
+
+def taylor_coefficients(flux_func, centroids, pixel_scale, polyorder=2, **kwargs):
+    """
+    c[i, j] are the coefficients of 1, x, y (, x*x, y*y, x*y) of flux_func
+    about centroids[i, j], with x and y in pixels of size pixel_scale.
+    Derivatives come from central differences half a pixel out, so they are
+    exact for quadratic flux_funcs. See r2d.deposit_polynomial
+    """
+    h = 0.5
+    sx = np.array([h * pixel_scale[0], 0])
+    sy = np.array([0, h * pixel_scale[1]])
+
+    def f(offset):
+        return evaluate_flux_func(flux_func, centroids + offset, **kwargs)
+
+    f0 = f(0)
+    fxp = f(sx)
+    fxm = f(-sx)
+    fyp = f(sy)
+    fym = f(-sy)
+    coefficients = [f0, (fxp - fxm) / (2 * h), (fyp - fym) / (2 * h)]
+    if polyorder >= 2:
+        coefficients += [
+            (fxp - 2 * f0 + fxm) / (2 * h * h),
+            (fyp - 2 * f0 + fym) / (2 * h * h),
+            (f(sx + sy) - f(sx - sy) - f(sy - sx) + f(-sx - sy)) / (4 * h * h),
+        ]
+    return np.dstack(coefficients)
 
 
 def vertex_centroids(vertices):
@@ -162,7 +202,7 @@ class Source(object):
     Class shell.
     """
 
-    def __init__(self, num_x, **kwargs):
+    def __init__(self, num_x, polyorder=0, **kwargs):
         self.vertices, self.centroids, self.fluxes = init_grid(num_x, **kwargs)
 
         # this makes it easier to convert
@@ -173,6 +213,23 @@ class Source(object):
         self.x_max = self.vertices[:, :, 0].max()
         self.y_max = self.vertices[:, :, 1].max()
 
+        # with polyorder > 0, also keep a linear or quadratic model of
+        # flux_func within each pixel, which can be deposited exactly
+        self.coefficients = None
+        if polyorder > 0:
+            flux_kwargs = {
+                key: kwargs[key]
+                for key in kwargs
+                if key not in inspect.signature(init_grid).parameters
+            }
+            self.coefficients = taylor_coefficients(
+                kwargs.get("flux_func", zero_flux_func),
+                self.centroids,
+                self.r1 - self.r0,
+                polyorder=polyorder,
+                **flux_kwargs
+            )
+
         self.psf_evaluator = Moment_Evaluator()
 
     def check_vertices(self):